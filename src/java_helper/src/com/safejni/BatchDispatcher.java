@@ -0,0 +1,195 @@
+package com.safejni;
+
+import java.lang.reflect.InvocationTargetException;
+import java.lang.reflect.Method;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.Charset;
+import java.util.Arrays;
+import java.util.ArrayList;
+import java.util.HashMap;
+
+/*
+ * Replays the static void calls recorded by a safejni::CallRecorder.
+ * Every call is an int method index followed by its arguments: primitives in native byte order and strings
+ * as an int byte count plus UTF-8 bytes. Methods are resolved once per recorder and cached by index.
+ * Replay boxes the arguments and goes through Method.invoke: a batch saves the JNI transitions, not the
+ * reflective call. MethodHandles would avoid it but need API 26, which the library doesn't require.
+*/
+public final class BatchDispatcher
+{
+    private static final Charset UTF8 = Charset.forName("UTF-8");
+    private static final HashMap<Long, ArrayList<RecordedMethod>> _recorders = new HashMap<Long, ArrayList<RecordedMethod>>();
+    private static byte[] _scratch = new byte[256];
+
+    private BatchDispatcher() {
+    }
+
+    //called by native before a batch: class, name and signature of the methods registered since the previous one
+    static synchronized void define(long recorder, String[] definitions) {
+        ArrayList<RecordedMethod> methods = _recorders.get(recorder);
+        if (methods == null) {
+            methods = new ArrayList<RecordedMethod>();
+            _recorders.put(recorder, methods);
+        }
+        for (int i = 0; i + 2 < definitions.length; i += 3) {
+            //unresolved methods keep their index, the calls to them fail when replayed
+            methods.add(RecordedMethod.resolve(definitions[i], definitions[i + 1], definitions[i + 2]));
+        }
+    }
+
+    //called by native when the recorder is destroyed
+    static synchronized void release(long recorder) {
+        _recorders.remove(recorder);
+    }
+
+    static synchronized void dispatch(long recorder, ByteBuffer buffer, int count) throws Throwable {
+        ArrayList<RecordedMethod> methods = _recorders.get(recorder);
+        buffer.order(ByteOrder.nativeOrder());
+        Throwable error = null;
+        for (int i = 0; i < count; ++i) {
+            RecordedMethod method = methods.get(buffer.getInt());
+            //the array is only read by invoke, so it is reused by every call to the method
+            Object[] args = method.args;
+            for (int j = 0; j < args.length; ++j) {
+                args[j] = read(buffer, method.parameters[j]);
+            }
+            try {
+                method.invoke(args);
+            }
+            catch (Throwable e) {
+                //the remaining calls are still replayed, the first error is reported to native
+                if (error == null) {
+                    error = e;
+                }
+            }
+            Arrays.fill(args, null);
+        }
+        if (error != null) {
+            throw error;
+        }
+    }
+
+    private static Object read(ByteBuffer buffer, Class<?> type) {
+        if (type == int.class) {
+            return buffer.getInt();
+        }
+        if (type == long.class) {
+            return buffer.getLong();
+        }
+        if (type == float.class) {
+            return buffer.getFloat();
+        }
+        if (type == double.class) {
+            return buffer.getDouble();
+        }
+        if (type == boolean.class) {
+            return buffer.get() != 0;
+        }
+        if (type == byte.class) {
+            return buffer.get();
+        }
+        if (type == short.class) {
+            return buffer.getShort();
+        }
+        if (type == char.class) {
+            return buffer.getChar();
+        }
+        int length = buffer.getInt();
+        if (_scratch.length < length) {
+            _scratch = new byte[Math.max(length, _scratch.length * 2)];
+        }
+        buffer.get(_scratch, 0, length);
+        return new String(_scratch, 0, length, UTF8);
+    }
+
+    private static final class RecordedMethod
+    {
+        final Method method;
+        final Class<?>[] parameters;
+        final Object[] args;
+        final String description;
+
+        RecordedMethod(Method method, Class<?>[] parameters, String description) {
+            this.method = method;
+            this.parameters = parameters;
+            this.args = new Object[parameters.length];
+            this.description = description;
+        }
+
+        static RecordedMethod resolve(String className, String name, String signature) {
+            String description = className + "." + name + signature;
+            try {
+                Class<?> clazz = Class.forName(className.replace('/', '.'), true, BatchDispatcher.class.getClassLoader());
+                for (Method method: clazz.getDeclaredMethods()) {
+                    if (method.getName().equals(name) && signature.equals(signature(method))) {
+                        method.setAccessible(true);
+                        return new RecordedMethod(method, method.getParameterTypes(), description);
+                    }
+                }
+            }
+            catch (Throwable e) {
+                // reported when the method is called, define must not fail or the method indexes would shift
+            }
+            return new RecordedMethod(null, parameters(signature), description);
+        }
+
+        void invoke(Object[] args) throws Throwable {
+            if (method == null) {
+                throw new NoSuchMethodError(description);
+            }
+            try {
+                method.invoke(null, args);
+            }
+            catch (InvocationTargetException e) {
+                throw e.getCause();
+            }
+        }
+
+        private static String signature(Method method) {
+            StringBuilder builder = new StringBuilder("(");
+            for (Class<?> type: method.getParameterTypes()) {
+                builder.append(descriptor(type));
+            }
+            return builder.append(")").append(descriptor(method.getReturnType())).toString();
+        }
+
+        private static String descriptor(Class<?> type) {
+            if (type.isArray()) {
+                return type.getName().replace('.', '/');
+            }
+            if (type == int.class) return "I";
+            if (type == long.class) return "J";
+            if (type == float.class) return "F";
+            if (type == double.class) return "D";
+            if (type == boolean.class) return "Z";
+            if (type == byte.class) return "B";
+            if (type == short.class) return "S";
+            if (type == char.class) return "C";
+            if (type == void.class) return "V";
+            return "L" + type.getName().replace('.', '/') + ";";
+        }
+
+        //parameter types of a method that could not be resolved, so its arguments can still be skipped
+        private static Class<?>[] parameters(String signature) {
+            ArrayList<Class<?>> types = new ArrayList<Class<?>>();
+            for (int i = 1; signature.charAt(i) != ')'; ++i) {
+                switch (signature.charAt(i)) {
+                    case 'I': types.add(int.class); break;
+                    case 'J': types.add(long.class); break;
+                    case 'F': types.add(float.class); break;
+                    case 'D': types.add(double.class); break;
+                    case 'Z': types.add(boolean.class); break;
+                    case 'B': types.add(byte.class); break;
+                    case 'S': types.add(short.class); break;
+                    case 'C': types.add(char.class); break;
+                    default:
+                        types.add(String.class);
+                        i = signature.indexOf(';', i);
+                        break;
+                }
+            }
+            return types.toArray(new Class<?>[types.size()]);
+        }
+    }
+}
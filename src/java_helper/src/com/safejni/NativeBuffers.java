@@ -0,0 +1,66 @@
+package com.safejni;
+
+import java.lang.ref.PhantomReference;
+import java.lang.ref.Reference;
+import java.lang.ref.ReferenceQueue;
+import java.nio.ByteBuffer;
+import java.util.HashSet;
+
+/*
+ * Keeps native memory exposed to Java as direct ByteBuffers alive.
+ * C++ registers every ByteBuffer created from a safejni::NativeBuffer, and the native handle is released
+ * from a daemon thread once the ByteBuffer has been garbage collected.
+*/
+public final class NativeBuffers
+{
+    private static final ReferenceQueue<ByteBuffer> _queue = new ReferenceQueue<ByteBuffer>();
+    private static final HashSet<BufferReference> _references = new HashSet<BufferReference>();
+
+    static {
+        Thread thread = new Thread(new Runnable() {
+            @Override
+            public void run() {
+                while (true) {
+                    try {
+                        Reference<? extends ByteBuffer> reference = _queue.remove();
+                        release((BufferReference)reference);
+                    }
+                    catch (InterruptedException e) {
+                        // keep waiting for collected buffers
+                    }
+                }
+            }
+        }, "SafeJNI-NativeBuffers");
+        thread.setDaemon(true);
+        thread.start();
+    }
+
+    private NativeBuffers() {
+    }
+
+    //called by native
+    public static void track(ByteBuffer buffer, long handle) {
+        synchronized (_references) {
+            _references.add(new BufferReference(buffer, handle));
+        }
+    }
+
+    private static void release(BufferReference reference) {
+        synchronized (_references) {
+            _references.remove(reference);
+        }
+        nativeRelease(reference.handle);
+    }
+
+    private static final class BufferReference extends PhantomReference<ByteBuffer>
+    {
+        final long handle;
+
+        BufferReference(ByteBuffer buffer, long handle) {
+            super(buffer, _queue);
+            this.handle = handle;
+        }
+    }
+
+    private static native void nativeRelease(long handle);
+}
@@ -0,0 +1,82 @@
+package com.safejni;
+
+import java.io.Closeable;
+import java.lang.reflect.InvocationHandler;
+import java.lang.reflect.Method;
+import java.lang.reflect.Proxy;
+
+/*
+ * Java side of a C++ std::function. Every callback created by C++ goes through the same native entry point,
+ * identified by the handle of the function in the native callback table.
+ * The function is released when the callback is closed or garbage collected.
+*/
+public final class NativeCallback implements Runnable, InvocationHandler, Closeable
+{
+    private long _handle;
+
+    //called by native
+    NativeCallback(long handle) {
+        _handle = handle;
+    }
+
+    //called by native: implements a single method interface with this callback
+    static Object proxy(Class<?> iface, NativeCallback callback) {
+        return Proxy.newProxyInstance(iface.getClassLoader(), new Class<?>[] {iface}, callback);
+    }
+
+    public Object call(Object... args) {
+        long handle;
+        synchronized (this) {
+            handle = _handle;
+        }
+        if (handle == 0) {
+            throw new IllegalStateException("The native callback has been closed");
+        }
+        return nativeInvoke(handle, args);
+    }
+
+    @Override
+    public void run() {
+        call();
+    }
+
+    @Override
+    public Object invoke(Object proxy, Method method, Object[] args) {
+        if (method.getDeclaringClass() == Object.class) {
+            String name = method.getName();
+            if (name.equals("equals")) {
+                return proxy == args[0];
+            }
+            if (name.equals("hashCode")) {
+                return System.identityHashCode(proxy);
+            }
+            return "NativeCallback@" + Integer.toHexString(System.identityHashCode(proxy));
+        }
+        return call(args != null ? args : new Object[0]);
+    }
+
+    @Override
+    public void close() {
+        long handle;
+        synchronized (this) {
+            handle = _handle;
+            _handle = 0;
+        }
+        if (handle != 0) {
+            nativeRelease(handle);
+        }
+    }
+
+    @Override
+    protected void finalize() throws Throwable {
+        try {
+            close();
+        }
+        finally {
+            super.finalize();
+        }
+    }
+
+    private static native Object nativeInvoke(long handle, Object[] args);
+    private static native void nativeRelease(long handle);
+}
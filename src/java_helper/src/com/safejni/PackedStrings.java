@@ -0,0 +1,74 @@
+package com.safejni;
+
+import java.util.HashMap;
+import java.util.Map;
+
+/*
+ * Java side of the packed String[] transfer used by SafeJNI.
+ * Arrays cross JNI as a single char[] with every string plus an int[] of offsets (offsets[i] is where string i starts,
+ * offsets[length] is the end of the last one), so the number of JNI calls doesn't depend on the number of strings.
+ * Maps are packed the same way with keys and values interleaved.
+*/
+public final class PackedStrings
+{
+    private PackedStrings() {
+    }
+
+    //called by native
+    public static String[] unpack(char[] chars, int[] offsets) {
+        String[] result = new String[offsets.length - 1];
+        for (int i = 0; i < result.length; ++i) {
+            result[i] = new String(chars, offsets[i], offsets[i + 1] - offsets[i]);
+        }
+        return result;
+    }
+
+    //called by native, null elements are packed as empty strings
+    public static char[] pack(String[] array, int[] offsets) {
+        int length = 0;
+        for (String str: array) {
+            if (str != null) {
+                length += str.length();
+            }
+        }
+
+        char[] chars = new char[length];
+        int position = 0;
+        for (int i = 0; i < array.length; ++i) {
+            offsets[i] = position;
+            String str = array[i];
+            if (str != null) {
+                str.getChars(0, str.length(), chars, position);
+                position += str.length();
+            }
+        }
+        offsets[array.length] = position;
+        return chars;
+    }
+
+    //called by native, keys and values are interleaved
+    public static HashMap<String, String> unpackMap(char[] chars, int[] offsets) {
+        int count = (offsets.length - 1) / 2;
+        HashMap<String, String> result = new HashMap<String, String>(count * 4 / 3 + 1);
+        for (int i = 0; i < count; ++i) {
+            int key = i * 2;
+            int value = key + 1;
+            result.put(new String(chars, offsets[key], offsets[key + 1] - offsets[key]),
+                       new String(chars, offsets[value], offsets[value + 1] - offsets[value]));
+        }
+        return result;
+    }
+
+    //called by native with 2 * map.size() + 1 offsets, null keys and values are packed as empty strings
+    public static char[] packMap(Map<?, ?> map, int[] offsets) {
+        String[] strings = new String[map.size() * 2];
+        int index = 0;
+        for (Map.Entry<?, ?> entry: map.entrySet()) {
+            Object key = entry.getKey();
+            Object value = entry.getValue();
+            strings[index++] = key != null ? key.toString() : null;
+            strings[index++] = value != null ? value.toString() : null;
+        }
+        return pack(strings, offsets);
+    }
+}
@@ -23,6 +23,10 @@ public enum SafeJNI
 
     public void setActivity(Activity activity) {
         _acivity = activity;
+        if (activity != null) {
+            // native threads resolve the application classes through this loader
+            nativeSetClassLoader(activity.getClassLoader());
+        }
     }
 
     public Activity getActivity() {
@@ -77,6 +81,8 @@ public enum SafeJNI
         }
     }
 
+    private static native void nativeSetClassLoader(ClassLoader classLoader);
+
     public interface JavaToNativeDispatcher
     {
         void dispatch(Runnable runnable);
@@ -4,279 +4,2644 @@
 */
 
 #include <jni.h>
+#ifdef __ANDROID__
 #include <android/log.h>
+#endif
 #include <cstdlib>
+#include <cctype>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <pthread.h>
 #include "safejni.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#ifdef __ANDROID__
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR  , "SafeJNI",__VA_ARGS__)
+#else
+//host builds (desktop JVM) log to stderr
+#define LOGE(...) (fprintf(stderr, "SafeJNI: " __VA_ARGS__), fputc('\n', stderr))
+#endif
+
+using std::string;
+using std::vector;
+
+namespace safejni {
+
+    namespace {
+
+        //Runs a function when the scope ends, also when it is left by an exception
+        template <typename F>
+        class ScopeExit
+        {
+        public:
+            explicit ScopeExit(F fn): fn(fn), active(true) {}
+            ScopeExit(ScopeExit && other): fn(other.fn), active(other.active) { other.active = false; }
+            ~ScopeExit() { if (active) fn(); }
+        private:
+            F fn;
+            bool active;
+        };
+
+        template <typename F>
+        inline ScopeExit<F> onScopeExit(F fn) { return ScopeExit<F>(fn); }
+
+        //FNV-1a hash used by the lookup caches
+        inline size_t hashString(size_t hash, const char * str)
+        {
+            while (*str) {
+                hash ^= static_cast<unsigned char>(*str++);
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+
+        //Insert-only hash table. Readers walk immutable bucket lists without locking,
+        //writers serialize on a mutex and publish new entries with a release store.
+        //Entries are never removed: they live as long as the process.
+        template <typename Entry, size_t NUM_BUCKETS>
+        class ConcurrentCache
+        {
+        public:
+            template <typename Predicate>
+            Entry * find(size_t hash, Predicate match) const
+            {
+                Entry * entry = buckets[hash % NUM_BUCKETS].load(std::memory_order_acquire);
+                for (; entry; entry = entry->next) {
+                    if (entry->hash == hash && match(*entry)) {
+                        return entry;
+                    }
+                }
+                return nullptr;
+            }
+
+            template <typename F>
+            void forEach(F fn) const
+            {
+                for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+                    for (Entry * entry = buckets[i].load(std::memory_order_acquire); entry; entry = entry->next) {
+                        fn(*entry);
+                    }
+                }
+            }
+
+            //returns the entry stored in the cache, which is not the candidate if another thread won the race
+            template <typename Predicate>
+            Entry * insert(Entry * candidate, Predicate match)
+            {
+                std::lock_guard<std::mutex> lock(writeMutex);
+                Entry * existing = find(candidate->hash, match);
+                if (existing) {
+                    return existing;
+                }
+                std::atomic<Entry*> & bucket = buckets[candidate->hash % NUM_BUCKETS];
+                candidate->next = bucket.load(std::memory_order_relaxed);
+                bucket.store(candidate, std::memory_order_release);
+                return candidate;
+            }
+
+        private:
+            std::atomic<Entry*> buckets[NUM_BUCKETS];
+            std::mutex writeMutex;
+        };
+
+        struct ClassEntry
+        {
+            ClassEntry(size_t hash, const char * className, jclass classId): hash(hash), info(className, classId), next(nullptr) {}
+            size_t hash;
+            JNIClassInfo info;
+            ClassEntry * next;
+        };
+
+        enum MemberKind
+        {
+            INSTANCE_METHOD,
+            STATIC_METHOD,
+            INSTANCE_FIELD,
+            STATIC_FIELD
+        };
+
+        struct MemberEntry
+        {
+            size_t hash;
+            string className;
+            string memberName;
+            string signature;
+            MemberKind kind;
+            JNIMethodInfo methodInfo;
+            JNIFieldInfo fieldInfo;
+            MemberEntry * next;
+#ifdef SAFEJNI_ENABLE_STATS
+            JNICallStats stats;
+#endif
+        };
+
+        //Strings up to this length are transcoded through a stack buffer
+        const size_t STACK_STRING_LENGTH = 256;
+
+        //Copies the leading ASCII code units of src into dst and returns how many were copied
+        size_t narrowAscii(const jchar * src, size_t length, char * dst)
+        {
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128i mask = _mm_set1_epi16(static_cast<short>(0xFF80));
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 8 <= length; i += 8) {
+                __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, mask), zero)) != 0xFFFF) {
+                    break;
+                }
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(units, units));
+            }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+            const uint16x8_t mask = vdupq_n_u16(0xFF80);
+            for (; i + 8 <= length; i += 8) {
+                uint16x8_t units = vld1q_u16(reinterpret_cast<const uint16_t*>(src + i));
+                uint64x2_t high = vreinterpretq_u64_u16(vandq_u16(units, mask));
+                if (vgetq_lane_u64(high, 0) | vgetq_lane_u64(high, 1)) {
+                    break;
+                }
+                vst1_u8(reinterpret_cast<uint8_t*>(dst + i), vmovn_u16(units));
+            }
+#endif
+            for (; i < length && src[i] < 0x80; ++i) {
+                dst[i] = static_cast<char>(src[i]);
+            }
+            return i;
+        }
+
+        //Copies the leading ASCII bytes of src into dst and returns how many were copied
+        size_t widenAscii(const char * src, size_t length, jchar * dst)
+        {
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 16 <= length; i += 16) {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                if (_mm_movemask_epi8(bytes)) {
+                    break;
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi8(bytes, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), _mm_unpackhi_epi8(bytes, zero));
+            }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+            const uint8x16_t mask = vdupq_n_u8(0x80);
+            for (; i + 16 <= length; i += 16) {
+                uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t*>(src + i));
+                uint64x2_t high = vreinterpretq_u64_u8(vandq_u8(bytes, mask));
+                if (vgetq_lane_u64(high, 0) | vgetq_lane_u64(high, 1)) {
+                    break;
+                }
+                vst1q_u16(reinterpret_cast<uint16_t*>(dst + i), vmovl_u8(vget_low_u8(bytes)));
+                vst1q_u16(reinterpret_cast<uint16_t*>(dst + i + 8), vmovl_u8(vget_high_u8(bytes)));
+            }
+#endif
+            for (; i < length && static_cast<unsigned char>(src[i]) < 0x80; ++i) {
+                dst[i] = static_cast<jchar>(src[i]);
+            }
+            return i;
+        }
+
+        inline bool isHighSurrogate(jchar c) { return c >= 0xD800 && c <= 0xDBFF; }
+        inline bool isLowSurrogate(jchar c) { return c >= 0xDC00 && c <= 0xDFFF; }
+
+        //UTF-8 size of UTF-16 text, unpaired surrogates count as U+FFFD
+        size_t utf8Length(const jchar * src, size_t length)
+        {
+            size_t result = 0;
+            for (size_t i = 0; i < length; ++i) {
+                jchar c = src[i];
+                if (c < 0x80) {
+                    result += 1;
+                }
+                else if (c < 0x800) {
+                    result += 2;
+                }
+                else if (isHighSurrogate(c) && i + 1 < length && isLowSurrogate(src[i + 1])) {
+                    result += 4;
+                    ++i;
+                }
+                else {
+                    result += 3;
+                }
+            }
+            return result;
+        }
+
+        //Encodes UTF-16 text as standard UTF-8, dst must hold utf8Length(src, length) bytes
+        void encodeUtf8(const jchar * src, size_t length, char * dst)
+        {
+            unsigned char * out = reinterpret_cast<unsigned char*>(dst);
+            for (size_t i = 0; i < length; ++i) {
+                uint32_t c = src[i];
+                if (c < 0x80) {
+                    *out++ = static_cast<unsigned char>(c);
+                    continue;
+                }
+                if (c < 0x800) {
+                    *out++ = static_cast<unsigned char>(0xC0 | (c >> 6));
+                    *out++ = static_cast<unsigned char>(0x80 | (c & 0x3F));
+                    continue;
+                }
+                if (isHighSurrogate(c) && i + 1 < length && isLowSurrogate(src[i + 1])) {
+                    c = 0x10000 + ((c - 0xD800) << 10) + (src[++i] - 0xDC00);
+                    *out++ = static_cast<unsigned char>(0xF0 | (c >> 18));
+                    *out++ = static_cast<unsigned char>(0x80 | ((c >> 12) & 0x3F));
+                    *out++ = static_cast<unsigned char>(0x80 | ((c >> 6) & 0x3F));
+                    *out++ = static_cast<unsigned char>(0x80 | (c & 0x3F));
+                    continue;
+                }
+                if (isHighSurrogate(c) || isLowSurrogate(c)) {
+                    c = 0xFFFD;
+                }
+                *out++ = static_cast<unsigned char>(0xE0 | (c >> 12));
+                *out++ = static_cast<unsigned char>(0x80 | ((c >> 6) & 0x3F));
+                *out++ = static_cast<unsigned char>(0x80 | (c & 0x3F));
+            }
+        }
+
+        //Decodes standard UTF-8 into dst (which must hold length code units) and returns the number of code units written.
+        //Invalid or truncated sequences are replaced by U+FFFD.
+        size_t decodeUtf8(const char * src, size_t length, jchar * dst)
+        {
+            const unsigned char * in = reinterpret_cast<const unsigned char*>(src);
+            size_t count = 0;
+            size_t i = 0;
+            while (i < length) {
+                size_t ascii = widenAscii(src + i, length - i, dst + count);
+                i += ascii;
+                count += ascii;
+                if (i >= length) {
+                    break;
+                }
+
+                const unsigned char lead = in[i];
+                size_t extra;
+                uint32_t c;
+                uint32_t minimum;
+                if (lead >= 0xC2 && lead <= 0xDF) {
+                    extra = 1; c = lead & 0x1F; minimum = 0x80;
+                }
+                else if (lead >= 0xE0 && lead <= 0xEF) {
+                    extra = 2; c = lead & 0x0F; minimum = 0x800;
+                }
+                else if (lead >= 0xF0 && lead <= 0xF4) {
+                    extra = 3; c = lead & 0x07; minimum = 0x10000;
+                }
+                else {
+                    dst[count++] = 0xFFFD;
+                    ++i;
+                    continue;
+                }
+
+                size_t j = 1;
+                for (; j <= extra && i + j < length && (in[i + j] & 0xC0) == 0x80; ++j) {
+                    c = (c << 6) | (in[i + j] & 0x3F);
+                }
+                if (j <= extra || c < minimum || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+                    dst[count++] = 0xFFFD;
+                    i += j;
+                    continue;
+                }
+                i += j;
+
+                if (c >= 0x10000) {
+                    c -= 0x10000;
+                    dst[count++] = static_cast<jchar>(0xD800 + (c >> 10));
+                    dst[count++] = static_cast<jchar>(0xDC00 + (c & 0x3FF));
+                }
+                else {
+                    dst[count++] = static_cast<jchar>(c);
+                }
+            }
+            return count;
+        }
+
+        //Transcodes UTF-16 text into the destination string, sized exactly once the non ASCII tail is known
+        void transcodeToUtf8(const jchar * src, size_t length, std::string & result)
+        {
+            result.resize(length);
+            size_t ascii = narrowAscii(src, length, &result[0]);
+            if (ascii < length) {
+                result.resize(ascii + utf8Length(src + ascii, length - ascii));
+                encodeUtf8(src + ascii, length - ascii, &result[ascii]);
+            }
+        }
+
+        //application ClassLoader (a global ref) and its loadClass method, guarded by classLoaderMutex
+        std::mutex classLoaderMutex;
+        jobject classLoader = nullptr;
+        jmethodID loadClassMethod = nullptr;
+
+        //Local ref to the class, or nullptr with the exception of FindClass pending. Array classes and lookups without a
+        //loader go straight to FindClass.
+        jclass loadClass(JNIEnv * env, const char * className)
+        {
+            jobject loader = nullptr;
+            jmethodID loadClassId = nullptr;
+            if (className[0] != '[') {
+                //a local ref keeps the loader alive if another thread replaces it meanwhile
+                std::lock_guard<std::mutex> lock(classLoaderMutex);
+                if (classLoader) {
+                    loader = env->NewLocalRef(classLoader);
+                    loadClassId = loadClassMethod;
+                }
+            }
+            if (loader) {
+                string binaryName(className);
+                std::replace(binaryName.begin(), binaryName.end(), '/', '.');
+                jstring javaName = env->NewStringUTF(binaryName.c_str());
+                jclass result = static_cast<jclass>(env->CallObjectMethod(loader, loadClassId, javaName));
+                env->DeleteLocalRef(javaName);
+                env->DeleteLocalRef(loader);
+                if (result && !env->ExceptionCheck()) {
+                    return result;
+                }
+                //ClassNotFoundException: FindClass reports the failure with the usual NoClassDefFoundError
+                env->ExceptionClear();
+                if (result) {
+                    env->DeleteLocalRef(result);
+                }
+            }
+            return env->FindClass(className);
+        }
+
+        //the SafeJNI Java helpers are loaded by the application class loader
+        void captureClassLoader(JNIEnv * env)
+        {
+            jclass helper = env->FindClass("com/safejni/NativeCallback");
+            if (!helper) {
+                //the app doesn't ship the helpers: lookups keep using FindClass until SafeJNI.setActivity provides a loader
+                env->ExceptionClear();
+                return;
+            }
+            jclass classClass = env->GetObjectClass(helper);
+            jmethodID getClassLoader = env->GetMethodID(classClass, "getClassLoader", "()Ljava/lang/ClassLoader;");
+            jobject loader = getClassLoader ? env->CallObjectMethod(helper, getClassLoader) : nullptr;
+            env->ExceptionClear();
+            if (loader) {
+                Utils::setClassLoader(loader);
+                env->DeleteLocalRef(loader);
+            }
+            env->DeleteLocalRef(classClass);
+            env->DeleteLocalRef(helper);
+        }
+
+        //Packed String[] transfer: the strings travel as a single char[] plus an int[] of offsets and
+        //com.safejni.PackedStrings splits or joins them on the Java side, so the cost in JNI calls doesn't depend on the number of strings.
+        //The helper class is optional, without it every array uses the per element path.
+        const char * PACKED_STRINGS_CLASS = "com/safejni/PackedStrings";
+        enum HelperState { HELPER_UNKNOWN, HELPER_AVAILABLE, HELPER_UNAVAILABLE };
+        std::atomic<int> packedStringsState(HELPER_UNKNOWN);
+        std::atomic<size_t> packedStringThreshold(32);
+
+        bool usePackedStrings(size_t count)
+        {
+            if (count < packedStringThreshold.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            int state = packedStringsState.load(std::memory_order_acquire);
+            if (state == HELPER_UNKNOWN) {
+                //probed with raw JNI and without throwing, so builds without exceptions can fall back too: a missing
+                //class or an outdated helper without some of the methods disables it
+                JNIEnv * env = Utils::getJNIEnvAttach();
+                jclass helper = loadClass(env, PACKED_STRINGS_CLASS);
+                state = HELPER_UNAVAILABLE;
+                if (helper &&
+                    env->GetStaticMethodID(helper, "unpack", "([C[I)[Ljava/lang/String;") &&
+                    env->GetStaticMethodID(helper, "pack", "([Ljava/lang/String;[I)[C") &&
+                    env->GetStaticMethodID(helper, "unpackMap", "([C[I)Ljava/util/HashMap;") &&
+                    env->GetStaticMethodID(helper, "packMap", "(Ljava/util/Map;[I)[C")) {
+                    state = HELPER_AVAILABLE;
+                }
+                env->ExceptionClear();
+                if (helper) {
+                    env->DeleteLocalRef(helper);
+                }
+                packedStringsState.store(state, std::memory_order_release);
+            }
+            return state == HELPER_AVAILABLE;
+        }
+
+        inline const string & packedString(const string & str, size_t) { return str; }
+        template <typename Pair>
+        inline const string & packedString(const Pair & entry, size_t index) { return index ? entry.second : entry.first; }
+
+        //Packs STRINGS_PER_ITEM strings per element (1 for arrays, key and value for maps) and calls the given
+        //PackedStrings method with the char[] and offsets int[]
+        template <size_t STRINGS_PER_ITEM, typename Container>
+        jobject packStrings(JNIEnv * env, const Container & data, const char * methodName, const char * signature)
+        {
+            //every UTF-8 byte produces at most one UTF-16 code unit
+            size_t capacity = 0;
+            for (const auto & item: data) {
+                for (size_t i = 0; i < STRINGS_PER_ITEM; ++i) {
+                    capacity += packedString(item, i).size();
+                }
+            }
+            jcharArray chars = env->NewCharArray(static_cast<jsize>(capacity));
+            if (!chars) {
+                JNI_EXCEPTION_CHECK
+                return nullptr;
+            }
+
+            std::vector<jint> offsets(data.size() * STRINGS_PER_ITEM + 1);
+            jchar * buffer = static_cast<jchar*>(env->GetPrimitiveArrayCritical(chars, nullptr));
+            if (!buffer) {
+                env->DeleteLocalRef(chars);
+                JNI_EXCEPTION_CHECK
+                SAFEJNI_THROW(JNIException("Could not access the packed string buffer."));
+                return nullptr;
+            }
+            size_t position = 0;
+            size_t index = 0;
+            for (const auto & item: data) {
+                for (size_t i = 0; i < STRINGS_PER_ITEM; ++i) {
+                    const string & str = packedString(item, i);
+                    offsets[index++] = static_cast<jint>(position);
+                    position += decodeUtf8(str.data(), str.size(), buffer + position);
+                }
+            }
+            offsets[index] = static_cast<jint>(position);
+            env->ReleasePrimitiveArrayCritical(chars, buffer, 0);
+
+            jintArray javaOffsets = toJavaArray(offsets.data(), offsets.size());
+            if (!javaOffsets) {
+                env->DeleteLocalRef(chars);
+                return nullptr;
+            }
+            const JNIMethodInfo & unpack = Utils::findStaticMethod(PACKED_STRINGS_CLASS, methodName, signature);
+            jobject result = env->CallStaticObjectMethod(unpack.classId, unpack.methodId, chars, javaOffsets);
+            env->DeleteLocalRef(chars);
+            env->DeleteLocalRef(javaOffsets);
+            if (env->ExceptionCheck()) {
+                //null result, the exception is reported through the policy
+                JNI_EXCEPTION_CHECK
+                return nullptr;
+            }
+            return result;
+        }
+
+        //Calls the given PackedStrings method, which fills count + 1 offsets and returns the char[] with every string
+        std::vector<std::string> unpackStrings(JNIEnv * env, jobject source, size_t count, const char * methodName, const char * signature)
+        {
+            std::vector<std::string> result;
+            jintArray javaOffsets = env->NewIntArray(static_cast<jsize>(count + 1));
+            if (!javaOffsets) {
+                JNI_EXCEPTION_CHECK
+                return result;
+            }
+            const JNIMethodInfo & pack = Utils::findStaticMethod(PACKED_STRINGS_CLASS, methodName, signature);
+            jcharArray chars = static_cast<jcharArray>(env->CallStaticObjectMethod(pack.classId, pack.methodId, source, javaOffsets));
+            if (env->ExceptionCheck() || !chars) {
+                env->DeleteLocalRef(javaOffsets);
+                JNI_EXCEPTION_CHECK
+                return result;
+            }
+            std::vector<jint> offsets(count + 1);
+            env->GetIntArrayRegion(javaOffsets, 0, static_cast<jsize>(offsets.size()), offsets.data());
+            env->DeleteLocalRef(javaOffsets);
+
+            const jchar * buffer = static_cast<const jchar*>(env->GetPrimitiveArrayCritical(chars, nullptr));
+            if (!buffer) {
+                env->DeleteLocalRef(chars);
+                JNI_EXCEPTION_CHECK
+                SAFEJNI_THROW(JNIException("Could not access the packed string buffer."));
+                return result;
+            }
+            result.resize(count);
+            auto release = onScopeExit([=]() {
+                env->ReleasePrimitiveArrayCritical(chars, const_cast<jchar*>(buffer), JNI_ABORT);
+                env->DeleteLocalRef(chars);
+            });
+            for (size_t i = 0; i < count; ++i) {
+                transcodeToUtf8(buffer + offsets[i], offsets[i + 1] - offsets[i], result[i]);
+            }
+            return result;
+        }
+
+        template <typename Map>
+        jobject writeHashMap(JNIEnv * env, const Map & data)
+        {
+            if (usePackedStrings(data.size() * 2)) {
+                return packStrings<2>(env, data, "unpackMap", "([C[I)Ljava/util/HashMap;");
+            }
+
+            //sized up front so put never rehashes (default load factor 0.75)
+            const JNIMethodInfo & constructor = Utils::findMethod("java/util/HashMap", "<init>", "(I)V");
+            jobject hashmap = env->NewObject(constructor.classId, constructor.methodId, static_cast<jint>(data.size() * 4 / 3 + 1));
+            if (!hashmap) {
+                JNI_EXCEPTION_CHECK
+                return nullptr;
+            }
+
+            jmethodID put = Utils::findMethod("java/util/HashMap", "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;").methodId;
+            for (auto & item : data)
+            {
+                jstring key = Utils::toJString(item.first);
+                jstring value = key ? Utils::toJString(item.second) : nullptr;
+                jobject previous = value ? env->CallObjectMethod(hashmap, put, key, value) : nullptr;
+
+                if (previous)
+                    env->DeleteLocalRef(previous);
+                if (key)
+                    env->DeleteLocalRef(key);
+                if (value)
+                    env->DeleteLocalRef(value);
+                //no JNI call may follow a pending exception, and a failed toJString has already reported its own
+                if (!key || !value || env->ExceptionCheck()) {
+                    env->DeleteLocalRef(hashmap);
+                    JNI_EXCEPTION_CHECK
+                    return nullptr;
+                }
+            }
+            return hashmap;
+        }
+
+        template <typename Map>
+        Map readMap(JNIEnv * env, jobject map)
+        {
+            Map result;
+            if (!map) {
+                return result;
+            }
+            const JNIMethodInfo & size = Utils::findMethod("java/util/Map", "size", "()I");
+            const size_t count = env->CallIntMethod(map, size.methodId);
+            if (env->ExceptionCheck()) {
+                JNI_EXCEPTION_CHECK
+                return result;
+            }
+
+            if (usePackedStrings(count * 2)) {
+                //keys and values are interleaved
+                std::vector<std::string> strings = unpackStrings(env, map, count * 2, "packMap", "(Ljava/util/Map;[I)[C");
+                for (size_t i = 0; i + 1 < strings.size(); i += 2) {
+                    result.insert(std::make_pair(std::move(strings[i]), std::move(strings[i + 1])));
+                }
+                return result;
+            }
+
+            const JNIMethodInfo & entrySet = Utils::findMethod("java/util/Map", "entrySet", "()Ljava/util/Set;");
+            const JNIMethodInfo & toArray = Utils::findMethod("java/util/Set", "toArray", "()[Ljava/lang/Object;");
+            const JNIMethodInfo & getKey = Utils::findMethod("java/util/Map$Entry", "getKey", "()Ljava/lang/Object;");
+            const JNIMethodInfo & getValue = Utils::findMethod("java/util/Map$Entry", "getValue", "()Ljava/lang/Object;");
+
+            jobject entries = env->CallObjectMethod(map, entrySet.methodId);
+            if (env->ExceptionCheck() || !entries) {
+                JNI_EXCEPTION_CHECK
+                return result;
+            }
+            jobjectArray array = static_cast<jobjectArray>(env->CallObjectMethod(entries, toArray.methodId));
+            env->DeleteLocalRef(entries);
+            if (env->ExceptionCheck() || !array) {
+                JNI_EXCEPTION_CHECK
+                return result;
+            }
+
+            const jsize length = env->GetArrayLength(array);
+            for (jsize i = 0; i < length; ++i) {
+                jobject entry = env->GetObjectArrayElement(array, i);
+                jstring key = static_cast<jstring>(env->CallObjectMethod(entry, getKey.methodId));
+                jstring value = env->ExceptionCheck() ? nullptr : static_cast<jstring>(env->CallObjectMethod(entry, getValue.methodId));
+                if (env->ExceptionCheck()) {
+                    //an entry that can't be read fails the whole map
+                    if (key)
+                        env->DeleteLocalRef(key);
+                    env->DeleteLocalRef(entry);
+                    env->DeleteLocalRef(array);
+                    JNI_EXCEPTION_CHECK
+                    return Map();
+                }
+                result.insert(std::make_pair(Utils::toString(key), Utils::toString(value)));
+                if (key)
+                    env->DeleteLocalRef(key);
+                if (value)
+                    env->DeleteLocalRef(value);
+                env->DeleteLocalRef(entry);
+            }
+            env->DeleteLocalRef(array);
+            return result;
+        }
+
+        //Threads attached by SafeJNI store the VM in this key so they are detached when they exit, threads keeping a
+        //pending exception store threadKeyMarker so it is freed. A single key orders both: the exception goes first.
+        pthread_key_t threadKey;
+        pthread_once_t threadKeyOnce = PTHREAD_ONCE_INIT;
+        char threadKeyMarker;
+        std::atomic<bool> attachAsDaemon(false);
+
+        ConcurrentCache<ClassEntry, 256> classCache;
+        ConcurrentCache<MemberEntry, 1024> memberCache;
+
+        inline size_t hashMember(const char * className, const char * memberName, const char * signature, MemberKind kind)
+        {
+            size_t hash = hashString(2166136261u + kind, className);
+            hash = hashString(hash * 31, memberName);
+            return hashString(hash * 31, signature);
+        }
+
+        const MemberEntry & findMember(const char * className, const char * memberName, const char * signature, MemberKind kind)
+        {
+            const size_t hash = hashMember(className, memberName, signature, kind);
+            auto match = [=](const MemberEntry & entry) {
+                return entry.kind == kind && entry.memberName == memberName && entry.signature == signature && entry.className == className;
+            };
+            MemberEntry * entry = memberCache.find(hash, match);
+            if (entry) {
+#ifdef SAFEJNI_ENABLE_STATS
+                entry->stats.cacheHits.fetch_add(1, std::memory_order_relaxed);
+#endif
+                return *entry;
+            }
+
+            //resolve outside the write lock: FindClass may run static initializers that call back into SafeJNI
+            jclass classId = Utils::findClass(className);
+            JNIEnv * env = Utils::getJNIEnvAttach();
+            jmethodID methodId = 0;
+            jfieldID fieldId = 0;
+            switch (kind) {
+                case INSTANCE_METHOD: methodId = env->GetMethodID(classId, memberName, signature); break;
+                case STATIC_METHOD: methodId = env->GetStaticMethodID(classId, memberName, signature); break;
+                case INSTANCE_FIELD: fieldId = env->GetFieldID(classId, memberName, signature); break;
+                case STATIC_FIELD: fieldId = env->GetStaticFieldID(classId, memberName, signature); break;
+            }
+            JNI_EXCEPTION_CHECK
+
+            if (!methodId && !fieldId) {
+                static const char * kindNames[] = {"method", "static method", "field", "static field"};
+                SAFEJNI_THROW(JNIException(string("Could not find the given '") + memberName + string("' ") + kindNames[kind] + string(" in the given '") + className + string("' class using the '") + signature + string("' signature.")));
+            }
+
+            MemberEntry * candidate = new MemberEntry{hash, className, memberName, signature, kind, JNIMethodInfo(classId, methodId), JNIFieldInfo(classId, fieldId), nullptr};
+#ifdef SAFEJNI_ENABLE_STATS
+            candidate->methodInfo.stats = &candidate->stats;
+            candidate->fieldInfo.stats = &candidate->stats;
+#endif
+            entry = memberCache.insert(candidate, match);
+            if (entry != candidate) {
+                delete candidate;
+            }
+#ifdef SAFEJNI_ENABLE_STATS
+            entry->stats.cacheMisses.fetch_add(1, std::memory_order_relaxed);
+#endif
+            return *entry;
+        }
+    }
+    
+	thread_local JNIEnv* Utils::env = 0;
+    JavaVM* Utils::javaVM = 0;
+
+
+    void init(JavaVM * vm, JNIEnv * env)
+    {
+        Utils::init(vm, env);
+    }
+    
+    JNIMethodInfo::JNIMethodInfo(jclass classId, jmethodID methodId): classId(classId), methodId(methodId)
+    {
+#ifdef SAFEJNI_ENABLE_STATS
+        stats = nullptr;
+#endif
+    }
+
+    JNIFieldInfo::JNIFieldInfo(jclass classId, jfieldID fieldId): classId(classId), fieldId(fieldId)
+    {
+#ifdef SAFEJNI_ENABLE_STATS
+        stats = nullptr;
+#endif
+    }
+    
+
+    struct JNIException::Details
+    {
+        jthrowable throwable;
+        std::once_flag resolved;
+        string className;
+        string message;
+        string description;
+
+        explicit Details(jthrowable throwable): throwable(throwable) {}
+        ~Details()
+        {
+            if (throwable) {
+                Utils::getJNIEnvAttach()->DeleteGlobalRef(throwable);
+            }
+        }
+    };
+
+    namespace {
+
+        //String returned by a no-arg method of the object's class. Raw JNI that never throws: this runs while reporting
+        //an exception, a failure only clears the Java exception and returns an empty string
+        string callStringMethod(JNIEnv * env, jobject instance, jclass instanceClass, const char * methodName)
+        {
+            jmethodID method = env->GetMethodID(instanceClass, methodName, "()Ljava/lang/String;");
+            jstring str = method ? static_cast<jstring>(env->CallObjectMethod(instance, method)) : nullptr;
+            if (env->ExceptionCheck()) {
+                env->ExceptionClear();
+                return string();
+            }
+            string result = str ? Utils::toString(str) : string();
+            if (str) {
+                env->DeleteLocalRef(str);
+            }
+            return result;
+        }
+
+        const char * UNAVAILABLE_DETAILS = "Java exception (details unavailable)";
+
+        //Fetches the Java details of the exception on first use, so the throwing path only pays for a global ref.
+        //Called from what(), so it never throws nor attaches the thread: failures leave a fixed description.
+        void resolveDetails(JNIException::Details & details)
+        {
+#if SAFEJNI_EXCEPTIONS
+            try {
+#endif
+                std::call_once(details.resolved, [&details]() {
+                    if (!details.throwable) {
+                        return;
+                    }
+                    details.description = UNAVAILABLE_DETAILS;
+                    JNIEnv * env = Utils::getJNIEnv();
+                    if (!env || env->ExceptionCheck()) {
+                        return;
+                    }
+                    jclass throwableClass = env->GetObjectClass(details.throwable);
+                    jclass classClass = env->GetObjectClass(throwableClass);
+                    string className = callStringMethod(env, throwableClass, classClass, "getName");
+                    string message = callStringMethod(env, details.throwable, throwableClass, "getMessage");
+                    string description = callStringMethod(env, details.throwable, throwableClass, "toString");
+                    env->DeleteLocalRef(classClass);
+                    env->DeleteLocalRef(throwableClass);
+                    details.className.swap(className);
+                    details.message.swap(message);
+                    if (!description.empty()) {
+                        details.description.swap(description);
+                    }
+                });
+#if SAFEJNI_EXCEPTIONS
+            }
+            catch (...) {
+                //std::system_error from call_once or bad_alloc: what() keeps whatever was resolved
+            }
+#endif
+        }
+
+        std::atomic<int> exceptionPolicy(static_cast<int>(SAFEJNI_EXCEPTIONS ? ExceptionPolicy::THROW : ExceptionPolicy::RETURN));
+        thread_local int threadExceptionPolicy = -1;
+        //exception kept by the RETURN and DEFERRED policies, deleted by Utils::releaseThread when the thread exits
+        thread_local JNIException * pendingException = nullptr;
+
+        //true when a new exception was kept
+        bool keepPendingException(const JNIException & exception, bool replace)
+        {
+            if (!pendingException) {
+                pendingException = new JNIException(exception);
+                return true;
+            }
+            else if (replace) {
+                *pendingException = exception;
+            }
+            return false;
+        }
+    }
+
+    JNIException::JNIException(const std::string & message): details(std::make_shared<Details>(nullptr))
+    {
+        details->message = message;
+        details->description = message;
+    }
+
+    JNIException::JNIException(jthrowable throwable): details(std::make_shared<Details>(static_cast<jthrowable>(Utils::getJNIEnvAttach()->NewGlobalRef(throwable))))
+    {
+
+    }
+
+    const char* JNIException::what() const throw()
+    {
+        resolveDetails(*details);
+        return details->description.c_str();
+    }
+
+    jthrowable JNIException::throwable() const
+    {
+        return details->throwable;
+    }
+
+    std::string JNIException::className() const
+    {
+        resolveDetails(*details);
+        return details->className;
+    }
+
+    std::string JNIException::message() const
+    {
+        resolveDetails(*details);
+        return details->message;
+    }
+
+    std::string JNIException::stackTrace() const
+    {
+        if (!details->throwable) {
+            return string();
+        }
+        JNIEnv * env = Utils::getJNIEnvAttach();
+        const JNIMethodInfo & stringWriterInit = Utils::findMethod("java/io/StringWriter", "<init>", "()V");
+        const JNIMethodInfo & printWriterInit = Utils::findMethod("java/io/PrintWriter", "<init>", "(Ljava/io/Writer;)V");
+        const JNIMethodInfo & printStackTrace = Utils::findMethod("java/lang/Throwable", "printStackTrace", "(Ljava/io/PrintWriter;)V");
+        const JNIMethodInfo & flush = Utils::findMethod("java/io/PrintWriter", "flush", "()V");
+        jobject stringWriter = env->NewObject(stringWriterInit.classId, stringWriterInit.methodId);
+        jobject printWriter = env->NewObject(printWriterInit.classId, printWriterInit.methodId, stringWriter);
+        env->CallVoidMethod(details->throwable, printStackTrace.methodId, printWriter);
+        env->CallVoidMethod(printWriter, flush.methodId);
+        string result = env->ExceptionCheck() ? string() : callStringMethod(env, stringWriter, stringWriterInit.classId, "toString");
+        env->ExceptionClear();
+        env->DeleteLocalRef(printWriter);
+        env->DeleteLocalRef(stringWriter);
+        return result;
+    }
+
+    ExceptionScope::ExceptionScope(ExceptionPolicy policy): previous(threadExceptionPolicy)
+    {
+        threadExceptionPolicy = static_cast<int>(policy);
+    }
+
+    ExceptionScope::~ExceptionScope()
+    {
+        threadExceptionPolicy = previous;
+    }
+
+    namespace {
+
+        //registrations made by NativeRegistrar before SafeJNI is initialized
+        struct QueuedNatives
+        {
+            const char * className;
+            vector<JNINativeMethod> methods;
+        };
+
+        std::mutex nativesMutex;
+        bool nativesReady = false;
+
+        vector<QueuedNatives> & queuedNatives()
+        {
+            static vector<QueuedNatives> queue;
+            return queue;
+        }
+
+        void registerQueuedNatives()
+        {
+            vector<QueuedNatives> queue;
+            {
+                std::lock_guard<std::mutex> lock(nativesMutex);
+                nativesReady = true;
+                queue.swap(queuedNatives());
+            }
+            for (const QueuedNatives & natives: queue) {
+                registerNatives(natives.className, natives.methods);
+            }
+        }
+
+        void runQueuedWarmUps();
+    }
+
+    void Utils::init(JavaVM * vm, JNIEnv * jniEnv)
+    {
+        Utils::javaVM = vm;
+        Utils::env = jniEnv;
+        captureClassLoader(jniEnv);
+        registerQueuedNatives();
+        runQueuedWarmUps();
+    }
+
+    void registerNatives(const char * className, const std::vector<JNINativeMethod> & methods)
+    {
+        JNIEnv * jniEnv = Utils::getJNIEnvAttach();
+        if (jniEnv->RegisterNatives(Utils::findClass(className), methods.data(), static_cast<jint>(methods.size())) != JNI_OK) {
+            JNI_EXCEPTION_CHECK
+            SAFEJNI_THROW(JNIException(string("Could not register the native methods of the given class: ") + className));
+        }
+    }
+
+    NativeRegistrar::NativeRegistrar(const char * className, std::initializer_list<JNINativeMethod> methods)
+    {
+        {
+            std::lock_guard<std::mutex> lock(nativesMutex);
+            if (!nativesReady) {
+                queuedNatives().push_back(QueuedNatives{className, vector<JNINativeMethod>(methods)});
+                return;
+            }
+        }
+        registerNatives(className, methods);
+    }
+
+    JNIEnv * Utils::currentEnv()
+    {
+        JNIEnv * jniEnv = nullptr;
+        if (!javaVM || javaVM->GetEnv(reinterpret_cast<void**>(&jniEnv), JNI_VERSION_1_6) != JNI_OK) {
+            return nullptr;
+        }
+        env = jniEnv;
+        return jniEnv;
+    }
+
+    JNIEnv * Utils::attachCurrentThread()
+    {
+        if (!javaVM) {
+            SAFEJNI_THROW(JNIException("SafeJNI is not initialized: call safejni::init from JNI_OnLoad."));
+        }
+
+        JNIEnv * jniEnv = nullptr;
+        int status = javaVM->GetEnv(reinterpret_cast<void**>(&jniEnv), JNI_VERSION_1_6);
+        if (status == JNI_EDETACHED) {
+#ifdef __ANDROID__
+            JNIEnv ** attachedEnv = &jniEnv;
+#else
+            //the desktop jni.h declares the out parameter as void**
+            void ** attachedEnv = reinterpret_cast<void**>(&jniEnv);
+#endif
+            status = attachAsDaemon ? javaVM->AttachCurrentThreadAsDaemon(attachedEnv, NULL) : javaVM->AttachCurrentThread(attachedEnv, NULL);
+            if (status < 0) {
+                SAFEJNI_THROW(JNIException("Could not attach the JNI environment to the current thread."));
+            }
+            pthread_once(&threadKeyOnce, createThreadKey);
+            pthread_setspecific(threadKey, javaVM);
+        }
+        else if (status != JNI_OK) {
+            SAFEJNI_THROW(JNIException("Could not get the JNI environment of the current thread."));
+        }
+
+        env = jniEnv;
+        return jniEnv;
+    }
+
+    void Utils::detachCurrentThread()
+    {
+        pthread_once(&threadKeyOnce, createThreadKey);
+        if (pthread_getspecific(threadKey) == javaVM) {
+            //a pending exception is still freed when the thread exits
+            pthread_setspecific(threadKey, pendingException ? &threadKeyMarker : nullptr);
+            javaVM->DetachCurrentThread();
+        }
+        env = nullptr;
+    }
+
+    void Utils::createThreadKey()
+    {
+        pthread_key_create(&threadKey, releaseThread);
+    }
+
+    void Utils::releaseThread(void * value)
+    {
+        //the cached env may belong to a thread the VM or its owner already detached: it is looked up again, and if the
+        //thread has to be attached to free the exception, the key is set again and this runs once more to detach it
+        env = nullptr;
+        delete pendingException;
+        pendingException = nullptr;
+        if (value == javaVM) {
+            javaVM->DetachCurrentThread();
+        }
+        env = nullptr;
+    }
+
+    void Utils::setClassLoader(jobject loader)
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        jobject globalLoader = nullptr;
+        jmethodID loadClassId = nullptr;
+        if (loader) {
+            jclass loaderClass = jniEnv->FindClass("java/lang/ClassLoader");
+            loadClassId = jniEnv->GetMethodID(loaderClass, "loadClass", "(Ljava/lang/String;)Ljava/lang/Class;");
+            jniEnv->DeleteLocalRef(loaderClass);
+            JNI_EXCEPTION_CHECK
+            globalLoader = jniEnv->NewGlobalRef(loader);
+        }
+        jobject previous = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(classLoaderMutex);
+            previous = classLoader;
+            classLoader = globalLoader;
+            loadClassMethod = loadClassId;
+        }
+        if (previous) {
+            jniEnv->DeleteGlobalRef(previous);
+        }
+    }
+
+    void Utils::setAttachAsDaemon(bool daemon)
+    {
+        attachAsDaemon = daemon;
+    }
+
+    void Utils::setPackedStringThreshold(size_t count)
+    {
+        packedStringThreshold = count;
+    }
+
+	jstring Utils::toJString(const char * str)
+	{
+	 	return str ? toJString(str, strlen(str)) : nullptr;
+	}
+
+    jstring Utils::toJString(const char * str, size_t length)
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        jstring result;
+        if (length <= STACK_STRING_LENGTH) {
+            jchar buffer[STACK_STRING_LENGTH];
+            result = jniEnv->NewString(buffer, static_cast<jsize>(decodeUtf8(str, length, buffer)));
+        }
+        else {
+            std::unique_ptr<jchar[]> buffer(new jchar[length]);
+            result = jniEnv->NewString(buffer.get(), static_cast<jsize>(decodeUtf8(str, length, buffer.get())));
+        }
+        JNI_EXCEPTION_CHECK
+        return result;
+    }
+
+    jstring Utils::toJString(const std::u16string & str)
+    {
+        jstring result = getJNIEnvAttach()->NewString(reinterpret_cast<const jchar*>(str.data()), static_cast<jsize>(str.size()));
+        JNI_EXCEPTION_CHECK
+        return result;
+    }
+    
+    jobjectArray Utils::toJObjectArray(const std::vector<std::string> & data)
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        if (usePackedStrings(data.size())) {
+            return static_cast<jobjectArray>(packStrings<1>(jniEnv, data, "unpack", "([C[I)[Ljava/lang/String;"));
+        }
+        jclass classId = findClass("java/lang/String");
+        jint size = data.size();
+        jobjectArray joa = jniEnv->NewObjectArray(size, classId, 0);
+        if (!joa) {
+            JNI_EXCEPTION_CHECK
+            return nullptr;
+        }
+        
+        for (int i = 0; i < size; i++)
+        {
+            jstring jstr = toJString(data[i]);
+            if (!jstr) {
+                //toJString has already reported the exception
+                jniEnv->DeleteLocalRef(joa);
+                return nullptr;
+            }
+            jniEnv->SetObjectArrayElement(joa, i, jstr);
+            jniEnv->DeleteLocalRef(jstr);
+        }
+        return joa;
+    }
+    
+    jbyteArray Utils::toJObjectArray(const std::vector<uint8_t> & data)
+    {
+        jbyteArray jba = toJavaArray(data.data(), data.size());
+        JNI_EXCEPTION_CHECK
+        return jba;
+    }
+
+    jobjectArray Utils::toJObjectArray(const std::vector<jobject> & data)
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        jint size = data.size();
+        jobjectArray joa = jniEnv->NewObjectArray(size, findClass("java/lang/Object"), 0);
+        if (!joa) {
+            JNI_EXCEPTION_CHECK
+            return nullptr;
+        }
+
+        for (int i = 0; i < size; i++)
+        {
+            jniEnv->SetObjectArrayElement(joa, i, data[i]);
+        }
+        return joa;
+    }
+
+    jobject Utils::toHashMap(const std::map<std::string, std::string> & data)
+    {
+        return writeHashMap(getJNIEnvAttach(), data);
+    }
+
+    jobject Utils::toHashMap(const std::unordered_map<std::string, std::string> & data)
+    {
+        return writeHashMap(getJNIEnvAttach(), data);
+    }
+
+    std::map<std::string, std::string> Utils::toMap(jobject map)
+    {
+        return readMap<std::map<std::string, std::string>>(getJNIEnvAttach(), map);
+    }
+
+    std::unordered_map<std::string, std::string> Utils::toUnorderedMap(jobject map)
+    {
+        return readMap<std::unordered_map<std::string, std::string>>(getJNIEnvAttach(), map);
+    }
+    
+    jobject Utils::toDirectByteBuffer(void * data, size_t size)
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        jobject buffer = jniEnv->NewDirectByteBuffer(data, static_cast<jlong>(size));
+        JNI_EXCEPTION_CHECK
+        if (!buffer) {
+            SAFEJNI_THROW(JNIException("Direct ByteBuffers are not supported by this VM."));
+        }
+        return buffer;
+    }
+
+    jobject Utils::toDirectByteBuffer(const NativeBuffer & nativeBuffer)
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        jobject buffer = toDirectByteBuffer(nativeBuffer.data(), nativeBuffer.size());
+
+        //the Java tracker owns a copy of the shared owner until the ByteBuffer is collected
+        std::shared_ptr<void> * handle = new std::shared_ptr<void>(nativeBuffer.owner());
+        const JNIMethodInfo & track = findStaticMethod("com/safejni/NativeBuffers", "track", "(Ljava/nio/ByteBuffer;J)V");
+        jniEnv->CallStaticVoidMethod(track.classId, track.methodId, buffer, reinterpret_cast<jlong>(handle));
+        if (jniEnv->ExceptionCheck()) {
+            delete handle;
+            jniEnv->DeleteLocalRef(buffer);
+            JNI_EXCEPTION_CHECK
+        }
+        return buffer;
+    }
+
+    DirectBuffer Utils::toDirectBuffer(jobject byteBuffer)
+    {
+        if (!byteBuffer) {
+            return DirectBuffer();
+        }
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        void * data = jniEnv->GetDirectBufferAddress(byteBuffer);
+        if (!data) {
+            SAFEJNI_THROW(JNIException("The given ByteBuffer is not a direct buffer."));
+        }
+        return DirectBuffer(data, static_cast<size_t>(jniEnv->GetDirectBufferCapacity(byteBuffer)));
+    }
+
+    NativeBuffer Utils::toNativeBuffer(jobject byteBuffer)
+    {
+        DirectBuffer buffer = toDirectBuffer(byteBuffer);
+        if (!buffer.data) {
+            return NativeBuffer();
+        }
+        std::shared_ptr<void> owner(References::newGlobalRef(byteBuffer, nullptr, "NativeBuffer"), [](void * globalRef) {
+            References::deleteGlobalRef(static_cast<jobject>(globalRef), nullptr, "NativeBuffer");
+        });
+        return NativeBuffer(buffer.data, buffer.size, owner);
+    }
+
+    std::string Utils::toString(jstring str)
+    {
+        std::string result;
+        if (!str) {
+            return result;
+        }
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        const size_t length = jniEnv->GetStringLength(str);
+        if (length <= STACK_STRING_LENGTH) {
+            jchar buffer[STACK_STRING_LENGTH];
+            jniEnv->GetStringRegion(str, 0, static_cast<jsize>(length), buffer);
+            transcodeToUtf8(buffer, length, result);
+            return result;
+        }
+
+        //no JNI calls are allowed until the critical section is released
+        const jchar * chars = jniEnv->GetStringCritical(str, nullptr);
+        if (!chars) {
+            JNI_EXCEPTION_CHECK
+            SAFEJNI_THROW(JNIException("Could not access the characters of a Java string."));
+        }
+        auto release = onScopeExit([=]() { jniEnv->ReleaseStringCritical(str, chars); });
+        transcodeToUtf8(chars, length, result);
+        return result;
+    }
+
+    std::u16string Utils::toU16String(jstring str)
+    {
+        std::u16string result;
+        if (str) {
+            JNIEnv * jniEnv = getJNIEnvAttach();
+            result.resize(jniEnv->GetStringLength(str));
+            jniEnv->GetStringRegion(str, 0, static_cast<jsize>(result.size()), reinterpret_cast<jchar*>(&result[0]));
+        }
+        return result;
+    }
+    
+    std::vector<std::string> Utils::toVectorString(jobjectArray array)
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        std::vector<std::string> result;
+        if (array) {
+            jint length = jniEnv->GetArrayLength(array);
+            if (usePackedStrings(length)) {
+                return unpackStrings(jniEnv, array, length, "pack", "([Ljava/lang/String;[I)[C");
+            }
+            
+            result.reserve(length);
+            for (int i = 0; i < length; i++) {
+                jobject valueJObject = jniEnv->GetObjectArrayElement(array, i);
+                result.push_back(toString((jstring)valueJObject));
+                jniEnv->DeleteLocalRef(valueJObject);
+            }
+        }
+        JNI_EXCEPTION_CHECK
+        return result;
+    }
+    
+    std::vector<uint8_t> Utils::toVectorByte(jbyteArray array)
+    {
+        return JNIToCPPConversor<std::vector<uint8_t>>::convert(array);
+    }
+
+    std::vector<float> Utils::toVectorFloat(jfloatArray array)
+    {
+        return JNIToCPPConversor<std::vector<float>>::convert(array);
+    }
+
+    std::vector<jobject> Utils::toVectorJObject(jobjectArray array)
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        std::vector<jobject> result;
+        if (array) {
+            jint length = jniEnv->GetArrayLength(array);
+            
+            for (int i = 0; i < length; i++) {
+                jobject valueJObject = jniEnv->GetObjectArrayElement(array, i);
+                result.push_back(valueJObject);
+            }
+        }
+        return result;
+    }
+    
+    jclass Utils::findClass(const char * className)
+    {
+        return findClassInfo(className).classId;
+    }
+
+    const JNIClassInfo & Utils::findClassInfo(const char * className)
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        const size_t hash = hashString(2166136261u, className);
+        auto match = [=](const ClassEntry & entry) { return entry.info.className == className; };
+        ClassEntry * entry = classCache.find(hash, match);
+        if (entry) {
+            return entry->info;
+        }
+
+        jclass localClassId = loadClass(jniEnv, className);
+        JNI_EXCEPTION_CHECK
+
+        if (!localClassId){
+            SAFEJNI_THROW(JNIException(string("Could not find the given class: ") + className));
+        }
+
+        jclass classId = static_cast<jclass>(jniEnv->NewGlobalRef(localClassId));
+        jniEnv->DeleteLocalRef(localClassId);
+
+        ClassEntry * candidate = new ClassEntry(hash, className, classId);
+        entry = classCache.insert(candidate, match);
+        if (entry != candidate) {
+            jniEnv->DeleteGlobalRef(classId);
+            delete candidate;
+        }
+        return entry->info;
+    }
+
+    const JNIMethodInfo & Utils::findStaticMethod(const char * className, const char * methodName, const char * signature)
+    {
+        return findMember(className, methodName, signature, STATIC_METHOD).methodInfo;
+    }
+
+    const JNIMethodInfo & Utils::findMethod(const char * className, const char * methodName, const char * signature)
+    {
+        return findMember(className, methodName, signature, INSTANCE_METHOD).methodInfo;
+    }
+
+    const JNIFieldInfo & Utils::findStaticField(const char * className, const char * fieldName, const char * signature)
+    {
+        return findMember(className, fieldName, signature, STATIC_FIELD).fieldInfo;
+    }
+
+    const JNIFieldInfo & Utils::findField(const char * className, const char * fieldName, const char * signature)
+    {
+        return findMember(className, fieldName, signature, INSTANCE_FIELD).fieldInfo;
+    }
+
+    //The returned pointers alias the cached entries without owning them, so no control block is allocated
+	SPJNIMethodInfo Utils::getStaticMethodInfo(const string& className, const string& methodName, const char * signature)
+    {
+        const JNIMethodInfo & methodInfo = findStaticMethod(className.c_str(), methodName.c_str(), signature);
+        return SPJNIMethodInfo(SPJNIMethodInfo(), const_cast<JNIMethodInfo*>(&methodInfo));
+    }
+    
+    SPJNIMethodInfo Utils::getMethodInfo(const string& className, const string& methodName, const char * signature)
+    {
+        const JNIMethodInfo & methodInfo = findMethod(className.c_str(), methodName.c_str(), signature);
+        return SPJNIMethodInfo(SPJNIMethodInfo(), const_cast<JNIMethodInfo*>(&methodInfo));
+    }   
+
+    void Utils::setExceptionPolicy(ExceptionPolicy policy)
+    {
+        exceptionPolicy.store(static_cast<int>(policy), std::memory_order_relaxed);
+    }
+
+    ExceptionPolicy Utils::getExceptionPolicy()
+    {
+        return static_cast<ExceptionPolicy>(threadExceptionPolicy >= 0 ? threadExceptionPolicy : exceptionPolicy.load(std::memory_order_relaxed));
+    }
+
+    bool Utils::hasPendingException()
+    {
+        return pendingException != nullptr;
+    }
+
+    std::unique_ptr<JNIException> Utils::takePendingException()
+    {
+        std::unique_ptr<JNIException> result(pendingException);
+        pendingException = nullptr;
+        return result;
+    }
+
+    void Utils::reportPendingException()
+    {
+        if (pendingException && getExceptionPolicy() == ExceptionPolicy::THROW) {
+            std::unique_ptr<JNIException> exception = takePendingException();
+            SAFEJNI_THROW(*exception);
+        }
+    }
+
+    void Utils::handleException()
+    {
+        JNIEnv * jniEnv = getJNIEnvAttach();
+        jthrowable throwable = jniEnv->ExceptionOccurred();
+        jniEnv->ExceptionClear();
+        JNIException exception(throwable);
+        jniEnv->DeleteLocalRef(throwable);
+        switch (getExceptionPolicy()) {
+            case ExceptionPolicy::THROW:
+                SAFEJNI_THROW(exception);
+            case ExceptionPolicy::RETURN:
+            case ExceptionPolicy::DEFERRED:
+                if (keepPendingException(exception, getExceptionPolicy() == ExceptionPolicy::RETURN)) {
+                    pthread_once(&threadKeyOnce, createThreadKey);
+                    if (!pthread_getspecific(threadKey)) {
+                        pthread_setspecific(threadKey, &threadKeyMarker);
+                    }
+                }
+                break;
+        }
+    }
+
+    void Utils::fatalError(const JNIException & exception)
+    {
+        LOGE("Fatal JNI error: %s", exception.what());
+        std::abort();
+    }
+
+#if SAFEJNI_EXCEPTIONS
+    void Utils::rethrowToJava(JNIEnv * env)
+    {
+        try {
+            throw;
+        }
+        catch (const JNIException & e) {
+            if (e.throwable()) {
+                env->Throw(e.throwable());
+                return;
+            }
+            env->ThrowNew(findClass("java/lang/RuntimeException"), e.what());
+        }
+        catch (const std::exception & e) {
+            env->ThrowNew(findClass("java/lang/RuntimeException"), e.what());
+        }
+        catch (...) {
+            env->ThrowNew(findClass("java/lang/RuntimeException"), "Unknown C++ exception");
+        }
+    }
+#endif
+    
+    // Native callbacks
+    namespace {
+
+        //handles given to com.safejni.NativeCallback. Invocations copy the shared_ptr, so closing a callback while it runs is safe
+        std::mutex callbacksMutex;
+        std::unordered_map<jlong, std::shared_ptr<NativeCallbackInvoker>> callbacks;
+        jlong nextCallbackHandle = 1;
+
+        std::shared_ptr<NativeCallbackInvoker> findCallback(jlong handle)
+        {
+            std::lock_guard<std::mutex> lock(callbacksMutex);
+            auto it = callbacks.find(handle);
+            return it != callbacks.end() ? it->second : nullptr;
+        }
+    }
+
+    jobject createNativeCallback(NativeCallbackInvoker invoker)
+    {
+        jlong handle;
+        {
+            std::lock_guard<std::mutex> lock(callbacksMutex);
+            handle = nextCallbackHandle++;
+            callbacks[handle] = std::make_shared<NativeCallbackInvoker>(std::move(invoker));
+        }
+        JNIEnv * jniEnv = Utils::getJNIEnvAttach();
+        const JNIMethodInfo & init = Utils::findMethod("com/safejni/NativeCallback", "<init>", "(J)V");
+        jobject callback = jniEnv->NewObject(init.classId, init.methodId, handle);
+        if (!callback) {
+            std::lock_guard<std::mutex> lock(callbacksMutex);
+            callbacks.erase(handle);
+        }
+        JNI_EXCEPTION_CHECK
+        return callback;
+    }
+
+    jobject createNativeProxy(const char * interfaceName, jobject callback)
+    {
+        JNIEnv * jniEnv = Utils::getJNIEnvAttach();
+        const JNIMethodInfo & proxy = Utils::findStaticMethod("com/safejni/NativeCallback", "proxy", "(Ljava/lang/Class;Lcom/safejni/NativeCallback;)Ljava/lang/Object;");
+        jobject result = jniEnv->CallStaticObjectMethod(proxy.classId, proxy.methodId, Utils::findClass(interfaceName), callback);
+        JNI_EXCEPTION_CHECK
+        return result;
+    }
+
+    // JNIExecutor
+    JNIExecutor::JNIExecutor(size_t numThreads, size_t queueCapacity): capacity(std::max<size_t>(queueCapacity, 1)), stopping(false)
+    {
+        for (size_t i = 0; i < std::max<size_t>(numThreads, 1); ++i) {
+            workers.push_back(std::thread(&JNIExecutor::run, this));
+        }
+    }
+
+    JNIExecutor::~JNIExecutor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        notEmpty.notify_all();
+        for (std::thread & worker: workers) {
+            worker.join();
+        }
+    }
+
+    JNIExecutor & JNIExecutor::shared()
+    {
+        //never destroyed: workers must not be joined while the VM is shutting down
+        static JNIExecutor * executor = new JNIExecutor();
+        return *executor;
+    }
+
+    void JNIExecutor::post(std::function<void()> task)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            notFull.wait(lock, [this]() { return queue.size() < capacity; });
+            queue.push_back(std::move(task));
+        }
+        notEmpty.notify_one();
+    }
+
+    bool JNIExecutor::tryPost(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (queue.size() >= capacity) {
+                return false;
+            }
+            queue.push_back(std::move(task));
+        }
+        notEmpty.notify_one();
+        return true;
+    }
+
+    void JNIExecutor::run()
+    {
+        //attached once, detached automatically when the worker exits
+        Utils::getJNIEnvAttach();
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                notEmpty.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            notFull.notify_one();
+
+            //no implicit LocalFrame: it would disable the per-call DeleteLocalRef of every call made by the task
+#if SAFEJNI_EXCEPTIONS
+            try {
+                task();
+            }
+            catch (const std::exception & e) {
+                LOGE("Unhandled exception in a JNIExecutor task: %s", e.what());
+            }
+            catch (...) {
+                LOGE("Unhandled exception in a JNIExecutor task");
+            }
+#else
+            task();
+#endif
+        }
+    }
+
+    std::shared_ptr<_jobject> makeSharedGlobalRef(jobject obj)
+    {
+        return std::shared_ptr<_jobject>(References::newGlobalRef(obj, nullptr, "callAsync"), [](jobject globalRef) {
+            References::deleteGlobalRef(globalRef, nullptr, "callAsync");
+        });
+    }
+
+    // CallRecorder
+    namespace {
+        std::atomic<jlong> nextRecorderId(1);
+    }
+
+    CallRecorder::CallRecorder(size_t maxCalls, size_t maxBytes, std::chrono::milliseconds maxDelay):
+        recorderId(nextRecorderId++), maxCalls(maxCalls), maxBytes(maxBytes), maxDelay(maxDelay), numCalls(0), registered(false), stopping(false)
+    {
+
+    }
+
+    CallRecorder::~CallRecorder()
+    {
+        {
+            std::lock_guard<std::mutex> lock(recordMutex);
+            stopping = true;
+        }
+        timerWake.notify_all();
+        if (timer.joinable()) {
+            timer.join();
+        }
+        if (numCalls || !newMethods.empty()) {
+            flushAndLog();
+        }
+        if (registered) {
+            ExceptionScope scope(ExceptionPolicy::RETURN);
+            JNIEnv * jniEnv = Utils::getJNIEnvAttach();
+            //already cached by the define call, so this can't throw
+            jclass dispatcher = Utils::findClass("com/safejni/BatchDispatcher");
+            jmethodID release = dispatcher ? jniEnv->GetStaticMethodID(dispatcher, "release", "(J)V") : nullptr;
+            if (release) {
+                jniEnv->CallStaticVoidMethod(dispatcher, release, recorderId);
+            }
+            jniEnv->ExceptionClear();
+        }
+    }
+
+    CallRecorder & CallRecorder::shared()
+    {
+        static CallRecorder * recorder = new CallRecorder();
+        return *recorder;
+    }
+
+    int32_t CallRecorder::registerMethod(const char * className, const char * methodName, const char * signature)
+    {
+        string key = string(className) + '.' + methodName + signature;
+        std::lock_guard<std::mutex> lock(recordMutex);
+        auto it = methods.find(key);
+        if (it != methods.end()) {
+            return it->second;
+        }
+        const int32_t index = static_cast<int32_t>(methods.size());
+        methods.emplace(std::move(key), index);
+        newMethods.push_back(className);
+        newMethods.push_back(methodName);
+        newMethods.push_back(signature);
+        return index;
+    }
+
+    size_t CallRecorder::pendingCalls()
+    {
+        std::lock_guard<std::mutex> lock(recordMutex);
+        return numCalls;
+    }
+
+    void CallRecorder::startTimer()
+    {
+        if (!timer.joinable()) {
+            timer = std::thread(&CallRecorder::runTimer, this);
+        }
+        timerWake.notify_one();
+    }
+
+    void CallRecorder::runTimer()
+    {
+        std::unique_lock<std::mutex> lock(recordMutex);
+        while (!stopping) {
+            if (!numCalls) {
+                timerWake.wait(lock);
+                continue;
+            }
+            const std::chrono::steady_clock::time_point deadline = firstCall + maxDelay;
+            if (std::chrono::steady_clock::now() < deadline) {
+                timerWake.wait_until(lock, deadline);
+                continue;
+            }
+            lock.unlock();
+            flushAndLog();
+            lock.lock();
+        }
+    }
+
+    void CallRecorder::flushAndLog()
+    {
+#if SAFEJNI_EXCEPTIONS
+        try {
+#endif
+            ExceptionScope scope(ExceptionPolicy::RETURN);
+            flush();
+            std::unique_ptr<JNIException> pending = Utils::takePendingException();
+            if (pending) {
+                LOGE("Recorded calls failed: %s", pending->what());
+            }
+#if SAFEJNI_EXCEPTIONS
+        }
+        catch (const std::exception & e) {
+            LOGE("Recorded calls failed: %s", e.what());
+        }
+#endif
+    }
+
+    void CallRecorder::flush()
+    {
+        std::lock_guard<std::mutex> flushLock(flushMutex);
+        vector<uint8_t> data;
+        vector<string> definitions;
+        size_t count;
+        {
+            std::lock_guard<std::mutex> lock(recordMutex);
+            data.swap(spareBuffer);
+            data.swap(buffer);
+            definitions.swap(newMethods);
+            count = numCalls;
+            numCalls = 0;
+        }
+        //the calls index the method table of the Java side: definitions it didn't get are queued again for the next
+        //flush, so later indexes stay right (the calls of a failed batch are dropped and the failure reported)
+        bool defined = definitions.empty();
+        auto restore = onScopeExit([&]() {
+            if (!defined) {
+                std::lock_guard<std::mutex> lock(recordMutex);
+                newMethods.insert(newMethods.begin(), definitions.begin(), definitions.end());
+            }
+            data.clear();
+            std::lock_guard<std::mutex> lock(recordMutex);
+            spareBuffer.swap(data);
+        });
+        JNIEnv * jniEnv = Utils::getJNIEnvAttach();
+        if (!defined) {
+            const JNIMethodInfo & define = Utils::findStaticMethod("com/safejni/BatchDispatcher", "define", "(J[Ljava/lang/String;)V");
+            jobjectArray javaDefinitions = Utils::toJObjectArray(definitions);
+            if (!javaDefinitions) {
+                return;
+            }
+            jniEnv->CallStaticVoidMethod(define.classId, define.methodId, recorderId, javaDefinitions);
+            jniEnv->DeleteLocalRef(javaDefinitions);
+            if (jniEnv->ExceptionCheck()) {
+                JNI_EXCEPTION_CHECK
+                return;
+            }
+            defined = true;
+            registered = true;
+        }
+        if (count) {
+            const JNIMethodInfo & dispatch = Utils::findStaticMethod("com/safejni/BatchDispatcher", "dispatch", "(JLjava/nio/ByteBuffer;I)V");
+            //the ByteBuffer is only read during the call
+            jobject byteBuffer = jniEnv->NewDirectByteBuffer(data.data(), static_cast<jlong>(data.size()));
+            if (!byteBuffer) {
+                JNI_EXCEPTION_CHECK
+                return;
+            }
+            jniEnv->CallStaticVoidMethod(dispatch.classId, dispatch.methodId, recorderId, byteBuffer, static_cast<jint>(count));
+            jniEnv->DeleteLocalRef(byteBuffer);
+            JNI_EXCEPTION_CHECK
+        }
+    }
+
+    // WarmUp
+    namespace {
+        const char * const warmUpKinds[] = {"class", "constructor", "method", "static", "field", "staticfield"};
+
+        WarmUpResult resolveWarmUpEntry(const WarmUpEntry & entry)
+        {
+            WarmUpResult result{entry, false, std::chrono::nanoseconds(0), string()};
+            const char * className = entry.className.c_str();
+            const char * name = entry.name.c_str();
+            const char * signature = entry.signature.c_str();
+            const auto start = std::chrono::steady_clock::now();
+#if SAFEJNI_EXCEPTIONS
+            try {
+                //failed lookups must throw whatever the policy is, the pending Java exception becomes the error
+                ExceptionScope scope(ExceptionPolicy::THROW);
+#endif
+                switch (entry.kind) {
+                    case WarmUpEntry::CLASS:
+                        Utils::findClassInfo(className);
+                        break;
+                    case WarmUpEntry::CONSTRUCTOR:
+                        Utils::findClassInfo(className);
+                        Utils::findMethod(className, "<init>", signature);
+                        break;
+                    case WarmUpEntry::METHOD:
+                        Utils::findMethod(className, name, signature);
+                        break;
+                    case WarmUpEntry::STATIC_METHOD:
+                        Utils::findStaticMethod(className, name, signature);
+                        break;
+                    case WarmUpEntry::FIELD:
+                        Utils::findField(className, name, signature);
+                        break;
+                    case WarmUpEntry::STATIC_FIELD:
+                        Utils::findStaticField(className, name, signature);
+                        break;
+                }
+                result.resolved = true;
+#if SAFEJNI_EXCEPTIONS
+            }
+            catch (const std::exception & e) {
+                result.error = e.what();
+            }
+#endif
+            result.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+            return result;
+        }
+
+        void reportWarmUp(const vector<WarmUpResult> & results, const WarmUpReport & report)
+        {
+            if (report) {
+                report(results);
+                return;
+            }
+            for (const WarmUpResult & result: results) {
+                if (!result.resolved) {
+                    LOGE("Warm-up failed: %s %s %s %s: %s", warmUpKinds[result.entry.kind], result.entry.className.c_str(),
+                         result.entry.name.c_str(), result.entry.signature.c_str(), result.error.c_str());
+                }
+            }
+        }
+
+        void startWarmUp(const WarmUp & warmUp, bool background, const WarmUpReport & report)
+        {
+            if (!background) {
+                reportWarmUp(warmUp.run(), report);
+                return;
+            }
+            WarmUp entries(warmUp);
+            JNIExecutor::shared().post([entries, report]() {
+                reportWarmUp(entries.run(), report);
+            });
+        }
+
+        //warm-ups declared by WarmUpRegistrar before SafeJNI is initialized
+        struct QueuedWarmUp
+        {
+            WarmUp warmUp;
+            bool background;
+            WarmUpReport report;
+        };
+
+        std::mutex warmUpMutex;
+        bool warmUpReady = false;
+
+        vector<QueuedWarmUp> & queuedWarmUps()
+        {
+            static vector<QueuedWarmUp> queue;
+            return queue;
+        }
+
+        void runQueuedWarmUps()
+        {
+            vector<QueuedWarmUp> queue;
+            {
+                std::lock_guard<std::mutex> lock(warmUpMutex);
+                warmUpReady = true;
+                queue.swap(queuedWarmUps());
+            }
+            for (const QueuedWarmUp & queued: queue) {
+                startWarmUp(queued.warmUp, queued.background, queued.report);
+            }
+        }
+
+        void registerWarmUp(const WarmUp & warmUp, bool background, WarmUpReport report)
+        {
+            {
+                std::lock_guard<std::mutex> lock(warmUpMutex);
+                if (!warmUpReady) {
+                    queuedWarmUps().push_back(QueuedWarmUp{warmUp, background, std::move(report)});
+                    return;
+                }
+            }
+            startWarmUp(warmUp, background, report);
+        }
+
+        //whitespace separated tokens of a manifest line, up to the comment
+        vector<string> splitWarmUpLine(const string & line)
+        {
+            vector<string> tokens;
+            size_t i = 0;
+            while (i < line.size() && line[i] != '#') {
+                if (isspace(static_cast<unsigned char>(line[i]))) {
+                    ++i;
+                    continue;
+                }
+                size_t end = i;
+                while (end < line.size() && line[end] != '#' && !isspace(static_cast<unsigned char>(line[end]))) {
+                    ++end;
+                }
+                tokens.push_back(line.substr(i, end - i));
+                i = end;
+            }
+            return tokens;
+        }
+    }
+
+    WarmUp & WarmUp::addClass(const string & className)
+    {
+        entryList.push_back(WarmUpEntry{WarmUpEntry::CLASS, className, string(), string()});
+        return *this;
+    }
+
+    WarmUp & WarmUp::addConstructor(const string & className, const string & signature)
+    {
+        entryList.push_back(WarmUpEntry{WarmUpEntry::CONSTRUCTOR, className, "<init>", signature});
+        return *this;
+    }
+
+    WarmUp & WarmUp::addMethod(const string & className, const string & name, const string & signature)
+    {
+        entryList.push_back(WarmUpEntry{WarmUpEntry::METHOD, className, name, signature});
+        return *this;
+    }
+
+    WarmUp & WarmUp::addStaticMethod(const string & className, const string & name, const string & signature)
+    {
+        entryList.push_back(WarmUpEntry{WarmUpEntry::STATIC_METHOD, className, name, signature});
+        return *this;
+    }
+
+    WarmUp & WarmUp::addField(const string & className, const string & name, const string & signature)
+    {
+        entryList.push_back(WarmUpEntry{WarmUpEntry::FIELD, className, name, signature});
+        return *this;
+    }
+
+    WarmUp & WarmUp::addStaticField(const string & className, const string & name, const string & signature)
+    {
+        entryList.push_back(WarmUpEntry{WarmUpEntry::STATIC_FIELD, className, name, signature});
+        return *this;
+    }
+
+    bool WarmUp::parse(const string & manifest, string * error)
+    {
+        WarmUp parsed;
+        size_t lineNumber = 0;
+        size_t start = 0;
+        while (start <= manifest.size()) {
+            size_t end = manifest.find('\n', start);
+            if (end == string::npos) {
+                end = manifest.size();
+            }
+            ++lineNumber;
+            const vector<string> tokens = splitWarmUpLine(manifest.substr(start, end - start));
+            start = end + 1;
+            if (tokens.empty()) {
+                continue;
+            }
+
+            const string & kind = tokens[0];
+            size_t expected = 4;
+            if (kind == "class") {
+                expected = 2;
+            }
+            else if (kind == "constructor") {
+                expected = 3;
+            }
+            else if (kind != "method" && kind != "static" && kind != "field" && kind != "staticfield") {
+                if (error) {
+                    *error = "line " + std::to_string(lineNumber) + ": unknown entry '" + kind + "'";
+                }
+                return false;
+            }
+            if (tokens.size() != expected) {
+                if (error) {
+                    *error = "line " + std::to_string(lineNumber) + ": '" + kind + "' takes " + std::to_string(expected - 1) + " values";
+                }
+                return false;
+            }
+
+            if (kind == "class") {
+                parsed.addClass(tokens[1]);
+            }
+            else if (kind == "constructor") {
+                parsed.addConstructor(tokens[1], tokens[2]);
+            }
+            else if (kind == "method") {
+                parsed.addMethod(tokens[1], tokens[2], tokens[3]);
+            }
+            else if (kind == "static") {
+                parsed.addStaticMethod(tokens[1], tokens[2], tokens[3]);
+            }
+            else if (kind == "field") {
+                parsed.addField(tokens[1], tokens[2], tokens[3]);
+            }
+            else {
+                parsed.addStaticField(tokens[1], tokens[2], tokens[3]);
+            }
+        }
+        entryList.insert(entryList.end(), parsed.entryList.begin(), parsed.entryList.end());
+        return true;
+    }
+
+    bool WarmUp::parseFile(const char * path, string * error)
+    {
+        FILE * file = fopen(path, "rb");
+        if (!file) {
+            if (error) {
+                *error = string("could not open ") + path;
+            }
+            return false;
+        }
+        string manifest;
+        char chunk[4096];
+        size_t read;
+        while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            manifest.append(chunk, read);
+        }
+        fclose(file);
+        return parse(manifest, error);
+    }
+
+    vector<WarmUpResult> WarmUp::run() const
+    {
+        vector<WarmUpResult> results;
+        results.reserve(entryList.size());
+        for (const WarmUpEntry & entry: entryList) {
+            results.push_back(resolveWarmUpEntry(entry));
+        }
+        return results;
+    }
+
+    std::future<vector<WarmUpResult>> WarmUp::runAsync() const
+    {
+        WarmUp entries(*this);
+        return JNIExecutor::shared().submit([entries]() { return entries.run(); });
+    }
 
-using std::string;
-using std::vector;
+    string WarmUp::describe(const vector<WarmUpResult> & results)
+    {
+        vector<const WarmUpResult *> sorted;
+        for (const WarmUpResult & result: results) {
+            sorted.push_back(&result);
+        }
+        std::stable_sort(sorted.begin(), sorted.end(), [](const WarmUpResult * a, const WarmUpResult * b) {
+            return !a->resolved && b->resolved;
+        });
 
-namespace safejni {
-    
-	JNIEnv* Utils::env = 0;
-    JavaVM* Utils::javaVM = 0;
+        string text;
+        for (const WarmUpResult * result: sorted) {
+            char time[32];
+            snprintf(time, sizeof(time), "%10.3f ms ", result->duration.count() / 1e6);
+            text += result->resolved ? "ok     " : "FAILED ";
+            text += time;
+            text += warmUpKinds[result->entry.kind];
+            text += " " + result->entry.className;
+            if (!result->entry.name.empty()) {
+                text += " " + result->entry.name;
+            }
+            if (!result->entry.signature.empty()) {
+                text += " " + result->entry.signature;
+            }
+            if (!result->resolved) {
+                text += ": " + result->error;
+            }
+            text += "\n";
+        }
+        return text;
+    }
 
+    void init(JavaVM * javaVM, JNIEnv * env, const WarmUp & warmUp, bool background, WarmUpReport report)
+    {
+        Utils::init(javaVM, env);
+        startWarmUp(warmUp, background, report);
+    }
 
-    void init(JavaVM * vm, JNIEnv * env)
+    WarmUpRegistrar::WarmUpRegistrar(const WarmUp & warmUp, bool background, WarmUpReport report)
     {
-        Utils::init(vm, env);
+        registerWarmUp(warmUp, background, std::move(report));
     }
-    
-    JNIMethodInfo::JNIMethodInfo(jclass classId, jmethodID methodId): classId(classId), methodId(methodId)
+
+    WarmUpRegistrar::WarmUpRegistrar(const char * manifest, bool background, WarmUpReport report)
     {
-        
+        WarmUp warmUp;
+        string error;
+        if (!warmUp.parse(manifest, &error)) {
+            LOGE("Invalid warm-up manifest: %s", error.c_str());
+            return;
+        }
+        registerWarmUp(warmUp, background, std::move(report));
     }
-    
-    JNIMethodInfo::~JNIMethodInfo()
+
+    // LocalFrame
+    thread_local int LocalFrame::depth = 0;
+
+    LocalFrame::LocalFrame(jint capacity): jniEnv(Utils::getJNIEnvAttach()), open(false)
     {
-     	if (classId) {
-     		Utils::getJNIEnv()->DeleteLocalRef(classId);
-     	}
+        if (jniEnv->PushLocalFrame(capacity) < 0) {
+            JNI_EXCEPTION_CHECK
+            SAFEJNI_THROW(JNIException("Could not push a JNI local frame."));
+        }
+        open = true;
+        ++depth;
     }
-    
 
-    JNIException::JNIException(const std::string & message): message(message)
+    LocalFrame::~LocalFrame()
     {
-        LOGE("JNI Exception: %s", message.c_str());
+        if (open) {
+            pop(jobject(nullptr));
+        }
     }
 
-    const char* JNIException::what() const throw()
+    jobject LocalFrame::pop(jobject result)
     {
-        return message.c_str();
+        if (!open) {
+            return nullptr;
+        }
+        open = false;
+        --depth;
+        return jniEnv->PopLocalFrame(result);
     }
 
-    void Utils::init(JavaVM * vm, JNIEnv * jniEnv)
+    // Call statistics
+#ifdef SAFEJNI_ENABLE_STATS
+    constexpr int JNICallStats::NUM_BUCKETS;
+    thread_local JNIStatsScope * JNIStatsScope::currentScope = nullptr;
+
+    JNICallStats::JNICallStats()
     {
-        Utils::javaVM = vm;
-        Utils::env = jniEnv;
+        reset();
     }
 
-    JNIEnv * Utils::getJNIEnvAttach() 
+    void JNICallStats::record(Phase phase, uint64_t nanos)
     {
-        if (javaVM) {
-            int status = javaVM->AttachCurrentThread(&env, NULL);
-            if (status < 0) {
-                throw JNIException("Could not attach the JNI environment to the current thread.");
+        int bucket = nanos ? 63 - __builtin_clzll(nanos) : 0;
+        totalNanos[phase].fetch_add(nanos, std::memory_order_relaxed);
+        histogram[phase][std::min(bucket, NUM_BUCKETS - 1)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void JNICallStats::reset()
+    {
+        calls.store(0, std::memory_order_relaxed);
+        cacheHits.store(0, std::memory_order_relaxed);
+        cacheMisses.store(0, std::memory_order_relaxed);
+        bytesMarshalled.store(0, std::memory_order_relaxed);
+        bytesUnmarshalled.store(0, std::memory_order_relaxed);
+        localRefs.store(0, std::memory_order_relaxed);
+        for (int phase = 0; phase < NUM_PHASES; ++phase) {
+            totalNanos[phase].store(0, std::memory_order_relaxed);
+            for (int bucket = 0; bucket < NUM_BUCKETS; ++bucket) {
+                histogram[phase][bucket].store(0, std::memory_order_relaxed);
             }
         }
+    }
 
-        return env;
+    JNIStatsScope::JNIStatsScope(JNICallStats * stats, JNIStatsClock::time_point start): stats(stats), previous(currentScope), start(start), opened(JNIStatsClock::now()),
+        marshalTime(JNIStatsClock::duration::zero()), unmarshalTime(JNIStatsClock::duration::zero()), bytesIn(0), bytesOut(0), localRefs(0)
+    {
+        currentScope = this;
     }
 
-	jstring Utils::toJString(const char * str)
-	{
-	 	return env->NewStringUTF(str);
-	}
-    
-    jobjectArray Utils::toJObjectArray(const std::vector<std::string> & data)
+    JNIStatsScope::~JNIStatsScope()
     {
-        jclass classId = env->FindClass("java/lang/String");
-        jint size = data.size();
-        jobjectArray joa = env->NewObjectArray(size, classId, 0);
-        
-        for (int i = 0; i < size; i++)
-        {
-            jstring jstr = toJString(data[i]);
-            env->SetObjectArrayElement(joa, i, jstr);
-            
+        currentScope = previous;
+        if (!stats) {
+            return;
         }
-        env->DeleteLocalRef(classId);
-        
-        JNI_EXCEPTION_CHECK
-        return joa;
+        auto nanos = [](JNIStatsClock::duration elapsed) {
+            return static_cast<uint64_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        };
+        JNIStatsClock::duration total = JNIStatsClock::now() - opened;
+        stats->calls.fetch_add(1, std::memory_order_relaxed);
+        stats->bytesMarshalled.fetch_add(bytesIn, std::memory_order_relaxed);
+        stats->bytesUnmarshalled.fetch_add(bytesOut, std::memory_order_relaxed);
+        stats->localRefs.fetch_add(localRefs, std::memory_order_relaxed);
+        stats->record(JNICallStats::LOOKUP, nanos(opened - start));
+        stats->record(JNICallStats::MARSHAL, nanos(marshalTime));
+        stats->record(JNICallStats::CALL, nanos(total - marshalTime - unmarshalTime));
+        stats->record(JNICallStats::UNMARSHAL, nanos(unmarshalTime));
     }
-    
-    jbyteArray Utils::toJObjectArray(const std::vector<uint8_t> & data)
+
+    double MethodStats::cacheHitRate() const
     {
-        jbyteArray jba = env->NewByteArray(data.size());
-        env->SetByteArrayRegion(jba, 0, data.size(), (const jbyte*)&data[0]);
-        JNI_EXCEPTION_CHECK
-        return jba;
+        uint64_t lookups = cacheHits + cacheMisses;
+        return lookups ? static_cast<double>(cacheHits) / lookups : 0.0;
     }
 
-    jobject Utils::toHashMap(const std::map<std::string, std::string> & data)
+    uint64_t MethodStats::percentile(JNICallStats::Phase phase, double percent) const
     {
-        jclass classId = env->FindClass("java/util/HashMap");
-        jmethodID methodId = env->GetMethodID(classId, "<init>", "()V");
-        jobject hashmap = env->NewObject(classId, methodId);
-        
-        methodId = env->GetMethodID(classId, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
-        for (auto & item : data)
-        {
-            jstring key = env->NewStringUTF(item.first.c_str());
-            jstring value = env->NewStringUTF(item.second.c_str());
-            env->CallObjectMethod(hashmap, methodId, key, value);
-            
-            env->DeleteLocalRef(key);
-            env->DeleteLocalRef(value);
+        uint64_t count = 0;
+        for (int bucket = 0; bucket < JNICallStats::NUM_BUCKETS; ++bucket) {
+            count += histogram[phase][bucket];
         }
-        env->DeleteLocalRef(classId);
-        JNI_EXCEPTION_CHECK
-        return hashmap;
+        const double target = count * std::min(std::max(percent, 0.0), 100.0) / 100.0;
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < JNICallStats::NUM_BUCKETS; ++bucket) {
+            seen += histogram[phase][bucket];
+            if (seen && seen >= target) {
+                return (uint64_t(1) << (bucket + 1)) - 1;
+            }
+        }
+        return 0;
     }
-    
-    std::string Utils::toString(jstring str)
-    {
-        if (!str) {
-            return std::string();
+
+    namespace {
+        const char * phaseNames[JNICallStats::NUM_PHASES] = {"lookup", "marshal", "call", "unmarshal"};
+
+        uint64_t totalTime(const MethodStats & method)
+        {
+            uint64_t nanos = 0;
+            for (int phase = 0; phase < JNICallStats::NUM_PHASES; ++phase) {
+                nanos += method.totalNanos[phase];
+            }
+            return nanos;
         }
-        jboolean isCopy;
-        const char* chars = env->GetStringUTFChars(str, &isCopy);
-        std::string s;
-        if (chars) {
-            s = chars;
-            env->ReleaseStringUTFChars(str, chars);
+
+        void appendFormat(string & out, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+        void appendFormat(string & out, const char * format, ...)
+        {
+            char buffer[512];
+            va_list args;
+            va_start(args, format);
+            int length = vsnprintf(buffer, sizeof(buffer), format, args);
+            va_end(args);
+            if (length > 0) {
+                out.append(buffer, std::min(static_cast<size_t>(length), sizeof(buffer) - 1));
+            }
+        }
+
+        void appendJSONString(string & out, const string & value)
+        {
+            out += '"';
+            for (char c: value) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                }
+                out += c;
+            }
+            out += '"';
         }
-        JNI_EXCEPTION_CHECK
-        return s;
     }
-    
-    std::vector<std::string> Utils::toVectorString(jobjectArray array)
+
+    std::vector<MethodStats> CallStats::snapshot()
     {
-        std::vector<std::string> result;
-        if (array) {
-            jint length = env->GetArrayLength(array);
-            
-            for (int i = 0; i < length; i++) {
-                jobject valueJObject = env->GetObjectArrayElement(array, i);
-                    result.push_back(toString((jstring)valueJObject));
-                    env->DeleteLocalRef(valueJObject);
+        std::vector<MethodStats> result;
+        memberCache.forEach([&](const MemberEntry & entry) {
+            const JNICallStats & stats = entry.stats;
+            MethodStats method;
+            method.className = entry.className;
+            method.name = entry.memberName;
+            method.signature = entry.signature;
+            method.field = entry.kind == INSTANCE_FIELD || entry.kind == STATIC_FIELD;
+            method.calls = stats.calls.load(std::memory_order_relaxed);
+            method.cacheHits = stats.cacheHits.load(std::memory_order_relaxed);
+            method.cacheMisses = stats.cacheMisses.load(std::memory_order_relaxed);
+            method.bytesMarshalled = stats.bytesMarshalled.load(std::memory_order_relaxed);
+            method.bytesUnmarshalled = stats.bytesUnmarshalled.load(std::memory_order_relaxed);
+            method.localRefs = stats.localRefs.load(std::memory_order_relaxed);
+            for (int phase = 0; phase < JNICallStats::NUM_PHASES; ++phase) {
+                method.totalNanos[phase] = stats.totalNanos[phase].load(std::memory_order_relaxed);
+                for (int bucket = 0; bucket < JNICallStats::NUM_BUCKETS; ++bucket) {
+                    method.histogram[phase][bucket] = stats.histogram[phase][bucket].load(std::memory_order_relaxed);
                 }
-        }
-        JNI_EXCEPTION_CHECK
+            }
+            result.push_back(method);
+        });
+        std::sort(result.begin(), result.end(), [](const MethodStats & a, const MethodStats & b) {
+            return totalTime(a) > totalTime(b);
+        });
         return result;
     }
-    
-    std::vector<uint8_t> Utils::toVectorByte(jbyteArray array)
+
+    void CallStats::reset()
+    {
+        memberCache.forEach([](MemberEntry & entry) {
+            entry.stats.reset();
+        });
+    }
+
+    std::string CallStats::dumpText()
     {
-        if (!array) {
-            return std::vector<uint8_t>();
+        string out;
+        for (const MethodStats & method: snapshot()) {
+            appendFormat(out, "%s.%s%s: %llu calls, %.1f%% cache hits", method.className.c_str(), method.name.c_str(), method.signature.c_str(),
+                         static_cast<unsigned long long>(method.calls), method.cacheHitRate() * 100.0);
+            for (int phase = 0; phase < JNICallStats::NUM_PHASES && method.calls; ++phase) {
+                JNICallStats::Phase p = static_cast<JNICallStats::Phase>(phase);
+                appendFormat(out, ", %s avg %.2fus p99 <%.2fus", phaseNames[phase], method.totalNanos[phase] / 1000.0 / method.calls, method.percentile(p, 99) / 1000.0);
+            }
+            appendFormat(out, ", %llu bytes in, %llu bytes out, %llu local refs\n", static_cast<unsigned long long>(method.bytesMarshalled),
+                         static_cast<unsigned long long>(method.bytesUnmarshalled), static_cast<unsigned long long>(method.localRefs));
         }
-        jsize size = env->GetArrayLength(array);
-        std::vector<uint8_t> result(size);
-        env->GetByteArrayRegion(array, 0, size, (jbyte*)&result[0]);
-        JNI_EXCEPTION_CHECK
-        return result;
+        return out;
     }
 
-    std::vector<float> Utils::toVectorFloat(jfloatArray array)
+    std::string CallStats::dumpJSON()
     {
-        if (!array) {
-            return std::vector<float>();
+        string out = "[";
+        bool first = true;
+        for (const MethodStats & method: snapshot()) {
+            out += first ? "\n" : ",\n";
+            first = false;
+            out += "{\"class\":";
+            appendJSONString(out, method.className);
+            out += ",\"name\":";
+            appendJSONString(out, method.name);
+            out += ",\"signature\":";
+            appendJSONString(out, method.signature);
+            appendFormat(out, ",\"field\":%s,\"calls\":%llu,\"cacheHits\":%llu,\"cacheMisses\":%llu,\"bytesMarshalled\":%llu,\"bytesUnmarshalled\":%llu,\"localRefs\":%llu,\"phases\":{",
+                         method.field ? "true" : "false", static_cast<unsigned long long>(method.calls), static_cast<unsigned long long>(method.cacheHits),
+                         static_cast<unsigned long long>(method.cacheMisses), static_cast<unsigned long long>(method.bytesMarshalled),
+                         static_cast<unsigned long long>(method.bytesUnmarshalled), static_cast<unsigned long long>(method.localRefs));
+            for (int phase = 0; phase < JNICallStats::NUM_PHASES; ++phase) {
+                appendFormat(out, "%s\"%s\":{\"totalNanos\":%llu,\"histogram\":[", phase ? "," : "", phaseNames[phase], static_cast<unsigned long long>(method.totalNanos[phase]));
+                for (int bucket = 0; bucket < JNICallStats::NUM_BUCKETS; ++bucket) {
+                    appendFormat(out, "%s%llu", bucket ? "," : "", static_cast<unsigned long long>(method.histogram[phase][bucket]));
+                }
+                out += "]}";
+            }
+            out += "}}";
         }
-        jsize size = env->GetArrayLength(array);
-        std::vector<float> result(size);
-        env->GetFloatArrayRegion(array, 0, size, (jfloat*)&result[0]);
-        JNI_EXCEPTION_CHECK
-        return result;
+        out += "\n]\n";
+        return out;
     }
+#endif
 
-    std::vector<jobject> Utils::toVectorJObject(jobjectArray array)
+    // NativeBuffer
+    NativeBuffer::NativeBuffer(size_t size): bufferData(new uint8_t[size]), bufferSize(size), bufferOwner(static_cast<uint8_t*>(bufferData), std::default_delete<uint8_t[]>())
     {
-        std::vector<jobject> result;
-        if (array) {
-            jint length = env->GetArrayLength(array);
-            
-            for (int i = 0; i < length; i++) {
-                jobject valueJObject = env->GetObjectArrayElement(array, i);
-                result.push_back(valueJObject);
+    }
+
+    // JNIObject pool
+    namespace {
+        const size_t POOL_GRANULARITY = 16;
+        const size_t POOL_MAX_BLOCK_SIZE = 256;
+        const size_t POOL_BLOCKS_PER_CHUNK = 64;
+
+        struct PoolBlock
+        {
+            PoolBlock * next;
+        };
+
+        struct BlockPool
+        {
+            std::mutex mutex;
+            PoolBlock * freeBlocks;
+        };
+
+        BlockPool blockPools[POOL_MAX_BLOCK_SIZE / POOL_GRANULARITY];
+    }
+
+    void * JNIObjectPool::allocate(size_t size)
+    {
+        if (size > POOL_MAX_BLOCK_SIZE) {
+            return ::operator new(size);
+        }
+        const size_t index = (size - 1) / POOL_GRANULARITY;
+        BlockPool & pool = blockPools[index];
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (!pool.freeBlocks) {
+            const size_t blockSize = (index + 1) * POOL_GRANULARITY;
+            uint8_t * chunk = static_cast<uint8_t*>(::operator new(blockSize * POOL_BLOCKS_PER_CHUNK));
+            for (size_t i = 0; i < POOL_BLOCKS_PER_CHUNK; ++i) {
+                PoolBlock * block = reinterpret_cast<PoolBlock*>(chunk + i * blockSize);
+                block->next = pool.freeBlocks;
+                pool.freeBlocks = block;
             }
         }
-        return result;
+        PoolBlock * block = pool.freeBlocks;
+        pool.freeBlocks = block->next;
+        return block;
     }
-    
-	SPJNIMethodInfo Utils::getStaticMethodInfo(const string& className, const string& methodName, const char * signature)
+
+    void JNIObjectPool::deallocate(void * block, size_t size)
     {
-        jclass classId = 0;
-        jmethodID methodId = 0;
-        classId = env->FindClass(className.c_str());
-        JNI_EXCEPTION_CHECK
+        if (size > POOL_MAX_BLOCK_SIZE) {
+            ::operator delete(block);
+            return;
+        }
+        BlockPool & pool = blockPools[(size - 1) / POOL_GRANULARITY];
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        PoolBlock * freed = static_cast<PoolBlock*>(block);
+        freed->next = pool.freeBlocks;
+        pool.freeBlocks = freed;
+    }
+
+    // References
+    namespace {
+        std::atomic<size_t> globalRefCount(0);
+        std::atomic<size_t> weakRefCount(0);
+        std::atomic<size_t> refWarnAt(0);
+        std::atomic<size_t> refLimit(0);
+        std::mutex refBudgetMutex;
+        std::function<void(const RefStats &)> refWarning;
+
+        std::mutex refSitesMutex;
+        //keyed by content: the same __FILE__:__LINE__ literal may have a different address in each translation unit
+        std::unordered_map<string, size_t> refSites;
+
+        struct RefSlot
+        {
+            jobject ref;
+            uint32_t generation;
+            bool weak;
+            const char * site;
+            uint32_t nextFree;
+        };
+
+        const uint32_t NO_SLOT = UINT32_MAX;
+        std::mutex refSlotsMutex;
+        vector<RefSlot> refSlots;
+        uint32_t freeRefSlot = NO_SLOT;
 
-        if (!classId){
-            throw JNIException(string("Could not find the given class: ") + className);
+        //counts a new ref, refusing it when the budget limit is reached
+        void countRef(std::atomic<size_t> & counter, const JNIClassInfo * classInfo, const char * site)
+        {
+            const size_t count = ++counter + (&counter == &globalRefCount ? weakRefCount.load() : globalRefCount.load());
+            const size_t limit = refLimit.load(std::memory_order_relaxed);
+            if (limit && count > limit) {
+                --counter;
+                SAFEJNI_THROW(JNIException("The JNI reference budget has been exceeded."));
+            }
+            if (classInfo) {
+                ++classInfo->liveRefs;
+            }
+            if (site) {
+                std::lock_guard<std::mutex> lock(refSitesMutex);
+                ++refSites[site];
+            }
+            if (count == refWarnAt.load(std::memory_order_relaxed)) {
+                std::function<void(const RefStats &)> warning;
+                {
+                    std::lock_guard<std::mutex> lock(refBudgetMutex);
+                    warning = refWarning;
+                }
+                if (warning) {
+                    warning(References::stats());
+                }
+                else {
+                    LOGE("%zu JNI global and weak references are alive", count);
+                }
+            }
         }
-        
-        methodId = env->GetStaticMethodID(classId, methodName.c_str(), signature);
-        JNI_EXCEPTION_CHECK
-        
-        if (!methodId){
-            throw JNIException(string("Could not find the given '") + methodName + string("' static method in the given '") + className + string("' class using the '") + signature + string("' signature."));
+
+        void uncountRef(std::atomic<size_t> & counter, const JNIClassInfo * classInfo, const char * site)
+        {
+            --counter;
+            if (classInfo) {
+                --classInfo->liveRefs;
+            }
+            if (site) {
+                std::lock_guard<std::mutex> lock(refSitesMutex);
+                auto it = refSites.find(site);
+                if (it != refSites.end() && --it->second == 0) {
+                    refSites.erase(it);
+                }
+            }
         }
-        
-        return SPJNIMethodInfo(new JNIMethodInfo(classId, methodId));
     }
-    
-    SPJNIMethodInfo Utils::getMethodInfo(const string& className, const string& methodName, const char * signature)
+
+    void JNILocalRefDeleter::operator()(jobject obj) const
     {
-        jclass classId = 0;
-        jmethodID methodId = 0;
-        classId = env->FindClass(className.c_str());
+        Utils::getJNIEnvAttach()->DeleteLocalRef(obj);
+    }
 
-        JNI_EXCEPTION_CHECK
-        if (!classId){
-            throw JNIException(string("Could not find the given class: ") + className);
+    jobject References::newGlobalRef(jobject obj, const JNIClassInfo * classInfo, const char * site)
+    {
+        if (!obj) {
+            return nullptr;
         }
-        
-        methodId = env->GetMethodID(classId, methodName.c_str(), signature);
-        JNI_EXCEPTION_CHECK
-        
-        if (!methodId){
-            throw JNIException(string("Could not find the given '") + methodName + string("' static method in the given '") + className + string("' class using the '") + signature + string("' signature."));
+        countRef(globalRefCount, classInfo, site);
+        return Utils::getJNIEnvAttach()->NewGlobalRef(obj);
+    }
+
+    jobject References::newWeakGlobalRef(jobject obj, const JNIClassInfo * classInfo, const char * site)
+    {
+        if (!obj) {
+            return nullptr;
         }
-        
-        return SPJNIMethodInfo(new JNIMethodInfo(classId, methodId));
-    }   
+        countRef(weakRefCount, classInfo, site);
+        return Utils::getJNIEnvAttach()->NewWeakGlobalRef(obj);
+    }
+
+    void References::deleteGlobalRef(jobject ref, const JNIClassInfo * classInfo, const char * site)
+    {
+        if (ref) {
+            Utils::getJNIEnvAttach()->DeleteGlobalRef(ref);
+            uncountRef(globalRefCount, classInfo, site);
+        }
+    }
+
+    void References::deleteWeakGlobalRef(jobject ref, const JNIClassInfo * classInfo, const char * site)
+    {
+        if (ref) {
+            Utils::getJNIEnvAttach()->DeleteWeakGlobalRef(static_cast<jweak>(ref));
+            uncountRef(weakRefCount, classInfo, site);
+        }
+    }
+
+    LocalRef References::promote(jobject weakRef)
+    {
+        //NewLocalRef returns null once the object has been collected
+        return LocalRef(weakRef ? Utils::getJNIEnvAttach()->NewLocalRef(weakRef) : nullptr);
+    }
+
+    RefStats References::stats()
+    {
+        return RefStats{globalRefCount.load(), weakRefCount.load()};
+    }
+
+    std::vector<std::pair<std::string, size_t>> References::siteStats()
+    {
+        std::lock_guard<std::mutex> lock(refSitesMutex);
+        return std::vector<std::pair<std::string, size_t>>(refSites.begin(), refSites.end());
+    }
+
+    void References::setBudget(size_t warnAt, size_t limit, std::function<void(const RefStats &)> warning)
+    {
+        std::lock_guard<std::mutex> lock(refBudgetMutex);
+        refWarning = std::move(warning);
+        refWarnAt = warnAt;
+        refLimit = limit;
+    }
+
+    RefHandle References::acquire(jobject obj, bool weak, const char * site)
+    {
+        if (!obj) {
+            return RefHandle{0, 0};
+        }
+        site = site ? site : "RefHandle";
+        jobject ref = weak ? newWeakGlobalRef(obj, nullptr, site) : newGlobalRef(obj, nullptr, site);
+        std::lock_guard<std::mutex> lock(refSlotsMutex);
+        uint32_t index = freeRefSlot;
+        if (index == NO_SLOT) {
+            index = static_cast<uint32_t>(refSlots.size());
+            refSlots.push_back(RefSlot{nullptr, 0, false, nullptr, NO_SLOT});
+        }
+        else {
+            freeRefSlot = refSlots[index].nextFree;
+        }
+        RefSlot & slot = refSlots[index];
+        //generation 0 is the null handle
+        slot.generation = slot.generation + 1 ? slot.generation + 1 : 1;
+        slot.ref = ref;
+        slot.weak = weak;
+        slot.site = site;
+        slot.nextFree = NO_SLOT;
+        return RefHandle{index, slot.generation};
+    }
+
+    LocalRef References::get(RefHandle handle)
+    {
+        std::lock_guard<std::mutex> lock(refSlotsMutex);
+        if (handle.index >= refSlots.size() || refSlots[handle.index].generation != handle.generation || !refSlots[handle.index].ref) {
+            return LocalRef();
+        }
+        return LocalRef(Utils::getJNIEnvAttach()->NewLocalRef(refSlots[handle.index].ref));
+    }
 
-    void Utils::checkException()
+    void References::release(RefHandle handle)
     {
-        if (env->ExceptionCheck())
+        jobject ref;
+        bool weak;
+        const char * site;
         {
-            jthrowable jthrowable = env->ExceptionOccurred();
-            env->ExceptionDescribe();
-            env->ExceptionClear();
-            SPJNIMethodInfo methodInfo = getMethodInfo("java/lang/Throwable", "getMessage", "()Ljava/lang/String;");
-            string exceptionMessage= toString(reinterpret_cast<jstring>(env->CallObjectMethod(jthrowable, methodInfo->methodId)));
-            throw new JNIException(exceptionMessage);
+            std::lock_guard<std::mutex> lock(refSlotsMutex);
+            if (handle.index >= refSlots.size() || refSlots[handle.index].generation != handle.generation || !refSlots[handle.index].ref) {
+                return;
+            }
+            RefSlot & slot = refSlots[handle.index];
+            ref = slot.ref;
+            weak = slot.weak;
+            site = slot.site;
+            slot.ref = nullptr;
+            slot.nextFree = freeRefSlot;
+            freeRefSlot = handle.index;
+        }
+        if (weak) {
+            deleteWeakGlobalRef(ref, nullptr, site);
+        }
+        else {
+            deleteGlobalRef(ref, nullptr, site);
         }
     }
-    
+
     // JNIObject
+    JNIObject::JNIObject(jobject instance, const JNIClassInfo * classInfo, RefType refType, const char * site): instance(instance), classInfo(classInfo), refType(refType), site(site)
+    {
+
+    }
+
     JNIObject::~JNIObject() {
-        if (instance) {
-            JNIEnv* jniEnv = Utils::getJNIEnv();
-            if (globalRef) {
-                jniEnv->DeleteGlobalRef(instance);
-            }
-            else {
-                jniEnv->DeleteLocalRef(instance);
-            }
+        if (refType == WEAK) {
+            References::deleteWeakGlobalRef(instance, classInfo.load(std::memory_order_relaxed), site);
+        }
+        else {
+            References::deleteGlobalRef(instance, classInfo.load(std::memory_order_relaxed), site);
         }
     }
     
-    void JNIObject::makeGlobalRef() {
-        if (!globalRef) {
-            this->instance = Utils::getJNIEnvAttach()->NewGlobalRef(this->instance);
-            globalRef = true;
+    void JNIObject::makeGlobalRef(const char * site) {
+        if (refType == WEAK) {
+            const JNIClassInfo * info = classInfo.load(std::memory_order_relaxed);
+            const char * weakSite = this->site;
+            if (site) {
+                this->site = site;
+            }
+            LocalRef strong = lock();
+            jobject weakRef = instance;
+            instance = References::newGlobalRef(strong.get(), info, this->site);
+            refType = GLOBAL;
+            References::deleteWeakGlobalRef(weakRef, info, weakSite);
+        }
+    }
+
+    const JNIClassInfo * JNIObject::getClassInfo() const
+    {
+        const JNIClassInfo * info = classInfo.load(std::memory_order_acquire);
+        if (!info && instance) {
+            JNIEnv * jniEnv = Utils::getJNIEnvAttach();
+            LocalRef strong = lock();
+            if (!strong) {
+                return nullptr;
+            }
+            LocalRef objectClass(jniEnv->GetObjectClass(strong.get()));
+            const JNIMethodInfo & getName = Utils::findMethod("java/lang/Class", "getName", "()Ljava/lang/String;");
+            LocalRef javaName(jniEnv->CallObjectMethod(objectClass.get(), getName.methodId));
+            JNI_EXCEPTION_CHECK
+            string name = Utils::toString(static_cast<jstring>(javaName.get()));
+            std::replace(name.begin(), name.end(), '.', '/');
+            const JNIClassInfo * resolved = &Utils::findClassInfo(name.c_str());
+            //the thread that stores the class makes it count the ref
+            if (classInfo.compare_exchange_strong(info, resolved, std::memory_order_acq_rel)) {
+                ++resolved->liveRefs;
+                info = resolved;
+            }
         }
+        return info;
+    }
+
+    const std::string & JNIObject::className() const
+    {
+        static const string empty;
+        const JNIClassInfo * info = getClassInfo();
+        return info ? info->className : empty;
+    }
+
+    LocalRef JNIObject::lock() const
+    {
+        return LocalRef(instance ? Utils::getJNIEnvAttach()->NewLocalRef(instance) : nullptr);
     }
     
-    std::shared_ptr<JNIObject> JNIObject::create(jobject obj, const std::string & className)
+    std::shared_ptr<JNIObject> JNIObject::create(jobject obj, const std::string & className, const char * site)
+    {
+        return create(obj, Utils::findClassInfo(className.c_str()), site);
+    }
+
+    std::shared_ptr<JNIObject> JNIObject::create(jobject obj, const JNIClassInfo & classInfo, const char * site)
+    {
+        return std::allocate_shared<JNIObject>(JNIPoolAllocator<JNIObject>(), References::newGlobalRef(obj, &classInfo, site), &classInfo, GLOBAL, site);
+    }
+
+    std::shared_ptr<JNIObject> JNIObject::createFromLocal(jobject localRef)
     {
-        JNIObject * result = new JNIObject();
-        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
-        result->jniClassName = className;
-        result->instance = jniEnv->NewGlobalRef(obj);
-        result->makeGlobalRef();
-        return std::shared_ptr<JNIObject>(result);
+        std::shared_ptr<JNIObject> result = std::allocate_shared<JNIObject>(JNIPoolAllocator<JNIObject>(), References::newGlobalRef(localRef), nullptr, GLOBAL);
+        if (localRef) {
+            Utils::getJNIEnvAttach()->DeleteLocalRef(localRef);
+        }
+        return result;
     }
     
     std::shared_ptr<JNIObject> JNIObject::createWeak(jobject obj)
     {
-        JNIObject * result = new JNIObject();
-        result->instance = obj;
-        return std::shared_ptr<JNIObject>(result);
+        return std::allocate_shared<JNIObject>(JNIPoolAllocator<JNIObject>(), References::newWeakGlobalRef(obj), nullptr, WEAK);
+    }
+
+    std::shared_ptr<JNIObject> JNIObject::createWeak(jobject obj, const std::string & className, const char * site)
+    {
+        const JNIClassInfo & classInfo = Utils::findClassInfo(className.c_str());
+        return std::allocate_shared<JNIObject>(JNIPoolAllocator<JNIObject>(), References::newWeakGlobalRef(obj, &classInfo, site), &classInfo, WEAK, site);
     }
 }
 
@@ -293,4 +2658,51 @@ extern "C"
 
         return JNI_VERSION_1_6;
     } 
+
+    JNIEXPORT void JNICALL Java_com_safejni_SafeJNI_nativeSetClassLoader(JNIEnv * env, jclass clazz, jobject classLoader)
+    {
+        safejni::Utils::setClassLoader(classLoader);
+    }
+
+    //single entry point of every com.safejni.NativeCallback
+    JNIEXPORT jobject JNICALL Java_com_safejni_NativeCallback_nativeInvoke(JNIEnv * env, jclass clazz, jlong handle, jobjectArray args)
+    {
+        std::shared_ptr<safejni::NativeCallbackInvoker> invoker = safejni::findCallback(handle);
+        if (!invoker) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "The native callback has been closed");
+            return nullptr;
+        }
+#if SAFEJNI_EXCEPTIONS
+        try {
+            return (*invoker)(env, args);
+        }
+        catch (...) {
+            safejni::Utils::rethrowToJava(env);
+        }
+        return nullptr;
+#else
+        return (*invoker)(env, args);
+#endif
+    }
+
+    //called by com.safejni.NativeCallback when it is closed or finalized
+    JNIEXPORT void JNICALL Java_com_safejni_NativeCallback_nativeRelease(JNIEnv * env, jclass clazz, jlong handle)
+    {
+        //the function is destroyed outside the lock, its captures may run arbitrary code
+        std::shared_ptr<safejni::NativeCallbackInvoker> invoker;
+        {
+            std::lock_guard<std::mutex> lock(safejni::callbacksMutex);
+            auto it = safejni::callbacks.find(handle);
+            if (it != safejni::callbacks.end()) {
+                invoker = std::move(it->second);
+                safejni::callbacks.erase(it);
+            }
+        }
+    }
+
+    //called by com.safejni.NativeBuffers when a ByteBuffer created from a NativeBuffer is garbage collected
+    JNIEXPORT void JNICALL Java_com_safejni_NativeBuffers_nativeRelease(JNIEnv * env, jclass clazz, jlong handle)
+    {
+        delete reinterpret_cast<std::shared_ptr<void>*>(handle);
+    }
 }
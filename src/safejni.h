@@ -10,8 +10,29 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <array>
+#include <algorithm>
 #include <exception>
+#include <atomic>
+#include <functional>
+#include <tuple>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <cstring>
+#include <climits>
+#include <type_traits>
 #include <stdint.h>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#if __cplusplus >= 202002L
+#include <span>
+#endif
 
 
 namespace safejni {
@@ -19,13 +40,16 @@ namespace safejni {
 
 #pragma mark Compile Time Strings
 
-//Compile Time String
+//Compile Time String. The characters are constexpr static storage: value() is a plain address, without the
+//thread-safe initialization guard of a function-local static. The extra '\0' keeps empty strings valid.
 template <char... Cs> struct CompileTimeString {
-    static const char * value() {
-        static const char a[sizeof...(Cs)] = {Cs...};
-        return a;
+    static constexpr char chars[sizeof...(Cs) + 1] = {Cs..., '\0'};
+    static constexpr const char * value() {
+        return chars;
     }
 };
+
+template <char... Cs> constexpr char CompileTimeString<Cs...>::chars[sizeof...(Cs) + 1];
  
 //Concatenate 2 Strings
 template <class L, class R> struct Concatenate2;
@@ -50,70 +74,375 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
     using Result = typename Concatenate2<C1,typename Concatenate<C...>::Result>::Result;
 };
 
+//Strips a string at its first '\0'
+template <typename Result, char... Cs> struct TrimCompileTimeString;
+
+template <char... RC> struct TrimCompileTimeString<CompileTimeString<RC...>> {
+    using Result = CompileTimeString<RC...>;
+};
+
+template <char... RC, char... Cs> struct TrimCompileTimeString<CompileTimeString<RC...>, '\0', Cs...> {
+    using Result = CompileTimeString<RC...>;
+};
+
+template <char... RC, char C, char... Cs> struct TrimCompileTimeString<CompileTimeString<RC...>, C, Cs...> {
+    using Result = typename TrimCompileTimeString<CompileTimeString<RC..., C>, Cs...>::Result;
+};
+
+//Turns a string literal of up to 128 characters into a CompileTimeString (C++11 has no string literal template arguments)
+//  using Name = SAFEJNI_STRING("android/graphics/Bitmap");
+//the inner clamp keeps compilers from warning about the out of range index of the branch that is not taken
+#define SAFEJNI_CHAR_AT(str, i) ((i) < sizeof(str) ? (str)[(i) < sizeof(str) ? (i) : 0] : '\0')
+#define SAFEJNI_CHARS8(str, i) SAFEJNI_CHAR_AT(str, i), SAFEJNI_CHAR_AT(str, i + 1), SAFEJNI_CHAR_AT(str, i + 2), SAFEJNI_CHAR_AT(str, i + 3), \
+    SAFEJNI_CHAR_AT(str, i + 4), SAFEJNI_CHAR_AT(str, i + 5), SAFEJNI_CHAR_AT(str, i + 6), SAFEJNI_CHAR_AT(str, i + 7)
+#define SAFEJNI_CHARS32(str, i) SAFEJNI_CHARS8(str, i), SAFEJNI_CHARS8(str, i + 8), SAFEJNI_CHARS8(str, i + 16), SAFEJNI_CHARS8(str, i + 24)
+#define SAFEJNI_STRING(str) safejni::TrimCompileTimeString<safejni::CompileTimeString<>, \
+    SAFEJNI_CHARS32(str, 0), SAFEJNI_CHARS32(str, 32), SAFEJNI_CHARS32(str, 64), SAFEJNI_CHARS32(str, 96)>::Result
+
 #pragma mark Utility functions
     
+//Builds with -fno-exceptions report Java exceptions through ExceptionPolicy::RETURN and abort on internal errors
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#define SAFEJNI_EXCEPTIONS 1
+#define SAFEJNI_THROW(exception) throw exception
+#else
+#define SAFEJNI_EXCEPTIONS 0
+#define SAFEJNI_THROW(exception) safejni::Utils::fatalError(exception)
+#endif
+    
     class JNIException: public std::exception
     {
     public:
-        std::string message;
         JNIException(const std::string & message);
+        //Wraps a Java exception. The class name and message are fetched from the throwable the first time they are needed
+        explicit JNIException(jthrowable throwable);
         virtual const char* what() const throw();
+        //the Java throwable (a global ref owned by the exception) or nullptr for errors raised by SafeJNI itself
+        jthrowable throwable() const;
+        std::string className() const;
+        std::string message() const;
+        //printStackTrace output, built on every call
+        std::string stackTrace() const;
+        
+        struct Details;
+    private:
+        std::shared_ptr<Details> details;
+    };
+    
+    //What happens when a call leaves a Java exception pending
+    enum class ExceptionPolicy {
+        //throw a JNIException (default when C++ exceptions are enabled)
+        THROW,
+        //clear it and keep it as the thread's pending exception, the call returns a zero value (default with -fno-exceptions)
+        RETURN,
+        //keep the first one as the thread's pending exception and ignore the rest until the batch reports it
+        DEFERRED
     };
 
+#ifdef SAFEJNI_ENABLE_STATS
+    class JNICallStats;
+#endif
+
+    //Resolved method. Instances are owned by the process-wide method cache: classId is a global ref that lives as long as the process
     class JNIMethodInfo
     {
     public:
         jclass classId;
         jmethodID methodId;
+#ifdef SAFEJNI_ENABLE_STATS
+        JNICallStats * stats;
+#endif
         JNIMethodInfo(jclass classId, jmethodID methodId);
-        ~JNIMethodInfo();
     };
 
     typedef std::shared_ptr<JNIMethodInfo> SPJNIMethodInfo;
 
+    //Non-owning view of native memory, exposed to Java as a direct java.nio.ByteBuffer.
+    //The memory must outlive every Java reference to the buffer.
+    struct DirectBuffer
+    {
+        void * data;
+        size_t size;
+        DirectBuffer(): data(nullptr), size(0) {}
+        DirectBuffer(void * data, size_t size): data(data), size(size) {}
+    };
+
+    //Native memory with shared ownership. When passed to Java as a direct ByteBuffer the ByteBuffer keeps
+    //the memory alive: it is freed once the last NativeBuffer copy and the last Java reference are gone.
+    class NativeBuffer
+    {
+    public:
+        NativeBuffer(): bufferData(nullptr), bufferSize(0) {}
+        //allocates size bytes
+        explicit NativeBuffer(size_t size);
+        //wraps memory whose lifetime is tied to owner (the owner deleter frees it)
+        NativeBuffer(void * data, size_t size, std::shared_ptr<void> owner): bufferData(data), bufferSize(size), bufferOwner(owner) {}
+
+        inline uint8_t * data() const { return static_cast<uint8_t*>(bufferData);}
+        inline size_t size() const { return bufferSize;}
+        inline const std::shared_ptr<void> & owner() const { return bufferOwner;}
+    private:
+        void * bufferData;
+        size_t bufferSize;
+        std::shared_ptr<void> bufferOwner;
+    };
+
+    //Resolved class, owned by the process-wide class cache: classId is a global ref that lives as long as the process
+    class JNIClassInfo
+    {
+    public:
+        JNIClassInfo(const char * className, jclass classId): className(className), classId(classId), liveRefs(0) {}
+        std::string className;
+        jclass classId;
+        //global and weak refs to objects of this class held by JNIObject instances
+        mutable std::atomic<size_t> liveRefs;
+    };
+
+    //Resolved field, owned by the process-wide cache like JNIMethodInfo
+    class JNIFieldInfo
+    {
+    public:
+        jclass classId;
+        jfieldID fieldId;
+#ifdef SAFEJNI_ENABLE_STATS
+        JNICallStats * stats;
+#endif
+        JNIFieldInfo(jclass classId, jfieldID fieldId);
+    };
+
     class Utils 
     {
     private:
-        static JNIEnv * env;
+        static thread_local JNIEnv * env;
         static JavaVM * javaVM;
+        static JNIEnv * attachCurrentThread();
+        static JNIEnv * currentEnv();
+        //pthread key destructor: frees the pending exception of an exiting thread, then detaches it if SafeJNI attached it
+        static void releaseThread(void * value);
+        static void createThreadKey();
     public:
         static void init(JavaVM * vm, JNIEnv * env);
-        static inline JNIEnv * getJNIEnv() { return env;}
-        static JNIEnv* getJNIEnvAttach();
+        //JNIEnv of the calling thread, nullptr if it is not attached to the VM (it never attaches it)
+        static inline JNIEnv * getJNIEnv() { return env ? env : currentEnv();}
+        //JNIEnv of the calling thread. The first call on a native thread attaches it to the VM, later calls are a
+        //thread-local load. Threads attached this way are detached automatically when they exit.
+        static inline JNIEnv * getJNIEnvAttach() { return env ? env : attachCurrentThread();}
+        //Detaches the calling thread now if it was attached by SafeJNI. The env of threads attached elsewhere is cached
+        //too: call it before detaching such a thread yourself, so SafeJNI stops using the env.
+        static void detachCurrentThread();
+        //Attach native threads as daemon threads so they don't block VM shutdown (disabled by default)
+        static void setAttachAsDaemon(bool daemon);
+        //Classes are looked up through classLoader.loadClass, so threads attached from native code (whose FindClass only
+        //sees the system classes) find the application classes too. init() captures the loader of the SafeJNI Java helpers
+        //and SafeJNI.setActivity the loader of the activity. The resolved classes are cached for every thread.
+        static void setClassLoader(jobject classLoader);
+        //String arrays (and maps) with at least this many strings are transferred packed through com.safejni.PackedStrings
+        //(default 32, SIZE_MAX disables it). Without the java_helper classes every array uses the per element path.
+        static void setPackedStringThreshold(size_t count);
+        //Strings are transcoded between standard UTF-8 and UTF-16 (supplementary characters included)
         static jstring toJString(const char * str);
+        static jstring toJString(const char * str, size_t length);
         inline static jstring toJString(const std::string & str) {
-            return toJString(str.c_str());
+            return toJString(str.data(), str.size());
         }
+        static jstring toJString(const std::u16string & str);
         static jobjectArray toJObjectArray(const std::vector<std::string> & data);
         static jbyteArray toJObjectArray(const std::vector<uint8_t> & data);
+        static jobjectArray toJObjectArray(const std::vector<jobject> & data);
+        //Maps with enough entries are transferred packed like string arrays (keys and values count against the threshold)
         static jobject toHashMap(const std::map<std::string, std::string> & data);
+        static jobject toHashMap(const std::unordered_map<std::string, std::string> & data);
+        static jobject toDirectByteBuffer(void * data, size_t size);
+        static jobject toDirectByteBuffer(const NativeBuffer & buffer);
 
         static std::string toString(jstring str);
+        static std::u16string toU16String(jstring str);
         static std::vector<std::string> toVectorString(jobjectArray array);
         static std::vector<uint8_t> toVectorByte(jbyteArray);
         static std::vector<float> toVectorFloat(jfloatArray);
+        //Every element stays a live local ref until the caller deletes it, so large arrays can overflow the local ref
+        //table of threads that never return to Java: wrap the call in a LocalFrame, or visit them with forEachElement.
         static std::vector<jobject> toVectorJObject(jobjectArray);
+        static std::map<std::string, std::string> toMap(jobject map);
+        static std::unordered_map<std::string, std::string> toUnorderedMap(jobject map);
+        static DirectBuffer toDirectBuffer(jobject byteBuffer);
+        static NativeBuffer toNativeBuffer(jobject byteBuffer);
         
+        //Cached lookups: the first call resolves and stores the class as a global ref, later calls are lock-free and never allocate
+        static jclass findClass(const char * className);
+        static const JNIClassInfo & findClassInfo(const char * className);
+        static const JNIMethodInfo & findStaticMethod(const char * className, const char * methodName, const char * signature);
+        static const JNIMethodInfo & findMethod(const char * className, const char * methodName, const char * signature);
+        static const JNIFieldInfo & findStaticField(const char * className, const char * fieldName, const char * signature);
+        static const JNIFieldInfo & findField(const char * className, const char * fieldName, const char * signature);
+
         static SPJNIMethodInfo getStaticMethodInfo(const std::string& className, const std::string& methodName, const char * signature);
         static SPJNIMethodInfo getMethodInfo(const std::string& className, const std::string& methodName, const char * signature);
-        static void checkException();
+        
+        //Process-wide policy, ExceptionScope overrides it for a thread
+        static void setExceptionPolicy(ExceptionPolicy policy);
+        static ExceptionPolicy getExceptionPolicy();
+        //Exception kept by the RETURN and DEFERRED policies on the calling thread. take clears it (nullptr when there is none)
+        static bool hasPendingException();
+        static std::unique_ptr<JNIException> takePendingException();
+        //Reports the kept exception through the current policy (throws it under THROW)
+        static void reportPendingException();
+        //Only a single ExceptionCheck when no exception is pending
+        static inline void checkException() {
+            if (getJNIEnvAttach()->ExceptionCheck()) {
+                handleException();
+            }
+        }
+        static void handleException();
+        [[noreturn]] static void fatalError(const JNIException & exception);
+        //Called from a catch block in native method trampolines: turns the C++ exception into a pending Java exception
+        static void rethrowToJava(JNIEnv * env);
+    };
+    
+    //Sets the exception policy of the calling thread until the scope ends
+    class ExceptionScope {
+    public:
+        explicit ExceptionScope(ExceptionPolicy policy);
+        ~ExceptionScope();
+        ExceptionScope(const ExceptionScope &) = delete;
+        ExceptionScope & operator=(const ExceptionScope &) = delete;
+    private:
+        int previous;
     };
 
     void init(JavaVM * javaVM, JNIEnv * env);
     
+#pragma mark Reference Registry
+    
+#define SAFEJNI_STRINGIFY_(x) #x
+#define SAFEJNI_STRINGIFY(x) SAFEJNI_STRINGIFY_(x)
+    //call site tag for the reference statistics, passed as the site argument of the functions that create refs:
+    //  JNIObjectPtr bitmap = JNIObject::create(obj, "android/graphics/Bitmap", SAFEJNI_REF_SITE);
+#define SAFEJNI_REF_SITE __FILE__ ":" SAFEJNI_STRINGIFY(__LINE__)
+    
+    struct RefStats {
+        size_t globalRefs;
+        size_t weakRefs;
+    };
+    
+    //Slot of the recycled handle table. The generation detects handles used after release
+    struct RefHandle {
+        uint32_t index;
+        uint32_t generation;
+        explicit operator bool() const { return generation != 0;}
+    };
+    
+    //Owns a local ref and deletes it when it goes out of scope
+    struct JNILocalRefDeleter {
+        void operator()(jobject obj) const;
+    };
+    typedef std::unique_ptr<_jobject, JNILocalRefDeleter> LocalRef;
+    
+    //Global and weak global refs created by SafeJNI go through the registry, which counts them per class (JNIClassInfo::liveRefs)
+    //and per call site (the site tags are compared by content) and checks them against the budget. Android aborts the process when its global reference table
+    //overflows, the budget turns that into a warning and a JNIException.
+    class References {
+    public:
+        static jobject newGlobalRef(jobject obj, const JNIClassInfo * classInfo = nullptr, const char * site = nullptr);
+        static jobject newWeakGlobalRef(jobject obj, const JNIClassInfo * classInfo = nullptr, const char * site = nullptr);
+        static void deleteGlobalRef(jobject ref, const JNIClassInfo * classInfo = nullptr, const char * site = nullptr);
+        static void deleteWeakGlobalRef(jobject ref, const JNIClassInfo * classInfo = nullptr, const char * site = nullptr);
+        //local ref to the object of a weak global ref, empty once the object has been collected
+        static LocalRef promote(jobject weakRef);
+        
+        static RefStats stats();
+        //live refs created with a site tag
+        static std::vector<std::pair<std::string, size_t>> siteStats();
+        //warning is called each time the count of global plus weak refs reaches warnAt. Past limit new refs are refused
+        //with a JNIException. 0 disables either check
+        static void setBudget(size_t warnAt, size_t limit, std::function<void(const RefStats &)> warning = nullptr);
+        
+        //Handle table: refs are stored in recycled slots, so code that keeps objects by handle has a flat footprint
+        //a null obj returns the null handle without taking a slot
+        static RefHandle acquire(jobject obj, bool weak = false, const char * site = nullptr);
+        //local ref to the object, empty if the handle was released or the weak object collected
+        static LocalRef get(RefHandle handle);
+        static void release(RefHandle handle);
+    };
+    
+    //Fixed size blocks for JNIObject allocations (object and shared_ptr control block in one block).
+    //Freed blocks are kept for reuse, the pool never returns memory to the system.
+    class JNIObjectPool {
+    public:
+        static void * allocate(size_t size);
+        static void deallocate(void * block, size_t size);
+    };
+    
+    template<typename T>
+    struct JNIPoolAllocator {
+        typedef T value_type;
+        JNIPoolAllocator() {}
+        template<typename U> JNIPoolAllocator(const JNIPoolAllocator<U> &) {}
+        T * allocate(size_t n) { return static_cast<T*>(n == 1 ? JNIObjectPool::allocate(sizeof(T)) : ::operator new(n * sizeof(T)));}
+        void deallocate(T * block, size_t n) {
+            if (n == 1) {
+                JNIObjectPool::deallocate(block, sizeof(T));
+            }
+            else {
+                ::operator delete(block);
+            }
+        }
+        template<typename U> struct rebind { typedef JNIPoolAllocator<U> other; };
+    };
+    
+    template<typename T, typename U>
+    inline bool operator==(const JNIPoolAllocator<T> &, const JNIPoolAllocator<U> &) { return true;}
+    template<typename T, typename U>
+    inline bool operator!=(const JNIPoolAllocator<T> &, const JNIPoolAllocator<U> &) { return false;}
+    
     class JNIObject {
     public:
+        enum RefType { GLOBAL, WEAK };
+        
+        //site tags the ref in References::siteStats (SAFEJNI_REF_SITE), nullptr leaves it untagged
+        JNIObject(jobject instance, const JNIClassInfo * classInfo, RefType refType, const char * site = nullptr);
         ~JNIObject();
-        void makeGlobalRef();
-        static std::shared_ptr<JNIObject> create(jobject obj, const std::string & className);
+        //turns a weak object into a strong one (the instance is null if it was already collected)
+        void makeGlobalRef(const char * site = nullptr);
+        static std::shared_ptr<JNIObject> create(jobject obj, const std::string & className, const char * site = nullptr);
+        static std::shared_ptr<JNIObject> create(jobject obj, const JNIClassInfo & classInfo, const char * site = nullptr);
+        //takes ownership of a local ref (returned by a JNI call) and keeps a global ref instead
+        static std::shared_ptr<JNIObject> createFromLocal(jobject localRef);
+        //weak global ref: doesn't keep the Java object alive, calls promote it for their duration
         static std::shared_ptr<JNIObject> createWeak(jobject obj);
-        template<typename... Args> static std::shared_ptr<JNIObject> create(const std::string & className, Args ...v);
-        template<typename T = void,typename... Args> inline T call(const std::string & methodName, Args... v);
+        static std::shared_ptr<JNIObject> createWeak(jobject obj, const std::string & className, const char * site = nullptr);
+        template<typename... Args> static std::shared_ptr<JNIObject> create(const std::string & className, Args&&... v);
+        //creates the Java object with an already resolved constructor, a single NewObject call
+        template<typename... Args> static std::shared_ptr<JNIObject> construct(const JNIClassInfo & classInfo, const JNIMethodInfo & constructor, Args&&... v);
+        template<typename T = void,typename... Args> inline T call(const std::string & methodName, Args&&... v);
+        
+        //the class is looked up from the instance on first use when the object was created without one
+        const JNIClassInfo * getClassInfo() const;
+        const std::string & className() const;
+        //local ref to the object, empty if a weak object was collected
+        LocalRef lock() const;
+        inline bool isWeak() const { return refType == WEAK;}
+        //calls f with a ref that can be used as an object: the instance itself, or a local ref promoted from a weak
+        //object for the duration of f. Throws when a weak object has been collected.
+        template<typename F>
+        auto withInstance(F && f) const -> decltype(f(jobject()))
+        {
+            if (refType != WEAK) {
+                return f(instance);
+            }
+            LocalRef strong = lock();
+            if (!strong) {
+                SAFEJNI_THROW(JNIException("The Java object of a weak JNIObject has been collected."));
+            }
+            return f(strong.get());
+        }
         
-        std::string jniClassName;
         jobject instance = nullptr;
     protected:
-        bool globalRef = false;
+        //shared by every object of the class, owned by the class cache
+        mutable std::atomic<const JNIClassInfo*> classInfo;
+        RefType refType;
+        const char * site;
     };
 
     class JNIObject;
@@ -123,6 +452,510 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
     
 #define JNI_EXCEPTION_CHECK safejni::Utils::checkException();
     
+#pragma mark Local Reference Frames
+    
+    //RAII PushLocalFrame/PopLocalFrame scope. Every local ref created while the frame is open is released when it closes,
+    //so the calls made inside skip their individual DeleteLocalRef calls. Raw jobject results that must outlive the frame
+    //are carried out with pop().
+    class LocalFrame {
+    public:
+        explicit LocalFrame(jint capacity = 16);
+        ~LocalFrame();
+        LocalFrame(const LocalFrame &) = delete;
+        LocalFrame & operator=(const LocalFrame &) = delete;
+        
+        //closes the frame and returns a ref to result that is valid in the enclosing frame
+        jobject pop(jobject result);
+        template <typename T> inline T pop(T result) { return static_cast<T>(pop(static_cast<jobject>(result)));}
+        
+        //true when the calling thread has an open frame
+        static inline bool active() { return depth > 0;}
+    private:
+        JNIEnv * jniEnv;
+        bool open;
+        static thread_local int depth;
+    };
+    
+#pragma mark Call Statistics
+    
+    //Per-method call statistics, compiled in with -DSAFEJNI_ENABLE_STATS. The define must be the same for every translation
+    //unit (safejni.cpp included) because it adds a counter pointer to JNIMethodInfo and JNIFieldInfo.
+    //Without it the hooks expand to nothing and the call paths are exactly the uninstrumented ones.
+#ifdef SAFEJNI_ENABLE_STATS
+    typedef std::chrono::steady_clock JNIStatsClock;
+    
+    //Counters of a cached method or field, updated with relaxed atomics from any thread
+    class JNICallStats {
+    public:
+        enum Phase {
+            LOOKUP,
+            MARSHAL,
+            CALL,
+            UNMARSHAL,
+            NUM_PHASES
+        };
+        //bucket i counts the durations in [2^i, 2^(i+1)) nanoseconds, the last one also counts anything longer
+        static constexpr int NUM_BUCKETS = 32;
+        
+        JNICallStats();
+        JNICallStats(const JNICallStats &) = delete;
+        JNICallStats & operator=(const JNICallStats &) = delete;
+        void record(Phase phase, uint64_t nanos);
+        void reset();
+        
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> cacheHits;
+        std::atomic<uint64_t> cacheMisses;
+        std::atomic<uint64_t> bytesMarshalled;
+        std::atomic<uint64_t> bytesUnmarshalled;
+        std::atomic<uint64_t> localRefs;
+        std::atomic<uint64_t> totalNanos[NUM_PHASES];
+        std::atomic<uint64_t> histogram[NUM_PHASES][NUM_BUCKETS];
+    };
+    
+    //Times one call. It is opened once the member is resolved, so the lookup phase runs from start to the constructor.
+    //The conversions report their time and size to the innermost scope of the thread, the rest is accounted as the call.
+    class JNIStatsScope {
+    public:
+        JNIStatsScope(JNICallStats * stats, JNIStatsClock::time_point start);
+        ~JNIStatsScope();
+        JNIStatsScope(const JNIStatsScope &) = delete;
+        JNIStatsScope & operator=(const JNIStatsScope &) = delete;
+        
+        inline void marshalled(JNIStatsClock::duration elapsed, size_t bytes, bool localRef) {
+            marshalTime += elapsed;
+            bytesIn += bytes;
+            localRefs += localRef ? 1 : 0;
+        }
+        inline void unmarshalled(JNIStatsClock::duration elapsed, size_t bytes, bool localRef) {
+            unmarshalTime += elapsed;
+            bytesOut += bytes;
+            localRefs += localRef ? 1 : 0;
+        }
+        static inline JNIStatsScope * current() { return currentScope;}
+    private:
+        JNICallStats * stats;
+        JNIStatsScope * previous;
+        JNIStatsClock::time_point start;
+        JNIStatsClock::time_point opened;
+        JNIStatsClock::duration marshalTime;
+        JNIStatsClock::duration unmarshalTime;
+        size_t bytesIn;
+        size_t bytesOut;
+        size_t localRefs;
+        static thread_local JNIStatsScope * currentScope;
+    };
+    
+    //Bytes copied by a conversion. References and shared memory (jobject, DirectBuffer, NativeBuffer...) count 0
+    template <typename T, typename Enable = void>
+    struct JNIMarshalSize {
+        static inline size_t size(const T &) { return 0;}
+    };
+    
+    template <typename T>
+    struct JNIMarshalSize<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+        static inline size_t size(const T &) { return sizeof(T);}
+    };
+    
+    template <>
+    struct JNIMarshalSize<std::string> {
+        static inline size_t size(const std::string & str) { return str.size();}
+    };
+    
+    template <>
+    struct JNIMarshalSize<std::u16string> {
+        static inline size_t size(const std::u16string & str) { return str.size() * sizeof(char16_t);}
+    };
+    
+    template <>
+    struct JNIMarshalSize<const char *> {
+        static inline size_t size(const char * str) { return str ? strlen(str) : 0;}
+    };
+    
+#if __cplusplus >= 201703L
+    template <>
+    struct JNIMarshalSize<std::string_view> {
+        static inline size_t size(std::string_view str) { return str.size();}
+    };
+#endif
+    
+    template <typename T>
+    struct JNIMarshalSize<std::vector<T>> {
+        static size_t size(const std::vector<T> & values) {
+            if (std::is_arithmetic<T>::value) {
+                return values.size() * sizeof(T);
+            }
+            size_t bytes = 0;
+            for (const auto & value: values) {
+                bytes += JNIMarshalSize<T>::size(value);
+            }
+            return bytes;
+        }
+    };
+    
+    template <typename T, size_t N>
+    struct JNIMarshalSize<std::array<T, N>> {
+        static inline size_t size(const std::array<T, N> &) { return N * sizeof(T);}
+    };
+    
+    template <typename M>
+    struct JNIStringMapSize {
+        static size_t size(const M & values) {
+            size_t bytes = 0;
+            for (const auto & entry: values) {
+                bytes += entry.first.size() + entry.second.size();
+            }
+            return bytes;
+        }
+    };
+    
+    template <>
+    struct JNIMarshalSize<std::map<std::string, std::string>>: JNIStringMapSize<std::map<std::string, std::string>> {};
+    
+    template <>
+    struct JNIMarshalSize<std::unordered_map<std::string, std::string>>: JNIStringMapSize<std::unordered_map<std::string, std::string>> {};
+    
+    //Counters of one method or field, copied out of the live counters by CallStats::snapshot()
+    struct MethodStats {
+        std::string className;
+        std::string name;
+        std::string signature;
+        bool field;
+        uint64_t calls;
+        uint64_t cacheHits;
+        uint64_t cacheMisses;
+        uint64_t bytesMarshalled;
+        uint64_t bytesUnmarshalled;
+        uint64_t localRefs;
+        uint64_t totalNanos[JNICallStats::NUM_PHASES];
+        uint64_t histogram[JNICallStats::NUM_PHASES][JNICallStats::NUM_BUCKETS];
+        
+        //share of the lookups served by the method cache, in [0, 1]
+        double cacheHitRate() const;
+        //upper bound in nanoseconds of the histogram bucket holding the given percentile (0-100) of a phase
+        uint64_t percentile(JNICallStats::Phase phase, double percent) const;
+    };
+    
+    class CallStats {
+    public:
+        //every method and field looked up or called so far, the most expensive ones first
+        static std::vector<MethodStats> snapshot();
+        //zeroes the counters, the methods stay cached
+        static void reset();
+        //one line per method: calls, cache hit rate, average and p99 per phase, bytes and local refs
+        static std::string dumpText();
+        static std::string dumpJSON();
+    };
+    
+#define SAFEJNI_STATS_START safejni::JNIStatsClock::time_point statsStart = safejni::JNIStatsClock::now();
+#define SAFEJNI_STATS_SCOPE(info) safejni::JNIStatsScope statsScope((info).stats, statsStart);
+#else
+#define SAFEJNI_STATS_START
+#define SAFEJNI_STATS_SCOPE(info)
+#endif
+    
+#pragma mark Primitive Arrays
+    
+    //Maps a C++ element type to its Java array type and the JNI functions that operate on it
+    template <typename T>
+    struct JNIArrayTraits;
+    
+    template<>
+    struct JNIArrayTraits<int8_t> {
+        typedef jbyteArray ArrayType;
+        using JNIType = CompileTimeString<'[','B'>;
+        inline static ArrayType newArray(JNIEnv * env, jsize length) { return env->NewByteArray(length);}
+        inline static void getRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, int8_t * buffer) { env->GetByteArrayRegion(array, start, length, reinterpret_cast<jbyte*>(buffer));}
+        inline static void setRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, const int8_t * buffer) { env->SetByteArrayRegion(array, start, length, reinterpret_cast<const jbyte*>(buffer));}
+        inline static int8_t * getElements(JNIEnv * env, ArrayType array, jboolean * isCopy) { return reinterpret_cast<int8_t*>(env->GetByteArrayElements(array, isCopy));}
+        inline static void releaseElements(JNIEnv * env, ArrayType array, int8_t * elements, jint mode) { env->ReleaseByteArrayElements(array, reinterpret_cast<jbyte*>(elements), mode);}
+    };
+    
+    template<>
+    struct JNIArrayTraits<uint8_t> {
+        typedef jbyteArray ArrayType;
+        using JNIType = CompileTimeString<'[','B'>;
+        inline static ArrayType newArray(JNIEnv * env, jsize length) { return env->NewByteArray(length);}
+        inline static void getRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, uint8_t * buffer) { env->GetByteArrayRegion(array, start, length, reinterpret_cast<jbyte*>(buffer));}
+        inline static void setRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, const uint8_t * buffer) { env->SetByteArrayRegion(array, start, length, reinterpret_cast<const jbyte*>(buffer));}
+        inline static uint8_t * getElements(JNIEnv * env, ArrayType array, jboolean * isCopy) { return reinterpret_cast<uint8_t*>(env->GetByteArrayElements(array, isCopy));}
+        inline static void releaseElements(JNIEnv * env, ArrayType array, uint8_t * elements, jint mode) { env->ReleaseByteArrayElements(array, reinterpret_cast<jbyte*>(elements), mode);}
+    };
+    
+    template<>
+    struct JNIArrayTraits<int16_t> {
+        typedef jshortArray ArrayType;
+        using JNIType = CompileTimeString<'[','S'>;
+        inline static ArrayType newArray(JNIEnv * env, jsize length) { return env->NewShortArray(length);}
+        inline static void getRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, int16_t * buffer) { env->GetShortArrayRegion(array, start, length, reinterpret_cast<jshort*>(buffer));}
+        inline static void setRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, const int16_t * buffer) { env->SetShortArrayRegion(array, start, length, reinterpret_cast<const jshort*>(buffer));}
+        inline static int16_t * getElements(JNIEnv * env, ArrayType array, jboolean * isCopy) { return reinterpret_cast<int16_t*>(env->GetShortArrayElements(array, isCopy));}
+        inline static void releaseElements(JNIEnv * env, ArrayType array, int16_t * elements, jint mode) { env->ReleaseShortArrayElements(array, reinterpret_cast<jshort*>(elements), mode);}
+    };
+    
+    template<>
+    struct JNIArrayTraits<uint16_t> {
+        typedef jcharArray ArrayType;
+        using JNIType = CompileTimeString<'[','C'>;
+        inline static ArrayType newArray(JNIEnv * env, jsize length) { return env->NewCharArray(length);}
+        inline static void getRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, uint16_t * buffer) { env->GetCharArrayRegion(array, start, length, reinterpret_cast<jchar*>(buffer));}
+        inline static void setRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, const uint16_t * buffer) { env->SetCharArrayRegion(array, start, length, reinterpret_cast<const jchar*>(buffer));}
+        inline static uint16_t * getElements(JNIEnv * env, ArrayType array, jboolean * isCopy) { return reinterpret_cast<uint16_t*>(env->GetCharArrayElements(array, isCopy));}
+        inline static void releaseElements(JNIEnv * env, ArrayType array, uint16_t * elements, jint mode) { env->ReleaseCharArrayElements(array, reinterpret_cast<jchar*>(elements), mode);}
+    };
+    
+    template<>
+    struct JNIArrayTraits<int32_t> {
+        typedef jintArray ArrayType;
+        using JNIType = CompileTimeString<'[','I'>;
+        inline static ArrayType newArray(JNIEnv * env, jsize length) { return env->NewIntArray(length);}
+        inline static void getRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, int32_t * buffer) { env->GetIntArrayRegion(array, start, length, reinterpret_cast<jint*>(buffer));}
+        inline static void setRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, const int32_t * buffer) { env->SetIntArrayRegion(array, start, length, reinterpret_cast<const jint*>(buffer));}
+        inline static int32_t * getElements(JNIEnv * env, ArrayType array, jboolean * isCopy) { return reinterpret_cast<int32_t*>(env->GetIntArrayElements(array, isCopy));}
+        inline static void releaseElements(JNIEnv * env, ArrayType array, int32_t * elements, jint mode) { env->ReleaseIntArrayElements(array, reinterpret_cast<jint*>(elements), mode);}
+    };
+    
+    template<>
+    struct JNIArrayTraits<int64_t> {
+        typedef jlongArray ArrayType;
+        using JNIType = CompileTimeString<'[','J'>;
+        inline static ArrayType newArray(JNIEnv * env, jsize length) { return env->NewLongArray(length);}
+        inline static void getRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, int64_t * buffer) { env->GetLongArrayRegion(array, start, length, reinterpret_cast<jlong*>(buffer));}
+        inline static void setRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, const int64_t * buffer) { env->SetLongArrayRegion(array, start, length, reinterpret_cast<const jlong*>(buffer));}
+        inline static int64_t * getElements(JNIEnv * env, ArrayType array, jboolean * isCopy) { return reinterpret_cast<int64_t*>(env->GetLongArrayElements(array, isCopy));}
+        inline static void releaseElements(JNIEnv * env, ArrayType array, int64_t * elements, jint mode) { env->ReleaseLongArrayElements(array, reinterpret_cast<jlong*>(elements), mode);}
+    };
+    
+    template<>
+    struct JNIArrayTraits<float> {
+        typedef jfloatArray ArrayType;
+        using JNIType = CompileTimeString<'[','F'>;
+        inline static ArrayType newArray(JNIEnv * env, jsize length) { return env->NewFloatArray(length);}
+        inline static void getRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, float * buffer) { env->GetFloatArrayRegion(array, start, length, reinterpret_cast<jfloat*>(buffer));}
+        inline static void setRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, const float * buffer) { env->SetFloatArrayRegion(array, start, length, reinterpret_cast<const jfloat*>(buffer));}
+        inline static float * getElements(JNIEnv * env, ArrayType array, jboolean * isCopy) { return reinterpret_cast<float*>(env->GetFloatArrayElements(array, isCopy));}
+        inline static void releaseElements(JNIEnv * env, ArrayType array, float * elements, jint mode) { env->ReleaseFloatArrayElements(array, reinterpret_cast<jfloat*>(elements), mode);}
+    };
+    
+    template<>
+    struct JNIArrayTraits<double> {
+        typedef jdoubleArray ArrayType;
+        using JNIType = CompileTimeString<'[','D'>;
+        inline static ArrayType newArray(JNIEnv * env, jsize length) { return env->NewDoubleArray(length);}
+        inline static void getRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, double * buffer) { env->GetDoubleArrayRegion(array, start, length, reinterpret_cast<jdouble*>(buffer));}
+        inline static void setRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, const double * buffer) { env->SetDoubleArrayRegion(array, start, length, reinterpret_cast<const jdouble*>(buffer));}
+        inline static double * getElements(JNIEnv * env, ArrayType array, jboolean * isCopy) { return reinterpret_cast<double*>(env->GetDoubleArrayElements(array, isCopy));}
+        inline static void releaseElements(JNIEnv * env, ArrayType array, double * elements, jint mode) { env->ReleaseDoubleArrayElements(array, reinterpret_cast<jdouble*>(elements), mode);}
+    };
+    
+    template<>
+    struct JNIArrayTraits<bool> {
+        typedef jbooleanArray ArrayType;
+        using JNIType = CompileTimeString<'[','Z'>;
+        inline static ArrayType newArray(JNIEnv * env, jsize length) { return env->NewBooleanArray(length);}
+        inline static void getRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, bool * buffer) { env->GetBooleanArrayRegion(array, start, length, reinterpret_cast<jboolean*>(buffer));}
+        inline static void setRegion(JNIEnv * env, ArrayType array, jsize start, jsize length, const bool * buffer) { env->SetBooleanArrayRegion(array, start, length, reinterpret_cast<const jboolean*>(buffer));}
+        inline static bool * getElements(JNIEnv * env, ArrayType array, jboolean * isCopy) { return reinterpret_cast<bool*>(env->GetBooleanArrayElements(array, isCopy));}
+        inline static void releaseElements(JNIEnv * env, ArrayType array, bool * elements, jint mode) { env->ReleaseBooleanArrayElements(array, reinterpret_cast<jboolean*>(elements), mode);}
+    };
+    
+    static_assert(sizeof(bool) == sizeof(jboolean), "bool arrays are accessed in place as jboolean arrays");
+    
+    //How a JNIArrayView accesses the Java storage:
+    //  ELEMENTS uses Get<Type>ArrayElements: the VM may pin the array or hand out a copy. JNI calls are allowed while the view is alive.
+    //  CRITICAL uses GetPrimitiveArrayCritical: the array is pinned (no copy), but no other JNI call may be made until the view is released.
+    enum class ArrayAccess {
+        ELEMENTS,
+        CRITICAL
+    };
+    
+    //RAII view over the storage of a Java primitive array. Writes are copied back on release() or destruction,
+    //commit() publishes them while keeping the view, abort() releases without copying back.
+    template <typename T, ArrayAccess ACCESS = ArrayAccess::ELEMENTS>
+    class JNIArrayView {
+    public:
+        typedef typename JNIArrayTraits<T>::ArrayType ArrayType;
+        
+        JNIArrayView(): jniEnv(nullptr), javaArray(nullptr), elements(nullptr), length(0), copied(false), ownsRef(false) {}
+        
+        //ownsRef: the view deletes the local ref of the array when it is destroyed
+        explicit JNIArrayView(ArrayType array, bool ownsRef = false): jniEnv(Utils::getJNIEnvAttach()), javaArray(array), elements(nullptr), length(0), copied(false), ownsRef(ownsRef)
+        {
+            if (javaArray) {
+                length = jniEnv->GetArrayLength(javaArray);
+                jboolean isCopy = JNI_FALSE;
+                if (ACCESS == ArrayAccess::CRITICAL) {
+                    elements = static_cast<T*>(jniEnv->GetPrimitiveArrayCritical(javaArray, &isCopy));
+                }
+                else {
+                    elements = JNIArrayTraits<T>::getElements(jniEnv, javaArray, &isCopy);
+                }
+                copied = isCopy == JNI_TRUE;
+                if (!elements) {
+                    JNI_EXCEPTION_CHECK
+                    SAFEJNI_THROW(JNIException("Could not access the elements of a Java array."));
+                }
+            }
+        }
+        
+        JNIArrayView(JNIArrayView && other): jniEnv(other.jniEnv), javaArray(other.javaArray), elements(other.elements), length(other.length), copied(other.copied), ownsRef(other.ownsRef)
+        {
+            other.javaArray = nullptr;
+            other.elements = nullptr;
+            other.length = 0;
+        }
+        
+        JNIArrayView & operator=(JNIArrayView && other)
+        {
+            if (this != &other) {
+                reset();
+                jniEnv = other.jniEnv;
+                javaArray = other.javaArray;
+                elements = other.elements;
+                length = other.length;
+                copied = other.copied;
+                ownsRef = other.ownsRef;
+                other.javaArray = nullptr;
+                other.elements = nullptr;
+                other.length = 0;
+            }
+            return *this;
+        }
+        
+        JNIArrayView(const JNIArrayView &) = delete;
+        JNIArrayView & operator=(const JNIArrayView &) = delete;
+        
+        ~JNIArrayView()
+        {
+            reset();
+        }
+        
+        inline T * data() const { return elements;}
+        inline size_t size() const { return static_cast<size_t>(length);}
+        inline bool empty() const { return length == 0;}
+        inline T * begin() const { return elements;}
+        inline T * end() const { return elements + length;}
+        inline T & operator[](size_t index) const { return elements[index];}
+        inline ArrayType array() const { return javaArray;}
+        //true when the VM handed out a copy instead of the Java storage
+        inline bool isCopy() const { return copied;}
+        
+        //copies pending writes back to the Java array and keeps the view usable
+        void commit() const
+        {
+            if (elements && copied) {
+                releaseElements(JNI_COMMIT);
+            }
+        }
+        
+        //copies pending writes back and releases the elements
+        void release()
+        {
+            if (elements) {
+                releaseElements(0);
+                elements = nullptr;
+            }
+        }
+        
+        //releases the elements discarding pending writes (when the VM handed out a copy)
+        void abort()
+        {
+            if (elements) {
+                releaseElements(JNI_ABORT);
+                elements = nullptr;
+            }
+        }
+        
+    private:
+        void releaseElements(jint mode) const
+        {
+            if (ACCESS == ArrayAccess::CRITICAL) {
+                jniEnv->ReleasePrimitiveArrayCritical(javaArray, elements, mode);
+            }
+            else {
+                JNIArrayTraits<T>::releaseElements(jniEnv, javaArray, elements, mode);
+            }
+        }
+        
+        void reset()
+        {
+            release();
+            if (javaArray && ownsRef) {
+                jniEnv->DeleteLocalRef(javaArray);
+            }
+            javaArray = nullptr;
+            length = 0;
+        }
+        
+        JNIEnv * jniEnv;
+        ArrayType javaArray;
+        T * elements;
+        jsize length;
+        bool copied;
+        bool ownsRef;
+    };
+    
+    //creates a Java array with a copy of the given elements
+    template <typename T>
+    typename JNIArrayTraits<T>::ArrayType toJavaArray(const T * data, size_t size)
+    {
+        JNIEnv * jniEnv = Utils::getJNIEnvAttach();
+        auto array = JNIArrayTraits<T>::newArray(jniEnv, static_cast<jsize>(size));
+        if (!array) {
+            JNI_EXCEPTION_CHECK
+            return array;
+        }
+        if (size) {
+            JNIArrayTraits<T>::setRegion(jniEnv, array, 0, static_cast<jsize>(size), data);
+        }
+        return array;
+    }
+    
+    inline size_t getJavaArrayLength(jarray array)
+    {
+        return array ? static_cast<size_t>(Utils::getJNIEnvAttach()->GetArrayLength(array)) : 0;
+    }
+    
+    //copies the first size elements of a Java array into the destination buffer
+    template <typename T>
+    void copyJavaArray(typename JNIArrayTraits<T>::ArrayType array, T * destination, size_t size)
+    {
+        if (array && size) {
+            JNIArrayTraits<T>::getRegion(Utils::getJNIEnvAttach(), array, 0, static_cast<jsize>(size), destination);
+            JNI_EXCEPTION_CHECK
+        }
+    }
+    
+    //Non-owning view over contiguous primitives (std::span for C++11): an existing buffer is passed as a Java array
+    //without building a std::vector first. The memory must stay valid until the call returns.
+    //  safejni::callStatic("com/example/Images", "upload", safejni::Span<uint8_t>(pixels, size));
+    template <typename T>
+    class Span {
+    public:
+        Span(): first(nullptr), count(0) {}
+        Span(const T * data, size_t size): first(data), count(size) {}
+        Span(const std::vector<T> & values): first(values.data()), count(values.size()) {}
+        template <size_t N> Span(const std::array<T, N> & values): first(values.data()), count(N) {}
+        template <size_t N> Span(const T (&values)[N]): first(values), count(N) {}
+        
+        inline const T * data() const { return first;}
+        inline size_t size() const { return count;}
+        inline bool empty() const { return count == 0;}
+        inline const T * begin() const { return first;}
+        inline const T * end() const { return first + count;}
+        
+    private:
+        const T * first;
+        size_t count;
+    };
+    
+#ifdef SAFEJNI_ENABLE_STATS
+    template <typename T>
+    struct JNIMarshalSize<Span<T>> {
+        static inline size_t size(const Span<T> & values) { return values.size() * sizeof(T);}
+    };
+#endif
+    
 #pragma mark C++ To JNI conversion templates
     
     //default template
@@ -145,22 +978,74 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         inline static jstring convert(const std::string & obj) { return Utils::toJString(obj);}
     };
     
+    template<>
+    struct CPPToJNIConversor<std::u16string> {
+        using JNIType = CompileTimeString<'L','j','a','v','a','/','l','a','n','g','/','S','t','r','i','n','g',';'>;
+        inline static jstring convert(const std::u16string & obj) { return Utils::toJString(obj);}
+    };
+    
     template<>
     struct CPPToJNIConversor<const char *> {
         using JNIType = CompileTimeString<'L','j','a','v','a','/','l','a','n','g','/','S','t','r','i','n','g',';'>;
         inline static jstring convert(const char * obj) { return Utils::toJString(obj);}
     };
     
+#if __cplusplus >= 201703L
+    template<>
+    struct CPPToJNIConversor<std::string_view> {
+        using JNIType = CompileTimeString<'L','j','a','v','a','/','l','a','n','g','/','S','t','r','i','n','g',';'>;
+        inline static jstring convert(std::string_view obj) { return Utils::toJString(obj.data(), obj.size());}
+    };
+#endif
+    
     template<>
     struct CPPToJNIConversor<std::vector<std::string>> {
         using JNIType = CompileTimeString<'[','L','j','a','v','a','/','l','a','n','g','/','S','t','r','i','n','g',';'>;
         inline static jobjectArray convert(const std::vector<std::string> & obj) { return Utils::toJObjectArray(obj);}
     };
 
+    //primitive arrays: a single New<Type>Array plus one Set<Type>ArrayRegion
+    template<typename T>
+    struct CPPToJNIConversor<std::vector<T>> {
+        using JNIType = typename JNIArrayTraits<T>::JNIType;
+        inline static typename JNIArrayTraits<T>::ArrayType convert(const std::vector<T> & obj) { return toJavaArray(obj.data(), obj.size());}
+    };
+    
+    template<typename T, size_t N>
+    struct CPPToJNIConversor<std::array<T, N>> {
+        using JNIType = typename JNIArrayTraits<T>::JNIType;
+        inline static typename JNIArrayTraits<T>::ArrayType convert(const std::array<T, N> & obj) { return toJavaArray(obj.data(), N);}
+    };
+    
+    template<typename T>
+    struct CPPToJNIConversor<Span<T>> {
+        using JNIType = typename JNIArrayTraits<T>::JNIType;
+        inline static typename JNIArrayTraits<T>::ArrayType convert(const Span<T> & obj) { return toJavaArray(obj.data(), obj.size());}
+    };
+    
+#if __cplusplus >= 202002L
+    template<typename T, size_t E>
+    struct CPPToJNIConversor<std::span<T, E>>: CPPToJNIConversor<Span<typename std::remove_const<T>::type>> {
+        inline static typename JNIArrayTraits<typename std::remove_const<T>::type>::ArrayType convert(const std::span<T, E> & obj) { return toJavaArray(obj.data(), obj.size());}
+    };
+    
+#ifdef SAFEJNI_ENABLE_STATS
+    template <typename T, size_t E>
+    struct JNIMarshalSize<std::span<T, E>> {
+        static inline size_t size(const std::span<T, E> & values) { return values.size_bytes();}
+    };
+#endif
+#endif
+    
+    //std::vector<bool> is not contiguous, it goes through a temporary buffer
     template<>
-    struct CPPToJNIConversor<std::vector<uint8_t>> {
-        using JNIType = CompileTimeString<'[','B'>;
-        inline static jbyteArray convert(const std::vector<uint8_t> & obj) { return Utils::toJObjectArray(obj);}
+    struct CPPToJNIConversor<std::vector<bool>> {
+        using JNIType = typename JNIArrayTraits<bool>::JNIType;
+        inline static jbooleanArray convert(const std::vector<bool> & obj) {
+            std::unique_ptr<bool[]> buffer(new bool[obj.size()]);
+            std::copy(obj.begin(), obj.end(), buffer.get());
+            return toJavaArray(buffer.get(), obj.size());
+        }
     };
 
     template<>
@@ -169,16 +1054,26 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         inline static jobject convert(jobject obj) { return obj;}
     };
     
+    //weak objects are passed as a local ref promoted for the call (released with the other params, see JNITemporaryParam)
     template<>
     struct CPPToJNIConversor<JNIObjectPtr> {
         using JNIType = CompileTimeString<'L','j','a','v','a','/','l','a','n','g','/','O','b','j','e','c','t',';'>;
-        inline static jobject convert(const JNIObjectPtr & obj) { return obj->instance;}
+        inline static jobject convert(const JNIObjectPtr & obj) {
+            if (!obj || !obj->isWeak()) {
+                return obj ? obj->instance : nullptr;
+            }
+            jobject strong = obj->lock().release();
+            if (!strong) {
+                SAFEJNI_THROW(JNIException("The Java object of a weak JNIObject has been collected."));
+            }
+            return strong;
+        }
     };
     
     template<>
     struct CPPToJNIConversor<std::vector<jobject>> {
         using JNIType = CompileTimeString<'[','L','j','a','v','a','/','l','a','n','g','/','O','b','j','e','c','t',';'>;
-        inline static jbyteArray convert(const std::vector<uint8_t> & obj) { return Utils::toJObjectArray(obj);}
+        inline static jobjectArray convert(const std::vector<jobject> & obj) { return Utils::toJObjectArray(obj);}
     };
 
     template<>
@@ -187,25 +1082,56 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         inline static jobject convert(const std::map<std::string,std::string> & obj) { return Utils::toHashMap(obj);}
     };
     
-    //Add more types here
-    
-    //void conversor
-    
     template<>
-    struct CPPToJNIConversor<void> {
-        using JNIType = CompileTimeString<'V'>;
+    struct CPPToJNIConversor<std::unordered_map<std::string, std::string>> {
+        using JNIType = CompileTimeString<'L','j','a','v','a','/','u','t','i','l','/','H','a','s','h','M','a','p',';'>;
+        inline static jobject convert(const std::unordered_map<std::string,std::string> & obj) { return Utils::toHashMap(obj);}
     };
     
-    //primivite objects implementation
-    
     template<>
-    struct CPPToJNIConversor<int32_t> {
-        using JNIType = CompileTimeString<'I'>;
-        inline static jint convert(int value) { return static_cast<jint>(value);}
+    struct CPPToJNIConversor<DirectBuffer> {
+        using JNIType = CompileTimeString<'L','j','a','v','a','/','n','i','o','/','B','y','t','e','B','u','f','f','e','r',';'>;
+        inline static jobject convert(const DirectBuffer & obj) { return Utils::toDirectByteBuffer(obj.data, obj.size);}
     };
     
     template<>
-    struct CPPToJNIConversor<int64_t> {
+    struct CPPToJNIConversor<NativeBuffer> {
+        using JNIType = CompileTimeString<'L','j','a','v','a','/','n','i','o','/','B','y','t','e','B','u','f','f','e','r',';'>;
+        inline static jobject convert(const NativeBuffer & obj) { return Utils::toDirectByteBuffer(obj);}
+    };
+    
+    //array views are passed without copying: pending writes are committed first and the view keeps ownership of the reference.
+    //CRITICAL views can't be passed to Java because no JNI call may be made while they are alive.
+    template<typename T>
+    struct CPPToJNIConversor<JNIArrayView<T, ArrayAccess::ELEMENTS>> {
+        using JNIType = typename JNIArrayTraits<T>::JNIType;
+        inline static jarray convert(const JNIArrayView<T, ArrayAccess::ELEMENTS> & obj) { obj.commit(); return obj.array();}
+    };
+    
+    template<typename T>
+    struct CPPToJNIConversor<JNIArrayView<T, ArrayAccess::CRITICAL>> {
+        using JNIType = typename JNIArrayTraits<T>::JNIType;
+    };
+    
+    //Add more types here
+    
+    //void conversor
+    
+    template<>
+    struct CPPToJNIConversor<void> {
+        using JNIType = CompileTimeString<'V'>;
+    };
+    
+    //primivite objects implementation
+    
+    template<>
+    struct CPPToJNIConversor<int32_t> {
+        using JNIType = CompileTimeString<'I'>;
+        inline static jint convert(int value) { return static_cast<jint>(value);}
+    };
+    
+    template<>
+    struct CPPToJNIConversor<int64_t> {
         using JNIType = CompileTimeString<'J'>;
         inline static jlong convert(int64_t value) { return static_cast<jlong>(value);}
     };
@@ -256,66 +1182,283 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         inline static const char * jniTypeName();
     };
     
+    template<>
+    struct JNIToCPPConversor<jobject> {
+        inline static jobject convert(jobject obj) { return obj; }
+    };
+    
     template<>
     struct JNIToCPPConversor<std::string> {
         inline static std::string convert(jobject obj) { return Utils::toString((jstring)obj); }
     };
     
+    template<>
+    struct JNIToCPPConversor<std::u16string> {
+        inline static std::u16string convert(jobject obj) { return Utils::toU16String((jstring)obj); }
+    };
+    
     template<>
     struct JNIToCPPConversor<std::vector<std::string>> {
         inline static std::vector<std::string> convert(jobject obj) { return Utils::toVectorString((jobjectArray)obj); }
     };
     
+    //primitive arrays: a single Get<Type>ArrayRegion into the destination
+    template<typename T>
+    struct JNIToCPPConversor<std::vector<T>> {
+        inline static std::vector<T> convert(jobject obj) {
+            auto array = static_cast<typename JNIArrayTraits<T>::ArrayType>(obj);
+            std::vector<T> result(getJavaArrayLength(array));
+            copyJavaArray(array, result.data(), result.size());
+            return result;
+        }
+    };
+    
+    //copies at most N elements, the remaining ones are value-initialized
+    template<typename T, size_t N>
+    struct JNIToCPPConversor<std::array<T, N>> {
+        inline static std::array<T, N> convert(jobject obj) {
+            auto array = static_cast<typename JNIArrayTraits<T>::ArrayType>(obj);
+            std::array<T, N> result = {};
+            copyJavaArray(array, result.data(), std::min(getJavaArrayLength(array), N));
+            return result;
+        }
+    };
+    
     template<>
-    struct JNIToCPPConversor<std::vector<uint8_t>> {
-        inline static std::vector<uint8_t> convert(jobject obj) { return Utils::toVectorByte((jbyteArray)obj);}
+    struct JNIToCPPConversor<std::vector<bool>> {
+        inline static std::vector<bool> convert(jobject obj) {
+            jbooleanArray array = static_cast<jbooleanArray>(obj);
+            size_t length = getJavaArrayLength(array);
+            std::unique_ptr<bool[]> buffer(new bool[length]);
+            copyJavaArray(array, buffer.get(), length);
+            return std::vector<bool>(buffer.get(), buffer.get() + length);
+        }
     };
 
+    template<>
+    struct JNIToCPPConversor<std::map<std::string, std::string>> {
+        inline static std::map<std::string, std::string> convert(jobject obj) { return Utils::toMap(obj);}
+    };
+    
+    template<>
+    struct JNIToCPPConversor<std::unordered_map<std::string, std::string>> {
+        inline static std::unordered_map<std::string, std::string> convert(jobject obj) { return Utils::toUnorderedMap(obj);}
+    };
+    
     template<>
     struct JNIToCPPConversor<std::vector<jobject>> {
         inline static std::vector<jobject> convert(jobject obj) { return Utils::toVectorJObject((jobjectArray)obj);}
     };
     
     
+    //the address is valid while the Java ByteBuffer is reachable
+    template<>
+    struct JNIToCPPConversor<DirectBuffer> {
+        inline static DirectBuffer convert(jobject obj) { return Utils::toDirectBuffer(obj);}
+    };
+    
+    //keeps the Java ByteBuffer alive through a global ref for as long as the NativeBuffer is used
+    template<>
+    struct JNIToCPPConversor<NativeBuffer> {
+        inline static NativeBuffer convert(jobject obj) { return Utils::toNativeBuffer(obj);}
+    };
+    
+    //borrowed view over an array received from Java (the caller keeps ownership of the reference)
+    template<typename T, ArrayAccess ACCESS>
+    struct JNIToCPPConversor<JNIArrayView<T, ACCESS>> {
+        inline static JNIArrayView<T, ACCESS> convert(jobject obj) { return JNIArrayView<T, ACCESS>(static_cast<typename JNIArrayTraits<T>::ArrayType>(obj));}
+    };
+    
+    
+#pragma mark Typed Java Objects
+    
+    //Declares a tag type naming a Java class, for JavaObject
+#define SAFEJNI_JAVA_CLASS(Tag, className) \
+    struct Tag { \
+        static_assert(sizeof(className) <= 129, "SAFEJNI_JAVA_CLASS supports class names of up to 128 characters"); \
+        using Name = SAFEJNI_STRING(className); \
+    }
+    
+    //JNIObject of a class known at compile time. Signatures use its exact Lpkg/Class; type instead of java/lang/Object,
+    //and the class is resolved once per type, so returned objects are wrapped without looking their class up.
+    //  SAFEJNI_JAVA_CLASS(Bitmap, "android/graphics/Bitmap");
+    //  JavaObject<Bitmap> bitmap = callStatic<JavaObject<Bitmap>>("com/example/Images", "decode", path);
+    //  int32_t width = bitmap.call<int32_t>("getWidth");
+    template <typename ClassTag>
+    class JavaObject {
+    public:
+        using Name = typename ClassTag::Name;
+        
+        JavaObject() {}
+        explicit JavaObject(JNIObjectPtr object): object(std::move(object)) {}
+        
+        static inline const char * className() { return Name::value();}
+        //resolved on first use and shared by every JavaObject of this type
+        static const JNIClassInfo & classInfo();
+        //keeps a global ref to obj (which is not released), an empty object if obj is null
+        static JavaObject wrap(jobject obj);
+        template<typename... Args> static JavaObject create(Args&&... v);
+        template<typename T = void, typename... Args> T call(const std::string & methodName, Args&&... v) const;
+        
+        //the raw ref: a weak global ref when the object is weak, which must be promoted with ptr()->lock() before use
+        inline jobject get() const { return object ? object->instance : nullptr;}
+        inline const JNIObjectPtr & ptr() const { return object;}
+        explicit inline operator bool() const { return object != nullptr;}
+    private:
+        JNIObjectPtr object;
+        static std::atomic<const JNIClassInfo*> resolvedClass;
+    };
+    
+    template <typename ClassTag>
+    std::atomic<const JNIClassInfo*> JavaObject<ClassTag>::resolvedClass(nullptr);
+    
+    template <typename ClassTag>
+    const JNIClassInfo & JavaObject<ClassTag>::classInfo()
+    {
+        const JNIClassInfo * info = resolvedClass.load(std::memory_order_acquire);
+        if (!info) {
+            info = &Utils::findClassInfo(className());
+            resolvedClass.store(info, std::memory_order_release);
+        }
+        return *info;
+    }
+    
+    template <typename ClassTag>
+    JavaObject<ClassTag> JavaObject<ClassTag>::wrap(jobject obj)
+    {
+        return obj ? JavaObject(JNIObject::create(obj, classInfo())) : JavaObject();
+    }
+    
+    template <typename ClassTag>
+    struct CPPToJNIConversor<JavaObject<ClassTag>> {
+        using JNIType = typename Concatenate<CompileTimeString<'L'>, typename ClassTag::Name, CompileTimeString<';'>>::Result;
+        inline static jobject convert(const JavaObject<ClassTag> & obj) { return CPPToJNIConversor<JNIObjectPtr>::convert(obj.ptr());}
+    };
+    
+    template <typename ClassTag>
+    struct JNIToCPPConversor<JavaObject<ClassTag>> {
+        inline static JavaObject<ClassTag> convert(jobject obj) { return JavaObject<ClassTag>::wrap(obj);}
+    };
+    
 #pragma mark JNI Call Template Specializations
     
+    //JNIToCPPConversor<T>::convert, reporting the conversion to the stats scope of the call when stats are compiled in
+    template <typename T>
+    inline T JNIUnmarshal(jobject obj)
+    {
+#ifdef SAFEJNI_ENABLE_STATS
+        JNIStatsScope * statsScope = JNIStatsScope::current();
+        if (statsScope) {
+            JNIStatsClock::time_point start = JNIStatsClock::now();
+            T result = JNIToCPPConversor<T>::convert(obj);
+            statsScope->unmarshalled(JNIStatsClock::now() - start, JNIMarshalSize<T>::size(result), obj != nullptr);
+            return result;
+        }
+#endif
+        return JNIToCPPConversor<T>::convert(obj);
+    }
+    
     //default implementation (for jobject types)
     template <typename T, typename... Args>
     struct JNICaller {
         static T callStatic(JNIEnv *env, jclass cls, jmethodID method, Args... v) {
             auto obj = env->CallStaticObjectMethod(cls,method,v...);
-            T result = JNIToCPPConversor<T>::convert(obj);
-            if (obj)
+            T result = JNIUnmarshal<T>(obj);
+            if (obj && !LocalFrame::active())
                 env->DeleteLocalRef(obj);
             return result;
         }
         static T callInstance(JNIEnv *env, jobject instance,jmethodID method, Args... v){
             auto obj = env->CallObjectMethod(instance,method,v...);
-            T result = JNIToCPPConversor<T>::convert(obj);
-            if (obj)
+            T result = JNIUnmarshal<T>(obj);
+            if (obj && !LocalFrame::active())
                 env->DeleteLocalRef(obj);
             return result;
         }
         static T getField(JNIEnv * env, jobject instance, jfieldID fid) {
             auto obj = env->GetObjectField(instance, fid);
-            T result = JNIToCPPConversor<T>::convert(obj);
-            if (obj) 
+            T result = JNIUnmarshal<T>(obj);
+            if (obj && !LocalFrame::active())
+                env->DeleteLocalRef(obj);
+            return result;
+        }
+        static T getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            auto obj = env->GetStaticObjectField(cls, fid);
+            T result = JNIUnmarshal<T>(obj);
+            if (obj && !LocalFrame::active())
                 env->DeleteLocalRef(obj);
             return result;
         }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jobject value) {
+            env->SetObjectField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jobject value) {
+            env->SetStaticObjectField(cls, fid, value);
+        }
     };
     
     // Raw jobject implementation (When the user wants one instead of auto conversion)
     template <typename... Args>
     struct JNICaller<JNIObjectPtr,Args...> {
         static JNIObjectPtr callStatic(JNIEnv *env, jclass cls, jmethodID method, Args... v) {
-            return JNIObject::createWeak(env->CallStaticObjectMethod(cls, method, v...));
+            return JNIObject::createFromLocal(env->CallStaticObjectMethod(cls, method, v...));
         }
         static JNIObjectPtr callInstance(JNIEnv *env, jobject instance, jmethodID method, Args... v) {
-            return JNIObject::createWeak(env->CallObjectMethod(instance, method, v...));
+            return JNIObject::createFromLocal(env->CallObjectMethod(instance, method, v...));
         }
         static JNIObjectPtr getField(JNIEnv * env, jobject instance, jfieldID fid) {
-            return JNIObject::createWeak(env->GetObjectField(instance, fid));
+            return JNIObject::createFromLocal(env->GetObjectField(instance, fid));
+        }
+        static JNIObjectPtr getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return JNIObject::createFromLocal(env->GetStaticObjectField(cls, fid));
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jobject value) {
+            env->SetObjectField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jobject value) {
+            env->SetStaticObjectField(cls, fid, value);
+        }
+    };
+    
+    // Raw local ref, owned by the caller (jobject would otherwise match the native pointer specialization)
+    template <typename... Args>
+    struct JNICaller<jobject,Args...> {
+        static jobject callStatic(JNIEnv *env, jclass cls, jmethodID method, Args... v) {
+            return env->CallStaticObjectMethod(cls, method, v...);
+        }
+        static jobject callInstance(JNIEnv *env, jobject instance, jmethodID method, Args... v) {
+            return env->CallObjectMethod(instance, method, v...);
+        }
+        static jobject getField(JNIEnv * env, jobject instance, jfieldID fid) {
+            return env->GetObjectField(instance, fid);
+        }
+        static jobject getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return env->GetStaticObjectField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jobject value) {
+            env->SetObjectField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jobject value) {
+            env->SetStaticObjectField(cls, fid, value);
+        }
+    };
+    
+    // Array views take ownership of the returned local ref, so the array is accessed in place without any copy
+    template <typename T, ArrayAccess ACCESS, typename... Args>
+    struct JNICaller<JNIArrayView<T, ACCESS>,Args...> {
+        typedef JNIArrayView<T, ACCESS> View;
+        typedef typename View::ArrayType ArrayType;
+        static View callStatic(JNIEnv *env, jclass cls, jmethodID method, Args... v) {
+            return View(static_cast<ArrayType>(env->CallStaticObjectMethod(cls, method, v...)), true);
+        }
+        static View callInstance(JNIEnv *env, jobject instance, jmethodID method, Args... v) {
+            return View(static_cast<ArrayType>(env->CallObjectMethod(instance, method, v...)), true);
+        }
+        static View getField(JNIEnv * env, jobject instance, jfieldID fid) {
+            return View(static_cast<ArrayType>(env->GetObjectField(instance, fid)), true);
+        }
+        static View getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return View(static_cast<ArrayType>(env->GetStaticObjectField(cls, fid)), true);
         }
     };
     
@@ -331,6 +1474,15 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         static T* getField(JNIEnv * env, jobject instance, jfieldID fid) {
             return (T*)env->GetLongField(instance, fid);
         }
+        static T* getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return (T*)env->GetStaticLongField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jlong value) {
+            env->SetLongField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jlong value) {
+            env->SetStaticLongField(cls, fid, value);
+        }
     };
     
     //void implementation
@@ -358,6 +1510,15 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         static bool getField(JNIEnv * env, jobject instance, jfieldID fid) {
             return env->GetBooleanField(instance, fid);
         }
+        static bool getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return env->GetStaticBooleanField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jboolean value) {
+            env->SetBooleanField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jboolean value) {
+            env->SetStaticBooleanField(cls, fid, value);
+        }
     };
     
     template <typename... Args>
@@ -371,6 +1532,15 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         static int8_t getField(JNIEnv * env, jobject instance, jfieldID fid) {
             return env->GetByteField(instance, fid);
         }
+        static int8_t getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return env->GetStaticByteField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jbyte value) {
+            env->SetByteField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jbyte value) {
+            env->SetStaticByteField(cls, fid, value);
+        }
     };
     
     template <typename... Args>
@@ -384,6 +1554,15 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         static uint8_t getField(JNIEnv * env, jobject instance, jfieldID fid) {
             return env->GetCharField(instance, fid);
         }
+        static uint8_t getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return env->GetStaticCharField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jchar value) {
+            env->SetCharField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jchar value) {
+            env->SetStaticCharField(cls, fid, value);
+        }
     };
     
     template <typename... Args>
@@ -397,6 +1576,15 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         static int16_t getField(JNIEnv * env, jobject instance, jfieldID fid) {
             return env->GetShortField(instance, fid);
         }
+        static int16_t getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return env->GetStaticShortField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jshort value) {
+            env->SetShortField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jshort value) {
+            env->SetStaticShortField(cls, fid, value);
+        }
     };
     
     template <typename... Args>
@@ -410,6 +1598,15 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         static int32_t getField(JNIEnv * env, jobject instance, jfieldID fid) {
             return env->GetIntField(instance, fid);
         }
+        static int32_t getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return env->GetStaticIntField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jint value) {
+            env->SetIntField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jint value) {
+            env->SetStaticIntField(cls, fid, value);
+        }
     };
     
     template <typename... Args>
@@ -423,6 +1620,15 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         static int64_t getField(JNIEnv * env, jobject instance, jfieldID fid) {
             return env->GetLongField(instance, fid);
         }
+        static int64_t getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return env->GetStaticLongField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jlong value) {
+            env->SetLongField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jlong value) {
+            env->SetStaticLongField(cls, fid, value);
+        }
     };
     
     template <typename... Args>
@@ -436,6 +1642,15 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         static float getField(JNIEnv * env, jobject instance, jfieldID fid) {
             return env->GetFloatField(instance, fid);
         }
+        static float getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return env->GetStaticFloatField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jfloat value) {
+            env->SetFloatField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jfloat value) {
+            env->SetStaticFloatField(cls, fid, value);
+        }
     };
     
     template <typename... Args>
@@ -449,6 +1664,15 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         static double getField(JNIEnv * env, jobject instance, jfieldID fid) {
             return env->GetDoubleField(instance, fid);
         }
+        static double getStaticField(JNIEnv * env, jclass cls, jfieldID fid) {
+            return env->GetStaticDoubleField(cls, fid);
+        }
+        static void setField(JNIEnv * env, jobject instance, jfieldID fid, jdouble value) {
+            env->SetDoubleField(instance, fid, value);
+        }
+        static void setStaticField(JNIEnv * env, jclass cls, jfieldID fid, jdouble value) {
+            env->SetStaticDoubleField(cls, fid, value);
+        }
     };
     
 #pragma mark JNI Signature Utilities
@@ -458,9 +1682,9 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         buffer+= CPPToJNIConversor<T>::jniTypeName();
     }
     
-    //deduces the signature of a JNI method according to the variadic params and the return type
+    //deduces the signature of a JNI method according to the param types and the return type
     template <typename T, typename... Args>
-    inline const char * getJNISignature(Args...) {
+    inline const char * getJNITypeSignature() {
         return Concatenate<CompileTimeString<'('>, //left parenthesis
                             typename CPPToJNIConversor<Args>::JNIType..., //params signature
                             CompileTimeString<')'>, //right parenthesis
@@ -469,16 +1693,47 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
                             ::Result::value();
     }
     
+    //deduces the signature of a JNI method according to the variadic params and the return type
+    template <typename T, typename... Args>
+    inline const char * getJNISignature(Args...) {
+        return getJNITypeSignature<T, Args...>();
+    }
+    
+    //signature of a field of the given type
+    template <typename T>
+    inline const char * getJNIFieldSignature() {
+        return Concatenate<typename CPPToJNIConversor<T>::JNIType,
+                            CompileTimeString<'\0'>>
+                            ::Result::value();
+    }
+    
 #pragma mark JNI Param Destructor Templates
     
+    //Tells a destructor whether the stack is unwinding past the scope that created it. Without std::uncaught_exceptions
+    //(before C++17) a call made from a destructor during unwinding skips its exception check.
+    class JNIUnwindCheck {
+    public:
+#ifdef __cpp_lib_uncaught_exceptions
+        JNIUnwindCheck(): count(std::uncaught_exceptions()) {}
+        inline bool unwinding() const { return std::uncaught_exceptions() > count;}
+    private:
+        int count;
+#else
+        inline bool unwinding() const { return std::uncaught_exception();}
+#endif
+    };
+    
     //Helper object to destroy parameters converter to JNI
     template <uint8_t NUM_PARAMS>
     struct JNIParamDestructor {
         JNIEnv* jniEnv;
         jobject jniParams[NUM_PARAMS] = {0};
         int currentIndex;
+        //inside a LocalFrame the refs are released all at once when the frame is popped
+        bool deleteRefs;
+        JNIUnwindCheck unwindCheck;
         
-        JNIParamDestructor(JNIEnv * env): jniEnv(env), currentIndex(0) {
+        JNIParamDestructor(JNIEnv * env): jniEnv(env), currentIndex(0), deleteRefs(!LocalFrame::active()) {
             
         }
         
@@ -486,21 +1741,27 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
             jniParams[currentIndex++] = jniObject;
         }
         
-        ~JNIParamDestructor() {
-            for (int i = 0; i< NUM_PARAMS; ++i) {
+        //the exception check of the call may throw, unless the stack is already unwinding
+        ~JNIParamDestructor() noexcept(false) {
+            for (int i = 0; deleteRefs && i< NUM_PARAMS; ++i) {
                 if (jniParams[i])
                     jniEnv->DeleteLocalRef(jniParams[i]);
             }
-            JNI_EXCEPTION_CHECK
+            if (!unwindCheck.unwinding()) {
+                JNI_EXCEPTION_CHECK
+            }
         }
     };
     
     //optimized base case for the destructor
     template<>
     struct JNIParamDestructor<0> {
+        JNIUnwindCheck unwindCheck;
         JNIParamDestructor(JNIEnv * env) {}
-        ~JNIParamDestructor() {
-            JNI_EXCEPTION_CHECK
+        ~JNIParamDestructor() noexcept(false) {
+            if (!unwindCheck.unwinding()) {
+                JNI_EXCEPTION_CHECK
+            }
         }
     };
     
@@ -522,6 +1783,41 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         inline static void decide(jbyteArray obj, D & destructor) {destructor.add((jobject)obj);}
     };
     
+    template<typename D>
+    struct JNIDestructorDecider<jbooleanArray,D> {
+        inline static void decide(jbooleanArray obj, D & destructor) {destructor.add((jobject)obj);}
+    };
+    
+    template<typename D>
+    struct JNIDestructorDecider<jcharArray,D> {
+        inline static void decide(jcharArray obj, D & destructor) {destructor.add((jobject)obj);}
+    };
+    
+    template<typename D>
+    struct JNIDestructorDecider<jshortArray,D> {
+        inline static void decide(jshortArray obj, D & destructor) {destructor.add((jobject)obj);}
+    };
+    
+    template<typename D>
+    struct JNIDestructorDecider<jintArray,D> {
+        inline static void decide(jintArray obj, D & destructor) {destructor.add((jobject)obj);}
+    };
+    
+    template<typename D>
+    struct JNIDestructorDecider<jlongArray,D> {
+        inline static void decide(jlongArray obj, D & destructor) {destructor.add((jobject)obj);}
+    };
+    
+    template<typename D>
+    struct JNIDestructorDecider<jfloatArray,D> {
+        inline static void decide(jfloatArray obj, D & destructor) {destructor.add((jobject)obj);}
+    };
+    
+    template<typename D>
+    struct JNIDestructorDecider<jdoubleArray,D> {
+        inline static void decide(jdoubleArray obj, D & destructor) {destructor.add((jobject)obj);}
+    };
+    
     template<typename D>
     struct JNIDestructorDecider<jobjectArray,D> {
         inline static void decide(jobjectArray obj, D & destructor) {destructor.add((jobject)obj);}
@@ -532,14 +1828,103 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
         inline static void decide(jstring obj, D & destructor) {destructor.add((jobject)obj);}
     };
     
+    //conversions that pass a reference owned by the caller (a raw jobject, a JNIObject instance) must not release it after the call
+    template<typename T>
+    struct JNIBorrowedParam {
+        static constexpr bool value = false;
+    };
+    
+    template<>
+    struct JNIBorrowedParam<jobject> {
+        static constexpr bool value = true;
+    };
+    
+    template<>
+    struct JNIBorrowedParam<JNIObjectPtr> {
+        static constexpr bool value = true;
+    };
+    
+    template<typename T, ArrayAccess ACCESS>
+    struct JNIBorrowedParam<JNIArrayView<T, ACCESS>> {
+        static constexpr bool value = true;
+    };
+    
+    template<typename ClassTag>
+    struct JNIBorrowedParam<JavaObject<ClassTag>> {
+        static constexpr bool value = true;
+    };
+    
+    //borrowed params that sometimes convert to a new local ref, which is released after the call like any other
+    template<typename T>
+    struct JNITemporaryParam {
+        static inline bool value(const T &) { return false;}
+    };
+    
+    template<>
+    struct JNITemporaryParam<JNIObjectPtr> {
+        static inline bool value(const JNIObjectPtr & obj) { return obj && obj->isWeak();}
+    };
+    
+    template<typename ClassTag>
+    struct JNITemporaryParam<JavaObject<ClassTag>> {
+        static inline bool value(const JavaObject<ClassTag> & obj) { return JNITemporaryParam<JNIObjectPtr>::value(obj.ptr());}
+    };
+    
+    //views over memory owned by the caller, only valid for the duration of the call
+    template<typename T>
+    struct JNIViewParam {
+        static constexpr bool value = false;
+    };
+    
+    template<typename T>
+    struct JNIViewParam<Span<T>> {
+        static constexpr bool value = true;
+    };
+    
+#if __cplusplus >= 201703L
+    template<>
+    struct JNIViewParam<std::string_view> {
+        static constexpr bool value = true;
+    };
+#endif
+    
+#if __cplusplus >= 202002L
+    template<typename T, size_t E>
+    struct JNIViewParam<std::span<T, E>> {
+        static constexpr bool value = true;
+    };
+#endif
+    
+    template<typename... Args>
+    struct JNIViewParams {
+        static constexpr bool value = false;
+    };
+    
+    template<typename T, typename... Rest>
+    struct JNIViewParams<T, Rest...> {
+        static constexpr bool value = JNIViewParam<T>::value || JNIViewParams<Rest...>::value;
+    };
+    
 #pragma mark JNI Param Conversor Utility Template
     
     //JNI param conversor helper: Converts the parameter to JNI and adds it to the destructor if needed
     template <typename T, typename D>
     auto JNIParamConversor(const T & arg, D & destructor) -> decltype(CPPToJNIConversor<T>::convert(arg))
     {
+#ifdef SAFEJNI_ENABLE_STATS
+        JNIStatsScope * statsScope = JNIStatsScope::current();
+        JNIStatsClock::time_point start = statsScope ? JNIStatsClock::now() : JNIStatsClock::time_point();
+#endif
         auto result = CPPToJNIConversor<T>::convert(arg);
-        JNIDestructorDecider<decltype(CPPToJNIConversor<T>::convert(arg)),D>::decide(result, destructor);
+        const bool owned = !JNIBorrowedParam<T>::value || JNITemporaryParam<T>::value(arg);
+        if (owned) {
+            JNIDestructorDecider<decltype(CPPToJNIConversor<T>::convert(arg)),D>::decide(result, destructor);
+        }
+#ifdef SAFEJNI_ENABLE_STATS
+        if (statsScope) {
+            statsScope->marshalled(JNIStatsClock::now() - start, JNIMarshalSize<T>::size(arg), owned && std::is_pointer<decltype(result)>::value);
+        }
+#endif
         return result;
     }
     
@@ -547,53 +1932,1152 @@ template <typename C1, typename ...C> struct Concatenate<C1,C...>{
 #pragma mark Public API
     
     //generic call to static method
-    template<typename T = void, typename... Args> T callStatic(const std::string & className, const std::string & methodName, Args... v)
+    //Arguments are taken by forwarding reference and converted in place: containers are never copied before marshalling
+    template<typename T = void, typename... Args> T callStatic(const std::string & className, const std::string & methodName, Args&&... v)
     {
         static constexpr uint8_t nargs = sizeof...(Args);
+        SAFEJNI_STATS_START
         JNIEnv* jniEnv = Utils::getJNIEnvAttach();
-        SPJNIMethodInfo methodInfo = Utils::getStaticMethodInfo(className, methodName, getJNISignature<T,Args...>(v...));
+        const JNIMethodInfo & methodInfo = Utils::findStaticMethod(className.c_str(), methodName.c_str(), getJNITypeSignature<T, typename std::decay<Args>::type...>());
+        SAFEJNI_STATS_SCOPE(methodInfo)
         JNIParamDestructor<nargs> paramDestructor(jniEnv);
-        return JNICaller<T,decltype(CPPToJNIConversor<Args>::convert(v))...>::callStatic(jniEnv, methodInfo->classId, methodInfo->methodId, JNIParamConversor<Args>(v, paramDestructor)...);
+        return JNICaller<T,decltype(CPPToJNIConversor<typename std::decay<Args>::type>::convert(v))...>::callStatic(jniEnv, methodInfo.classId, methodInfo.methodId, JNIParamConversor<typename std::decay<Args>::type>(v, paramDestructor)...);
     }
     
     //generic call to instance method
-    template<typename T = void, typename... Args> T call(jobject instance, const std::string & className, const std::string & methodName, Args... v)
+    template<typename T = void, typename... Args> T call(jobject instance, const std::string & className, const std::string & methodName, Args&&... v)
     {
         static constexpr uint8_t nargs = sizeof...(Args);
+        SAFEJNI_STATS_START
         JNIEnv* jniEnv = Utils::getJNIEnvAttach();
-        SPJNIMethodInfo methodInfo = Utils::getMethodInfo(className, methodName, getJNISignature<T,Args...>(v...));
+        const JNIMethodInfo & methodInfo = Utils::findMethod(className.c_str(), methodName.c_str(), getJNITypeSignature<T, typename std::decay<Args>::type...>());
+        SAFEJNI_STATS_SCOPE(methodInfo)
         JNIParamDestructor<nargs> paramDestructor(jniEnv);
-        return JNICaller<T,decltype(CPPToJNIConversor<Args>::convert(v))...>::callInstance(jniEnv, instance, methodInfo->methodId, JNIParamConversor<Args>(v, paramDestructor)...);
+        return JNICaller<T,decltype(CPPToJNIConversor<typename std::decay<Args>::type>::convert(v))...>::callInstance(jniEnv, instance, methodInfo.methodId, JNIParamConversor<typename std::decay<Args>::type>(v, paramDestructor)...);
     }
 
+    //field access by name. The class is taken from the instance, so the field ID is looked up on every call
     template<typename T> T getField(jobject instance, const std::string & propertyName)
     {
         JNIEnv* jniEnv = Utils::getJNIEnvAttach();
         jclass clazz = jniEnv->GetObjectClass(instance);
-        const char * signature = Concatenate<typename CPPToJNIConversor<T>::JNIType,
-                                            CompileTimeString<'\0'>> //return type signature
-                                            ::Result::value();
-        jfieldID fid = jniEnv->GetFieldID(clazz, propertyName.c_str(), signature);
+        jfieldID fid = jniEnv->GetFieldID(clazz, propertyName.c_str(), getJNIFieldSignature<T>());
+        jniEnv->DeleteLocalRef(clazz);
+        JNI_EXCEPTION_CHECK
         return JNICaller<T>::getField(jniEnv, instance, fid);
-
     }
     
-    // JNIObject templates
-    template<typename... Args> std::shared_ptr<JNIObject> JNIObject::create(const std::string & className, Args ...v)
+    template<typename T> void setField(jobject instance, const std::string & propertyName, const T & value)
+    {
+        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+        jclass clazz = jniEnv->GetObjectClass(instance);
+        jfieldID fid = jniEnv->GetFieldID(clazz, propertyName.c_str(), getJNIFieldSignature<T>());
+        jniEnv->DeleteLocalRef(clazz);
+        JNI_EXCEPTION_CHECK
+        JNIParamDestructor<1> paramDestructor(jniEnv);
+        JNICaller<T>::setField(jniEnv, instance, fid, JNIParamConversor<T>(value, paramDestructor));
+    }
+    
+    //field access with a known class name (field IDs are cached)
+    template<typename T> T getField(jobject instance, const std::string & className, const std::string & propertyName)
+    {
+        SAFEJNI_STATS_START
+        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+        const JNIFieldInfo & fieldInfo = Utils::findField(className.c_str(), propertyName.c_str(), getJNIFieldSignature<T>());
+        SAFEJNI_STATS_SCOPE(fieldInfo)
+        return JNICaller<T>::getField(jniEnv, instance, fieldInfo.fieldId);
+    }
+    
+    template<typename T> void setField(jobject instance, const std::string & className, const std::string & propertyName, const T & value)
+    {
+        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+        const JNIFieldInfo & fieldInfo = Utils::findField(className.c_str(), propertyName.c_str(), getJNIFieldSignature<T>());
+        JNIParamDestructor<1> paramDestructor(jniEnv);
+        JNICaller<T>::setField(jniEnv, instance, fieldInfo.fieldId, JNIParamConversor<T>(value, paramDestructor));
+    }
+    
+    template<typename T> T getStaticField(const std::string & className, const std::string & propertyName)
+    {
+        SAFEJNI_STATS_START
+        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+        const JNIFieldInfo & fieldInfo = Utils::findStaticField(className.c_str(), propertyName.c_str(), getJNIFieldSignature<T>());
+        SAFEJNI_STATS_SCOPE(fieldInfo)
+        return JNICaller<T>::getStaticField(jniEnv, fieldInfo.classId, fieldInfo.fieldId);
+    }
+    
+    template<typename T> void setStaticField(const std::string & className, const std::string & propertyName, const T & value)
+    {
+        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+        const JNIFieldInfo & fieldInfo = Utils::findStaticField(className.c_str(), propertyName.c_str(), getJNIFieldSignature<T>());
+        JNIParamDestructor<1> paramDestructor(jniEnv);
+        JNICaller<T>::setStaticField(jniEnv, fieldInfo.classId, fieldInfo.fieldId, JNIParamConversor<T>(value, paramDestructor));
+    }
+    
+    //calls and field access through already resolved members (Utils::findMethod & co, generated proxies):
+    //no name or signature work is done per call
+    template<typename T = void, typename... Args> T callStatic(const JNIMethodInfo & methodInfo, Args&&... v)
+    {
+        static constexpr uint8_t nargs = sizeof...(Args);
+        SAFEJNI_STATS_START
+        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+        SAFEJNI_STATS_SCOPE(methodInfo)
+        JNIParamDestructor<nargs> paramDestructor(jniEnv);
+        return JNICaller<T,decltype(CPPToJNIConversor<typename std::decay<Args>::type>::convert(v))...>::callStatic(jniEnv, methodInfo.classId, methodInfo.methodId, JNIParamConversor<typename std::decay<Args>::type>(v, paramDestructor)...);
+    }
+    
+    template<typename T = void, typename... Args> T call(jobject instance, const JNIMethodInfo & methodInfo, Args&&... v)
     {
         static constexpr uint8_t nargs = sizeof...(Args);
-        JNIObject * result = new JNIObject();
+        SAFEJNI_STATS_START
         JNIEnv* jniEnv = Utils::getJNIEnvAttach();
-        SPJNIMethodInfo methodInfo = Utils::getMethodInfo(className, "<init>", getJNISignature<void,Args...>(v...));
+        SAFEJNI_STATS_SCOPE(methodInfo)
         JNIParamDestructor<nargs> paramDestructor(jniEnv);
-        result->instance = jniEnv->NewObject(methodInfo->classId, methodInfo->methodId, JNIParamConversor<Args>(v, paramDestructor)...);
-        result->jniClassName = className;
-        result->makeGlobalRef();
-        return std::shared_ptr<JNIObject>(result);
+        return JNICaller<T,decltype(CPPToJNIConversor<typename std::decay<Args>::type>::convert(v))...>::callInstance(jniEnv, instance, methodInfo.methodId, JNIParamConversor<typename std::decay<Args>::type>(v, paramDestructor)...);
+    }
+    
+    template<typename T> T getField(jobject instance, const JNIFieldInfo & fieldInfo)
+    {
+        SAFEJNI_STATS_START
+        SAFEJNI_STATS_SCOPE(fieldInfo)
+        return JNICaller<T>::getField(Utils::getJNIEnvAttach(), instance, fieldInfo.fieldId);
+    }
+    
+    template<typename T> void setField(jobject instance, const JNIFieldInfo & fieldInfo, const T & value)
+    {
+        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+        JNIParamDestructor<1> paramDestructor(jniEnv);
+        JNICaller<T>::setField(jniEnv, instance, fieldInfo.fieldId, JNIParamConversor<T>(value, paramDestructor));
     }
     
-    template<typename T,typename... Args> inline T JNIObject::call(const std::string & methodName, Args... v)
+    template<typename T> T getStaticField(const JNIFieldInfo & fieldInfo)
     {
-        return safejni::call<T, Args...>(instance, jniClassName, methodName, v...);
+        SAFEJNI_STATS_START
+        SAFEJNI_STATS_SCOPE(fieldInfo)
+        return JNICaller<T>::getStaticField(Utils::getJNIEnvAttach(), fieldInfo.classId, fieldInfo.fieldId);
     }
+    
+    template<typename T> void setStaticField(const JNIFieldInfo & fieldInfo, const T & value)
+    {
+        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+        JNIParamDestructor<1> paramDestructor(jniEnv);
+        JNICaller<T>::setStaticField(jniEnv, fieldInfo.classId, fieldInfo.fieldId, JNIParamConversor<T>(value, paramDestructor));
+    }
+    
+    //Runs fn(i) for every i in [0, count) inside local frames of callsPerFrame calls. Local ref usage stays bounded by
+    //callsPerFrame * refsPerCall no matter how many calls are made, and the calls skip their individual DeleteLocalRef traffic.
+    //  safejni::batch(names.size(), [&](size_t i) { log(names[i]); });
+    //Java exceptions are DEFERRED inside each frame: the first one is reported through the enclosing policy once the frame
+    //is closed, and the remaining calls of that frame still run.
+    template<typename F> void batch(size_t count, F fn, size_t callsPerFrame = 64, jint refsPerCall = 4)
+    {
+        callsPerFrame = std::max<size_t>(callsPerFrame, 1);
+        const size_t capacity = std::min<size_t>(callsPerFrame * static_cast<size_t>(std::max<jint>(refsPerCall, 1)), INT_MAX);
+        for (size_t start = 0; start < count; start += callsPerFrame) {
+            {
+                ExceptionScope deferred(ExceptionPolicy::DEFERRED);
+                LocalFrame frame(static_cast<jint>(capacity));
+                const size_t end = std::min(count, start + callsPerFrame);
+                for (size_t i = start; i < end; ++i) {
+                    fn(i);
+                }
+            }
+            if (Utils::hasPendingException()) {
+                Utils::reportPendingException();
+                return;
+            }
+        }
+    }
+    
+    //Frame-bounded alternative to Utils::toVectorJObject: calls fn(i, element) for every element of the array through
+    //batch, so at most elementsPerFrame elements are alive at once. element is released when its frame is closed.
+    //  safejni::forEachElement(views, [&](size_t i, jobject view) { ids[i] = getId(view); });
+    template<typename F> void forEachElement(jobjectArray array, F fn, size_t elementsPerFrame = 64, jint refsPerCall = 4)
+    {
+        JNIEnv * jniEnv = Utils::getJNIEnvAttach();
+        const size_t length = array ? static_cast<size_t>(jniEnv->GetArrayLength(array)) : 0;
+        batch(length, [&](size_t i) { fn(i, jniEnv->GetObjectArrayElement(array, static_cast<jsize>(i))); }, elementsPerFrame, refsPerCall < INT_MAX ? refsPerCall + 1 : refsPerCall);
+    }
+    
+    // JNIObject templates
+    template<typename... Args> std::shared_ptr<JNIObject> JNIObject::create(const std::string & className, Args&&... v)
+    {
+        SAFEJNI_STATS_START
+        const JNIClassInfo & classInfo = Utils::findClassInfo(className.c_str());
+        const JNIMethodInfo & constructor = Utils::findMethod(className.c_str(), "<init>", getJNITypeSignature<void, typename std::decay<Args>::type...>());
+        SAFEJNI_STATS_SCOPE(constructor)
+        return construct(classInfo, constructor, std::forward<Args>(v)...);
+    }
+    
+    template<typename... Args> std::shared_ptr<JNIObject> JNIObject::construct(const JNIClassInfo & classInfo, const JNIMethodInfo & constructor, Args&&... v)
+    {
+        static constexpr uint8_t nargs = sizeof...(Args);
+        JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+        JNIParamDestructor<nargs> paramDestructor(jniEnv);
+        jobject localRef = jniEnv->NewObject(classInfo.classId, constructor.methodId, JNIParamConversor<typename std::decay<Args>::type>(v, paramDestructor)...);
+        if (!localRef) {
+            JNI_EXCEPTION_CHECK
+            return nullptr;
+        }
+        std::shared_ptr<JNIObject> result = create(localRef, classInfo);
+        jniEnv->DeleteLocalRef(localRef);
+        return result;
+    }
+    
+    template<typename T,typename... Args> inline T JNIObject::call(const std::string & methodName, Args&&... v)
+    {
+        if (refType == WEAK) {
+            LocalRef strong = lock();
+            if (!strong) {
+                SAFEJNI_THROW(JNIException("The Java object of a weak JNIObject has been collected."));
+            }
+            return safejni::call<T>(strong.get(), className(), methodName, std::forward<Args>(v)...);
+        }
+        return safejni::call<T>(instance, className(), methodName, std::forward<Args>(v)...);
+    }
+    
+    // JavaObject templates
+    template <typename ClassTag> template <typename... Args>
+    JavaObject<ClassTag> JavaObject<ClassTag>::create(Args&&... v)
+    {
+        SAFEJNI_STATS_START
+        const JNIMethodInfo & constructor = Utils::findMethod(className(), "<init>", getJNITypeSignature<void, typename std::decay<Args>::type...>());
+        SAFEJNI_STATS_SCOPE(constructor)
+        return JavaObject(JNIObject::construct(classInfo(), constructor, std::forward<Args>(v)...));
+    }
+    
+    template <typename ClassTag> template <typename T, typename... Args>
+    T JavaObject<ClassTag>::call(const std::string & methodName, Args&&... v) const
+    {
+        auto invoke = [&](jobject instance) { return safejni::call<T>(instance, className(), methodName, std::forward<Args>(v)...); };
+        return object ? object->withInstance(invoke) : invoke(nullptr);
+    }
+    
+#pragma mark Prebound Method Handles
+    
+    //Static method handle: the class and method are resolved once on first use,
+    //then every call goes straight to JNICaller without any name or signature work.
+    //  StaticMethod<std::string(std::string, std::string)> concat("com/safejni/test/TestActivity", "concat");
+    //  std::string result = concat("Hello ", "World!");
+    template <typename Signature> class StaticMethod;
+    
+    template <typename T, typename... Args>
+    class StaticMethod<T(Args...)> {
+    public:
+        StaticMethod(const std::string & className, const std::string & methodName): className(className), methodName(methodName), methodInfo(nullptr) {}
+        StaticMethod(const StaticMethod & other): className(other.className), methodName(other.methodName), methodInfo(other.methodInfo.load()) {}
+        
+        T operator()(const Args &... v) const
+        {
+            static constexpr uint8_t nargs = sizeof...(Args);
+            SAFEJNI_STATS_START
+            JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+            const JNIMethodInfo & info = resolve();
+            SAFEJNI_STATS_SCOPE(info)
+            JNIParamDestructor<nargs> paramDestructor(jniEnv);
+            return JNICaller<T,decltype(CPPToJNIConversor<typename std::decay<Args>::type>::convert(v))...>::callStatic(jniEnv, info.classId, info.methodId, JNIParamConversor<typename std::decay<Args>::type>(v, paramDestructor)...);
+        }
+        
+        const JNIMethodInfo & resolve() const
+        {
+            const JNIMethodInfo * info = methodInfo.load(std::memory_order_acquire);
+            if (!info) {
+                info = &Utils::findStaticMethod(className.c_str(), methodName.c_str(), getJNITypeSignature<T, typename std::decay<Args>::type...>());
+                methodInfo.store(info, std::memory_order_release);
+            }
+            return *info;
+        }
+        
+    private:
+        std::string className;
+        std::string methodName;
+        mutable std::atomic<const JNIMethodInfo*> methodInfo;
+    };
+    
+    //Instance method handle, resolved once on first use like StaticMethod
+    //  Method<std::string()> getName("com/safejni/test/Ninja", "getName");
+    //  std::string name = getName(ninja->instance);
+    template <typename Signature> class Method;
+    
+    template <typename T, typename... Args>
+    class Method<T(Args...)> {
+    public:
+        Method(const std::string & className, const std::string & methodName): className(className), methodName(methodName), methodInfo(nullptr) {}
+        Method(const Method & other): className(other.className), methodName(other.methodName), methodInfo(other.methodInfo.load()) {}
+        
+        T operator()(jobject instance, const Args &... v) const
+        {
+            static constexpr uint8_t nargs = sizeof...(Args);
+            SAFEJNI_STATS_START
+            JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+            const JNIMethodInfo & info = resolve();
+            SAFEJNI_STATS_SCOPE(info)
+            JNIParamDestructor<nargs> paramDestructor(jniEnv);
+            return JNICaller<T,decltype(CPPToJNIConversor<typename std::decay<Args>::type>::convert(v))...>::callInstance(jniEnv, instance, info.methodId, JNIParamConversor<typename std::decay<Args>::type>(v, paramDestructor)...);
+        }
+        
+        inline T operator()(const JNIObjectPtr & object, const Args &... v) const
+        {
+            return object->withInstance([&](jobject instance) { return (*this)(instance, v...); });
+        }
+        
+        const JNIMethodInfo & resolve() const
+        {
+            const JNIMethodInfo * info = methodInfo.load(std::memory_order_acquire);
+            if (!info) {
+                info = &Utils::findMethod(className.c_str(), methodName.c_str(), getJNITypeSignature<T, typename std::decay<Args>::type...>());
+                methodInfo.store(info, std::memory_order_release);
+            }
+            return *info;
+        }
+        
+    private:
+        std::string className;
+        std::string methodName;
+        mutable std::atomic<const JNIMethodInfo*> methodInfo;
+    };
+    
+    //Constructor handle: the class and constructor are resolved once, every object then costs a single NewObject
+    //  Constructor<std::string> newNinja("com/safejni/test/Ninja");
+    //  JNIObjectPtr ninja = newNinja("Snake");
+    template <typename... Args>
+    class Constructor {
+    public:
+        Constructor(const std::string & className): className(className), classInfo(nullptr), constructor(nullptr) {}
+        Constructor(const Constructor & other): className(other.className), classInfo(other.classInfo.load()), constructor(other.constructor.load()) {}
+        
+        inline JNIObjectPtr operator()(const typename std::decay<Args>::type &... v) const
+        {
+            SAFEJNI_STATS_START
+            const JNIMethodInfo * info = constructor.load(std::memory_order_acquire);
+            if (!info) {
+                classInfo.store(&Utils::findClassInfo(className.c_str()), std::memory_order_relaxed);
+                info = &Utils::findMethod(className.c_str(), "<init>", getJNITypeSignature<void, typename std::decay<Args>::type...>());
+                constructor.store(info, std::memory_order_release);
+            }
+            SAFEJNI_STATS_SCOPE(*info)
+            return JNIObject::construct(*classInfo.load(std::memory_order_relaxed), *info, v...);
+        }
+        
+    private:
+        std::string className;
+        mutable std::atomic<const JNIClassInfo*> classInfo;
+        mutable std::atomic<const JNIMethodInfo*> constructor;
+    };
+    
+#pragma mark Prebound Field Handles
+    
+    //Instance field handle: the field ID is resolved once on first use, then get/set are a single Get/Set<Type>Field call
+    //  Field<std::string> name("com/safejni/test/Ninja", "name");
+    //  name.set(ninja, "Snake");
+    template <typename T>
+    class Field {
+    public:
+        Field(const std::string & className, const std::string & fieldName): className(className), fieldName(fieldName), fieldInfo(nullptr) {}
+        Field(const Field & other): className(other.className), fieldName(other.fieldName), fieldInfo(other.fieldInfo.load()) {}
+        
+        T get(jobject instance) const
+        {
+            SAFEJNI_STATS_START
+            const JNIFieldInfo & info = resolve();
+            SAFEJNI_STATS_SCOPE(info)
+            return JNICaller<T>::getField(Utils::getJNIEnvAttach(), instance, info.fieldId);
+        }
+        
+        void set(jobject instance, const T & value) const
+        {
+            JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+            const JNIFieldInfo & info = resolve();
+            JNIParamDestructor<1> paramDestructor(jniEnv);
+            JNICaller<T>::setField(jniEnv, instance, info.fieldId, JNIParamConversor<T>(value, paramDestructor));
+        }
+        
+        inline T get(const JNIObjectPtr & object) const { return object->withInstance([this](jobject instance) { return get(instance); }); }
+        inline void set(const JNIObjectPtr & object, const T & value) const { object->withInstance([&](jobject instance) { set(instance, value); }); }
+        
+        const JNIFieldInfo & resolve() const
+        {
+            const JNIFieldInfo * info = fieldInfo.load(std::memory_order_acquire);
+            if (!info) {
+                info = &Utils::findField(className.c_str(), fieldName.c_str(), getJNIFieldSignature<T>());
+                fieldInfo.store(info, std::memory_order_release);
+            }
+            return *info;
+        }
+        
+    private:
+        std::string className;
+        std::string fieldName;
+        mutable std::atomic<const JNIFieldInfo*> fieldInfo;
+    };
+    
+    //Static field handle, resolved once on first use like Field
+    template <typename T>
+    class StaticField {
+    public:
+        StaticField(const std::string & className, const std::string & fieldName): className(className), fieldName(fieldName), fieldInfo(nullptr) {}
+        StaticField(const StaticField & other): className(other.className), fieldName(other.fieldName), fieldInfo(other.fieldInfo.load()) {}
+        
+        T get() const
+        {
+            SAFEJNI_STATS_START
+            const JNIFieldInfo & info = resolve();
+            SAFEJNI_STATS_SCOPE(info)
+            return JNICaller<T>::getStaticField(Utils::getJNIEnvAttach(), info.classId, info.fieldId);
+        }
+        
+        void set(const T & value) const
+        {
+            JNIEnv* jniEnv = Utils::getJNIEnvAttach();
+            const JNIFieldInfo & info = resolve();
+            JNIParamDestructor<1> paramDestructor(jniEnv);
+            JNICaller<T>::setStaticField(jniEnv, info.classId, info.fieldId, JNIParamConversor<T>(value, paramDestructor));
+        }
+        
+        const JNIFieldInfo & resolve() const
+        {
+            const JNIFieldInfo * info = fieldInfo.load(std::memory_order_acquire);
+            if (!info) {
+                info = &Utils::findStaticField(className.c_str(), fieldName.c_str(), getJNIFieldSignature<T>());
+                fieldInfo.store(info, std::memory_order_release);
+            }
+            return *info;
+        }
+        
+    private:
+        std::string className;
+        std::string fieldName;
+        mutable std::atomic<const JNIFieldInfo*> fieldInfo;
+    };
+    
+#pragma mark Native Method Registration
+    
+    //Receiver of a native method: the jobject of instance methods or the jclass of static ones. When it is the first
+    //parameter of a registered C++ function it is filled in and left out of the Java signature.
+    struct JNIThis {
+        jobject instance;
+        inline operator jobject() const { return instance;}
+    };
+    
+    template<typename T>
+    inline typename std::enable_if<std::is_pointer<T>::value, T>::type fromJNIValue(jlong value) { return reinterpret_cast<T>(value);}
+    template<typename T, typename J>
+    inline typename std::enable_if<!std::is_pointer<T>::value, T>::type fromJNIValue(J value) { return static_cast<T>(value);}
+    
+    //How a C++ parameter or return value crosses a native method boundary: primitives and native pointers (as jlong) by value,
+    //everything else as a jobject converted by the JNIToCPPConversor/CPPToJNIConversor templates
+    template<typename T, typename J = decltype(CPPToJNIConversor<T>::convert(std::declval<T>())), bool PRIMITIVE = std::is_arithmetic<J>::value>
+    struct JNINativeType {
+        using Type = jobject;
+        inline static T fromJava(jobject obj) { return JNIToCPPConversor<T>::convert(obj);}
+        inline static jobject toJava(const T & value) { return CPPToJNIConversor<T>::convert(value);}
+    };
+    
+    template<typename T, typename J>
+    struct JNINativeType<T, J, true> {
+        using Type = J;
+        inline static T fromJava(J value) { return fromJNIValue<T>(value);}
+        inline static J toJava(T value) { return CPPToJNIConversor<T>::convert(value);}
+    };
+    
+    template<>
+    struct JNINativeType<JNIThis> {
+        using Type = jobject;
+        inline static JNIThis fromJava(jobject obj) { return JNIThis{obj};}
+    };
+    
+    //Calls the C++ function with converted arguments. C++ exceptions never cross into the VM: they become Java exceptions
+    //(the Java throwable itself for JNIException, java.lang.RuntimeException otherwise) and a zero value is returned.
+    template<typename R, typename... Args>
+    struct JNINativeCall {
+        using Type = typename JNINativeType<R>::Type;
+        template<typename... J>
+        static Type call(JNIEnv * env, R (*function)(Args...), J... args) {
+#if SAFEJNI_EXCEPTIONS
+            try {
+                return JNINativeType<R>::toJava(function(JNINativeType<typename std::decay<Args>::type>::fromJava(args)...));
+            }
+            catch (...) {
+                Utils::rethrowToJava(env);
+            }
+            return Type();
+#else
+            return JNINativeType<R>::toJava(function(JNINativeType<typename std::decay<Args>::type>::fromJava(args)...));
+#endif
+        }
+    };
+    
+    template<typename... Args>
+    struct JNINativeCall<void, Args...> {
+        using Type = void;
+        template<typename... J>
+        static void call(JNIEnv * env, void (*function)(Args...), J... args) {
+#if SAFEJNI_EXCEPTIONS
+            try {
+                function(JNINativeType<typename std::decay<Args>::type>::fromJava(args)...);
+            }
+            catch (...) {
+                Utils::rethrowToJava(env);
+            }
+#else
+            function(JNINativeType<typename std::decay<Args>::type>::fromJava(args)...);
+#endif
+        }
+    };
+    
+    //Trampoline registered with the VM. Source::function() returns the C++ function to call
+    template<typename Source, typename R, typename... Args>
+    struct JNINativeTrampoline {
+        static typename JNINativeCall<R, Args...>::Type invoke(JNIEnv * env, jobject, typename JNINativeType<typename std::decay<Args>::type>::Type... args) {
+            return JNINativeCall<R, Args...>::call(env, Source::function(), args...);
+        }
+        static const char * signature() {
+            return getJNITypeSignature<R, typename std::decay<Args>::type...>();
+        }
+    };
+    
+    template<typename Source, typename R, typename... Args>
+    struct JNINativeTrampoline<Source, R, JNIThis, Args...> {
+        static typename JNINativeCall<R, JNIThis, Args...>::Type invoke(JNIEnv * env, jobject receiver, typename JNINativeType<typename std::decay<Args>::type>::Type... args) {
+            return JNINativeCall<R, JNIThis, Args...>::call(env, Source::function(), receiver, args...);
+        }
+        static const char * signature() {
+            return getJNITypeSignature<R, typename std::decay<Args>::type...>();
+        }
+    };
+    
+    template<typename Source, typename F> struct JNINativeBinding;
+    
+    template<typename Source, typename R, typename... Args>
+    struct JNINativeBinding<Source, R (*)(Args...)>: JNINativeTrampoline<Source, R, Args...> {};
+    
+    //free functions and static member functions are called directly from the trampoline
+    template<typename F, F FUNCTION>
+    struct JNIFunctionSource {
+        inline static F function() { return FUNCTION;}
+    };
+    
+    //captureless lambdas are stored as a function pointer, one slot per lambda type
+    template<typename M> struct JNILambdaTraits;
+    
+    template<typename C, typename R, typename... Args>
+    struct JNILambdaTraits<R (C::*)(Args...) const> {
+        using Function = R (*)(Args...);
+    };
+    
+    template<typename L>
+    struct JNILambdaSource {
+        using Function = typename JNILambdaTraits<decltype(&L::operator())>::Function;
+        static Function slot;
+        inline static Function function() { return slot;}
+    };
+    
+    template<typename L>
+    typename JNILambdaSource<L>::Function JNILambdaSource<L>::slot = nullptr;
+    
+    inline JNINativeMethod makeNativeMethod(const char * name, const char * signature, void * function)
+    {
+        JNINativeMethod method;
+        method.name = const_cast<char*>(name);
+        method.signature = const_cast<char*>(signature);
+        method.fnPtr = function;
+        return method;
+    }
+    
+    //Native method backed by a C++ function, see SAFEJNI_NATIVE. The trampoline takes the usual JNIEnv and receiver, so it is
+    //also valid for @FastNative methods.
+    template<typename F, F FUNCTION>
+    JNINativeMethod nativeMethod(const char * name)
+    {
+        using Binding = JNINativeBinding<JNIFunctionSource<F, FUNCTION>, F>;
+        return makeNativeMethod(name, Binding::signature(), reinterpret_cast<void*>(&Binding::invoke));
+    }
+    
+    //Native method backed by a captureless lambda
+    //  safejni::nativeMethod("add", [](int32_t a, int32_t b) { return a + b; })
+    template<typename L>
+    JNINativeMethod nativeMethod(const char * name, L lambda)
+    {
+        using Source = JNILambdaSource<L>;
+        static_assert(std::is_convertible<L, typename Source::Function>::value, "Only captureless lambdas can be registered as native methods");
+        Source::slot = lambda;
+        using Binding = JNINativeBinding<Source, typename Source::Function>;
+        return makeNativeMethod(name, Binding::signature(), reinterpret_cast<void*>(&Binding::invoke));
+    }
+    
+    template<typename T>
+    struct JNICriticalType {
+        static constexpr bool value = std::is_arithmetic<T>::value;
+    };
+    
+    template<>
+    struct JNICriticalType<void> {
+        static constexpr bool value = true;
+    };
+    
+    template<typename... T> struct JNICriticalTypes;
+    
+    template<>
+    struct JNICriticalTypes<> {
+        static constexpr bool value = true;
+    };
+    
+    template<typename T, typename... Rest>
+    struct JNICriticalTypes<T, Rest...> {
+        static constexpr bool value = JNICriticalType<T>::value && JNICriticalTypes<Rest...>::value;
+    };
+    
+    template<typename F> struct JNICriticalFunction;
+    
+    template<typename R, typename... Args>
+    struct JNICriticalFunction<R (*)(Args...)> {
+        static constexpr bool value = JNICriticalTypes<R, Args...>::value;
+        static const char * signature() { return getJNITypeSignature<R, Args...>();}
+    };
+    
+    //Native method for a static Java method annotated with @CriticalNative (Android 8+). The C++ function only takes and returns
+    //primitives, so it already has the critical native ABI and is registered as is: no JNIEnv, no receiver, no trampoline.
+    //It must not be used for methods without the annotation.
+    template<typename F, F FUNCTION>
+    JNINativeMethod criticalNativeMethod(const char * name)
+    {
+        static_assert(JNICriticalFunction<F>::value, "@CriticalNative methods only take and return primitive types");
+        return makeNativeMethod(name, JNICriticalFunction<F>::signature(), reinterpret_cast<void*>(FUNCTION));
+    }
+    
+#define SAFEJNI_NATIVE(name, function) safejni::nativeMethod<decltype(&function), &function>(name)
+#define SAFEJNI_CRITICAL_NATIVE(name, function) safejni::criticalNativeMethod<decltype(&function), &function>(name)
+    
+    //Registers the methods on the class now
+    void registerNatives(const char * className, const std::vector<JNINativeMethod> & methods);
+    
+    //Queues the methods for registration when SafeJNI is initialized from JNI_OnLoad (or registers them right away when it
+    //already is), so native methods can be declared next to their implementation:
+    //  static safejni::NativeRegistrar registrar("com/example/Math", {
+    //      SAFEJNI_NATIVE("add", add),
+    //      safejni::nativeMethod("negate", [](int32_t value) { return -value; })
+    //  });
+    class NativeRegistrar {
+    public:
+        NativeRegistrar(const char * className, std::initializer_list<JNINativeMethod> methods);
+    };
+    
+#pragma mark Native Callbacks
+    
+    //Boxed values crossing a com.safejni.NativeCallback invocation: primitives as java.lang wrappers, objects through the conversors
+    template<typename T>
+    struct JNIBoxing {
+        inline static T fromJava(jobject obj) { return JNIToCPPConversor<T>::convert(obj);}
+        inline static jobject toJava(const T & value) { return CPPToJNIConversor<T>::convert(value);}
+    };
+    
+    template<typename T>
+    struct JNIBoxTraits;
+    
+    template<> struct JNIBoxTraits<bool> {
+        static const char * className() { return "java/lang/Boolean";}
+        static const char * valueOf() { return "(Z)Ljava/lang/Boolean;";}
+        static const char * unbox() { return "booleanValue";}
+    };
+    template<> struct JNIBoxTraits<int8_t> {
+        static const char * className() { return "java/lang/Byte";}
+        static const char * valueOf() { return "(B)Ljava/lang/Byte;";}
+        static const char * unbox() { return "byteValue";}
+    };
+    template<> struct JNIBoxTraits<int16_t> {
+        static const char * className() { return "java/lang/Short";}
+        static const char * valueOf() { return "(S)Ljava/lang/Short;";}
+        static const char * unbox() { return "shortValue";}
+    };
+    template<> struct JNIBoxTraits<int32_t> {
+        static const char * className() { return "java/lang/Integer";}
+        static const char * valueOf() { return "(I)Ljava/lang/Integer;";}
+        static const char * unbox() { return "intValue";}
+    };
+    template<> struct JNIBoxTraits<int64_t> {
+        static const char * className() { return "java/lang/Long";}
+        static const char * valueOf() { return "(J)Ljava/lang/Long;";}
+        static const char * unbox() { return "longValue";}
+    };
+    template<> struct JNIBoxTraits<float> {
+        static const char * className() { return "java/lang/Float";}
+        static const char * valueOf() { return "(F)Ljava/lang/Float;";}
+        static const char * unbox() { return "floatValue";}
+    };
+    template<> struct JNIBoxTraits<double> {
+        static const char * className() { return "java/lang/Double";}
+        static const char * valueOf() { return "(D)Ljava/lang/Double;";}
+        static const char * unbox() { return "doubleValue";}
+    };
+    
+    template<typename T>
+    struct JNIPrimitiveBoxing {
+        inline static T fromJava(jobject obj) {
+            if (!obj) {
+                return T();
+            }
+            const JNIMethodInfo & unbox = Utils::findMethod(JNIBoxTraits<T>::className(), JNIBoxTraits<T>::unbox(), getJNITypeSignature<T>());
+            return JNICaller<T>::callInstance(Utils::getJNIEnvAttach(), obj, unbox.methodId);
+        }
+        inline static jobject toJava(T value) {
+            const JNIMethodInfo & valueOf = Utils::findStaticMethod(JNIBoxTraits<T>::className(), "valueOf", JNIBoxTraits<T>::valueOf());
+            return Utils::getJNIEnvAttach()->CallStaticObjectMethod(valueOf.classId, valueOf.methodId, CPPToJNIConversor<T>::convert(value));
+        }
+    };
+    
+    template<> struct JNIBoxing<bool>: JNIPrimitiveBoxing<bool> {};
+    template<> struct JNIBoxing<int8_t>: JNIPrimitiveBoxing<int8_t> {};
+    template<> struct JNIBoxing<int16_t>: JNIPrimitiveBoxing<int16_t> {};
+    template<> struct JNIBoxing<int32_t>: JNIPrimitiveBoxing<int32_t> {};
+    template<> struct JNIBoxing<int64_t>: JNIPrimitiveBoxing<int64_t> {};
+    template<> struct JNIBoxing<float>: JNIPrimitiveBoxing<float> {};
+    template<> struct JNIBoxing<double>: JNIPrimitiveBoxing<double> {};
+    
+    template<size_t... I> struct JNIIndexSequence {};
+    template<size_t N, size_t... I> struct JNIMakeIndexSequence: JNIMakeIndexSequence<N - 1, N - 1, I...> {};
+    template<size_t... I> struct JNIMakeIndexSequence<0, I...> {
+        using Type = JNIIndexSequence<I...>;
+    };
+    
+    //Type erased entry point stored in the callback table: takes the Object[] of the Java call and returns the boxed result
+    typedef std::function<jobject(JNIEnv *, jobjectArray)> NativeCallbackInvoker;
+    
+    template<typename R, typename... Args>
+    struct JNICallbackInvoker {
+        std::function<R(Args...)> function;
+        jobject operator()(JNIEnv * env, jobjectArray args) const {
+            return invoke(env, args, typename JNIMakeIndexSequence<sizeof...(Args)>::Type());
+        }
+        template<size_t... I>
+        jobject invoke(JNIEnv * env, jobjectArray args, JNIIndexSequence<I...>) const {
+            return JNIBoxing<R>::toJava(function(JNIBoxing<typename std::decay<Args>::type>::fromJava(env->GetObjectArrayElement(args, I))...));
+        }
+    };
+    
+    template<typename... Args>
+    struct JNICallbackInvoker<void, Args...> {
+        std::function<void(Args...)> function;
+        jobject operator()(JNIEnv * env, jobjectArray args) const {
+            invoke(env, args, typename JNIMakeIndexSequence<sizeof...(Args)>::Type());
+            return nullptr;
+        }
+        template<size_t... I>
+        void invoke(JNIEnv * env, jobjectArray args, JNIIndexSequence<I...>) const {
+            function(JNIBoxing<typename std::decay<Args>::type>::fromJava(env->GetObjectArrayElement(args, I))...);
+        }
+    };
+    
+    //Creates a com.safejni.NativeCallback (a Runnable) backed by the invoker. The invoker is kept in a native handle table
+    //until the Java object is closed or finalized. Returns a local ref.
+    jobject createNativeCallback(NativeCallbackInvoker invoker);
+    //Wraps a NativeCallback in a java.lang.reflect.Proxy implementing the given interface (every method calls the callback)
+    jobject createNativeProxy(const char * interfaceName, jobject callback);
+    
+    //Java Runnable that runs the function on the thread calling run()
+    inline jobject toRunnable(std::function<void()> function)
+    {
+        return createNativeCallback(JNICallbackInvoker<void>{std::move(function)});
+    }
+    
+    //Java object implementing a single method interface, the arguments and the result are boxed
+    //  jobject listener = safejni::toJavaInterface("android/view/View$OnClickListener", std::function<void(jobject)>(...));
+    template<typename R, typename... Args>
+    jobject toJavaInterface(const char * interfaceName, std::function<R(Args...)> function)
+    {
+        jobject callback = createNativeCallback(JNICallbackInvoker<R, Args...>{std::move(function)});
+        jobject proxy = createNativeProxy(interfaceName, callback);
+        Utils::getJNIEnvAttach()->DeleteLocalRef(callback);
+        return proxy;
+    }
+    
+    //std::function<void()> parameters are passed to Java as a Runnable
+    template<>
+    struct CPPToJNIConversor<std::function<void()>> {
+        using JNIType = CompileTimeString<'L','j','a','v','a','/','l','a','n','g','/','R','u','n','n','a','b','l','e',';'>;
+        inline static jobject convert(const std::function<void()> & function) { return toRunnable(function);}
+    };
+    
+#pragma mark Async Calls
+    
+    //std::result_of is removed in C++20
+    template<typename F>
+    struct JNITaskResult {
+        typedef decltype(std::declval<F&>()()) Type;
+    };
+    
+    //Runs Java calls on a small pool of threads attached to the VM once. The workers never return to Java, so tasks must
+    //release the raw local refs they create (the SafeJNI calls release theirs) or open their own LocalFrame.
+    //The queue is bounded: post and submit block while it is full, tryPost fails instead.
+    class JNIExecutor {
+    public:
+        explicit JNIExecutor(size_t numThreads = 2, size_t queueCapacity = 256);
+        //runs the queued tasks and joins the workers
+        ~JNIExecutor();
+        JNIExecutor(const JNIExecutor &) = delete;
+        JNIExecutor & operator=(const JNIExecutor &) = delete;
+        
+        //executor used by callStaticAsync, callAsync and postStatic
+        static JNIExecutor & shared();
+        
+        //fire-and-forget, exceptions thrown by the task are logged
+        void post(std::function<void()> task);
+        bool tryPost(std::function<void()> task);
+        
+        template<typename F>
+        std::future<typename JNITaskResult<F>::Type> submit(F task)
+        {
+            typedef typename JNITaskResult<F>::Type R;
+            std::shared_ptr<std::packaged_task<R()>> packaged = std::make_shared<std::packaged_task<R()>>(std::move(task));
+            std::future<R> result = packaged->get_future();
+            post([packaged]() { (*packaged)(); });
+            return result;
+        }
+        
+        //calls completion with the result of the task on the worker thread
+        template<typename F, typename C>
+        void submit(F task, C completion);
+        
+    private:
+        void run();
+        
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> queue;
+        std::mutex queueMutex;
+        std::condition_variable notEmpty;
+        std::condition_variable notFull;
+        size_t capacity;
+        bool stopping;
+    };
+    
+    template<typename R, typename F, typename C>
+    struct JNICompletionTask {
+        F task;
+        C completion;
+        void operator()() { completion(task()); }
+    };
+    
+    template<typename F, typename C>
+    struct JNICompletionTask<void, F, C> {
+        F task;
+        C completion;
+        void operator()() { task(); completion(); }
+    };
+    
+    template<typename F, typename C>
+    void JNIExecutor::submit(F task, C completion)
+    {
+        post(JNICompletionTask<typename JNITaskResult<F>::Type, F, C>{std::move(task), std::move(completion)});
+    }
+    
+    std::shared_ptr<_jobject> makeSharedGlobalRef(jobject obj);
+    
+    //How an async call keeps an argument until a worker runs it: local refs are confined to the calling thread and
+    //C strings may be freed by the caller, so they are promoted to global refs and copied into std::string
+    template<typename T, typename Enable = void>
+    struct JNIAsyncArg {
+        typedef T Type;
+        static inline T store(T && value) { return std::move(value);}
+        static inline const T & load(const T & value) { return value;}
+    };
+    
+    template<typename T>
+    struct JNIAsyncArg<T*, typename std::enable_if<std::is_base_of<_jobject, T>::value>::type> {
+        typedef std::shared_ptr<_jobject> Type;
+        static inline Type store(T * value) { return makeSharedGlobalRef(value);}
+        static inline T * load(const Type & value) { return static_cast<T*>(value.get());}
+    };
+    
+    //null strings are sent as empty strings
+    template<>
+    struct JNIAsyncArg<const char *> {
+        typedef std::string Type;
+        static inline std::string store(const char * value) { return value ? value : "";}
+        static inline const std::string & load(const std::string & value) { return value;}
+    };
+    
+    template<>
+    struct JNIAsyncArg<char *>: JNIAsyncArg<const char *> {};
+    
+    //local refs returned on a worker thread can't be used by the thread that waits for the result
+    template<typename T>
+    struct JNILocalResult {
+        static constexpr bool value = std::is_pointer<T>::value && std::is_base_of<_jobject, typename std::remove_pointer<T>::type>::value;
+    };
+    
+    template<typename T, ArrayAccess ACCESS>
+    struct JNILocalResult<JNIArrayView<T, ACCESS>> {
+        static constexpr bool value = true;
+    };
+    
+    //The arguments are stored (see JNIAsyncArg) and converted to JNI on the worker thread
+    template<typename T, typename... Args>
+    struct JNIAsyncStaticCall {
+        static_assert(!JNIViewParams<Args...>::value, "Async calls outlive the caller: pass owning types instead of views");
+        static_assert(!JNILocalResult<T>::value, "Async results can't be local refs: return a JNIObjectPtr or a C++ type");
+        std::string className;
+        std::string methodName;
+        std::tuple<typename JNIAsyncArg<Args>::Type...> args;
+        
+        T operator()() { return apply(typename JNIMakeIndexSequence<sizeof...(Args)>::Type()); }
+        template<size_t... I>
+        T apply(JNIIndexSequence<I...>) { return callStatic<T>(className, methodName, JNIAsyncArg<Args>::load(std::get<I>(args))...); }
+    };
+    
+    //the instance is kept alive by a global ref until the call has run
+    template<typename T, typename... Args>
+    struct JNIAsyncCall {
+        static_assert(!JNIViewParams<Args...>::value, "Async calls outlive the caller: pass owning types instead of views");
+        static_assert(!JNILocalResult<T>::value, "Async results can't be local refs: return a JNIObjectPtr or a C++ type");
+        std::shared_ptr<_jobject> instance;
+        std::string className;
+        std::string methodName;
+        std::tuple<typename JNIAsyncArg<Args>::Type...> args;
+        
+        T operator()() { return apply(typename JNIMakeIndexSequence<sizeof...(Args)>::Type()); }
+        template<size_t... I>
+        T apply(JNIIndexSequence<I...>) { return call<T>(instance.get(), className, methodName, JNIAsyncArg<Args>::load(std::get<I>(args))...); }
+    };
+    
+    template<typename T = void, typename... Args>
+    std::future<T> callStaticAsync(const std::string & className, const std::string & methodName, Args... v)
+    {
+        return JNIExecutor::shared().submit(JNIAsyncStaticCall<T, Args...>{className, methodName,
+            std::tuple<typename JNIAsyncArg<Args>::Type...>(JNIAsyncArg<Args>::store(std::move(v))...)});
+    }
+    
+    template<typename T = void, typename... Args>
+    std::future<T> callAsync(jobject instance, const std::string & className, const std::string & methodName, Args... v)
+    {
+        return JNIExecutor::shared().submit(JNIAsyncCall<T, Args...>{makeSharedGlobalRef(instance), className, methodName,
+            std::tuple<typename JNIAsyncArg<Args>::Type...>(JNIAsyncArg<Args>::store(std::move(v))...)});
+    }
+    
+    //fire-and-forget static void call
+    template<typename... Args>
+    void postStatic(const std::string & className, const std::string & methodName, Args... v)
+    {
+        JNIExecutor::shared().post(JNIAsyncStaticCall<void, Args...>{className, methodName,
+            std::tuple<typename JNIAsyncArg<Args>::Type...>(JNIAsyncArg<Args>::store(std::move(v))...)});
+    }
+    
+#pragma mark Batched Calls
+    
+    //Serializes a recorded argument: primitives as their JNI type in native byte order, strings as an int32 byte count and UTF-8
+    template<typename T, bool PRIMITIVE = std::is_arithmetic<T>::value>
+    struct JNIRecordedArg {
+        static_assert(PRIMITIVE, "Recorded calls only take primitives and strings");
+        inline static void write(std::vector<uint8_t> & buffer, T value) {
+            auto jniValue = CPPToJNIConversor<T>::convert(value);
+            const size_t offset = buffer.size();
+            buffer.resize(offset + sizeof(jniValue));
+            memcpy(&buffer[offset], &jniValue, sizeof(jniValue));
+        }
+    };
+    
+    inline void writeRecordedString(std::vector<uint8_t> & buffer, const char * str, size_t length)
+    {
+        const int32_t size = static_cast<int32_t>(length);
+        const size_t offset = buffer.size();
+        buffer.resize(offset + sizeof(size) + length);
+        memcpy(&buffer[offset], &size, sizeof(size));
+        memcpy(&buffer[offset + sizeof(size)], str, length);
+    }
+    
+    template<>
+    struct JNIRecordedArg<std::string, false> {
+        inline static void write(std::vector<uint8_t> & buffer, const std::string & value) { writeRecordedString(buffer, value.data(), value.size());}
+    };
+    
+    template<>
+    struct JNIRecordedArg<const char *, false> {
+        inline static void write(std::vector<uint8_t> & buffer, const char * value) { writeRecordedString(buffer, value, strlen(value));}
+    };
+    
+    //recorded arguments are taken by reference, so string literals must be mapped back to const char *
+    template<typename T>
+    struct JNIRecordedType {
+        typedef typename std::decay<T>::type Decayed;
+        typedef typename std::conditional<std::is_same<Decayed, char *>::value, const char *, Decayed>::type Type;
+    };
+    
+    template<typename... Args> class RecordedMethod;
+    
+    //Queues static void calls in a native buffer and replays them with a single JNI call to com.safejni.BatchDispatcher.
+    //Pending calls are flushed when maxCalls or maxBytes is reached, maxDelay after the oldest pending one was recorded
+    //(0 disables it), by flush() and when the recorder is destroyed. Calls are replayed in order, exceptions are reported
+    //by the flush (timed and destructor flushes, which have no caller, log them).
+    class CallRecorder {
+    public:
+        explicit CallRecorder(size_t maxCalls = 256, size_t maxBytes = 64 * 1024, std::chrono::milliseconds maxDelay = std::chrono::milliseconds(100));
+        //flushes the pending calls and releases the Java side of the recorder
+        ~CallRecorder();
+        CallRecorder(const CallRecorder &) = delete;
+        CallRecorder & operator=(const CallRecorder &) = delete;
+        
+        static CallRecorder & shared();
+        
+        template<typename... Args>
+        void record(const char * className, const char * methodName, const Args &... args)
+        {
+            append(registerMethod(className, methodName, getJNITypeSignature<void, typename JNIRecordedType<Args>::Type...>()), args...);
+        }
+        
+        //prebound method: registered once, recording skips the method lookup
+        template<typename... Args>
+        RecordedMethod<Args...> method(const char * className, const char * methodName)
+        {
+            return RecordedMethod<Args...>(*this, registerMethod(className, methodName, getJNITypeSignature<void, Args...>()));
+        }
+        
+        void flush();
+        size_t pendingCalls();
+        
+    private:
+        template<typename... Args> friend class RecordedMethod;
+        
+        int32_t registerMethod(const char * className, const char * methodName, const char * signature);
+        //called with recordMutex held when the first pending call is recorded
+        void startTimer();
+        void runTimer();
+        void flushAndLog();
+        
+        template<typename... Args>
+        void append(int32_t method, const Args &... args)
+        {
+            bool full;
+            {
+                std::lock_guard<std::mutex> lock(recordMutex);
+                if (!numCalls) {
+                    firstCall = std::chrono::steady_clock::now();
+                    if (maxDelay.count() > 0) {
+                        startTimer();
+                    }
+                }
+                JNIRecordedArg<int32_t>::write(buffer, method);
+                int expand[] = {0, (JNIRecordedArg<typename JNIRecordedType<Args>::Type>::write(buffer, args), 0)...};
+                (void)expand;
+                ++numCalls;
+                full = numCalls >= maxCalls || buffer.size() >= maxBytes ||
+                       (maxDelay.count() > 0 && std::chrono::steady_clock::now() - firstCall >= maxDelay);
+            }
+            if (full) {
+                flush();
+            }
+        }
+        
+        const jlong recorderId;
+        const size_t maxCalls;
+        const size_t maxBytes;
+        const std::chrono::milliseconds maxDelay;
+        std::mutex recordMutex;
+        //serializes flushes so batches reach Java in order
+        std::mutex flushMutex;
+        std::vector<uint8_t> buffer;
+        std::vector<uint8_t> spareBuffer;
+        size_t numCalls;
+        std::chrono::steady_clock::time_point firstCall;
+        std::unordered_map<std::string, int32_t> methods;
+        //class, name and signature of the methods registered since the last flush
+        std::vector<std::string> newMethods;
+        //the Java side has a method table for this recorder (guarded by flushMutex)
+        bool registered;
+        //flushes the pending calls maxDelay after the first one, started on first use
+        std::thread timer;
+        std::condition_variable timerWake;
+        bool stopping;
+    };
+    
+    template<typename... Args>
+    class RecordedMethod {
+    public:
+        RecordedMethod(CallRecorder & recorder, int32_t method): recorder(&recorder), method(method) {}
+        void operator()(const Args &... args) const { recorder->append(method, args...);}
+    private:
+        CallRecorder * recorder;
+        int32_t method;
+    };
+    
+#pragma mark Warm-up
+    
+    //Class or member resolved ahead of its first call (an empty signature for CLASS)
+    struct WarmUpEntry {
+        enum Kind { CLASS, CONSTRUCTOR, METHOD, STATIC_METHOD, FIELD, STATIC_FIELD };
+        Kind kind;
+        std::string className;
+        std::string name;
+        std::string signature;
+    };
+    
+    //Outcome of one entry: how long the lookup took and, when it failed, why
+    struct WarmUpResult {
+        WarmUpEntry entry;
+        bool resolved;
+        std::chrono::nanoseconds duration;
+        std::string error;
+    };
+    
+    typedef std::function<void(const std::vector<WarmUpResult> &)> WarmUpReport;
+    
+    //Classes and members resolved in one pass into the lookup caches, so the first calls skip FindClass and GetMethodID.
+    //Entries are declared in code, with the signatures derived like the calls derive them:
+    //  safejni::WarmUp warmUp;
+    //  warmUp.constructor<std::string>("com/example/Ninja").method<std::string>("com/example/Ninja", "getName");
+    //or parsed from a manifest, one entry per line ('#' starts a comment):
+    //  class        com/example/Ninja
+    //  constructor  com/example/Ninja (Ljava/lang/String;)V
+    //  method       com/example/Ninja getName ()Ljava/lang/String;
+    //  static       com/example/Ninja create (Ljava/lang/String;)Lcom/example/Ninja;
+    //  field        com/example/Ninja name Ljava/lang/String;
+    //  staticfield  com/example/Ninja COUNT I
+    //A failed entry doesn't stop the others. Without C++ exceptions lookup failures are fatal like everywhere else.
+    class WarmUp {
+    public:
+        WarmUp & addClass(const std::string & className);
+        WarmUp & addConstructor(const std::string & className, const std::string & signature);
+        WarmUp & addMethod(const std::string & className, const std::string & name, const std::string & signature);
+        WarmUp & addStaticMethod(const std::string & className, const std::string & name, const std::string & signature);
+        WarmUp & addField(const std::string & className, const std::string & name, const std::string & signature);
+        WarmUp & addStaticField(const std::string & className, const std::string & name, const std::string & signature);
+        
+        template<typename... Args>
+        WarmUp & constructor(const std::string & className) { return addConstructor(className, getJNITypeSignature<void, Args...>());}
+        template<typename T, typename... Args>
+        WarmUp & method(const std::string & className, const std::string & name) { return addMethod(className, name, getJNITypeSignature<T, Args...>());}
+        template<typename T, typename... Args>
+        WarmUp & staticMethod(const std::string & className, const std::string & name) { return addStaticMethod(className, name, getJNITypeSignature<T, Args...>());}
+        template<typename T>
+        WarmUp & field(const std::string & className, const std::string & name) { return addField(className, name, getJNIFieldSignature<T>());}
+        template<typename T>
+        WarmUp & staticField(const std::string & className, const std::string & name) { return addStaticField(className, name, getJNIFieldSignature<T>());}
+        
+        //Appends the entries of a manifest. On a malformed line nothing is added and error (when given) tells which one.
+        bool parse(const std::string & manifest, std::string * error = nullptr);
+        bool parseFile(const char * path, std::string * error = nullptr);
+        
+        const std::vector<WarmUpEntry> & entries() const { return entryList;}
+        
+        //Resolves every entry on the calling thread
+        std::vector<WarmUpResult> run() const;
+        //Resolves them on a JNIExecutor::shared() worker. Native threads look classes up through the application
+        //ClassLoader (see Utils::setClassLoader), so application classes resolve there too.
+        std::future<std::vector<WarmUpResult>> runAsync() const;
+        
+        //One line per entry with its time, failures first
+        static std::string describe(const std::vector<WarmUpResult> & results);
+        
+    private:
+        std::vector<WarmUpEntry> entryList;
+    };
+    
+    //Initializes SafeJNI and resolves the entries, on a background worker when background is set. report receives the
+    //results (without it the failures are logged).
+    void init(JavaVM * javaVM, JNIEnv * env, const WarmUp & warmUp, bool background = false, WarmUpReport report = nullptr);
+    
+    //Queues the entries for the warm-up run by init (from JNI_OnLoad), or runs it right away when SafeJNI is already initialized:
+    //  static safejni::WarmUpRegistrar warmUp(safejni::WarmUp().method<std::string>("com/example/Ninja", "getName"));
+    class WarmUpRegistrar {
+    public:
+        explicit WarmUpRegistrar(const WarmUp & warmUp, bool background = true, WarmUpReport report = nullptr);
+        //entries from a manifest embedded in the binary, a malformed manifest is logged and ignored
+        explicit WarmUpRegistrar(const char * manifest, bool background = true, WarmUpReport report = nullptr);
+    };
 }
@@ -0,0 +1,482 @@
+/*
+ * SafeJNI is licensed under MIT licensed. See LICENSE.md file for more information.
+ * Copyright (c) 2014 MortimerGoro
+*/
+
+//Host microbenchmarks: SafeJNI calls against the equivalent hand-written JNI, on a desktop JVM started with JNI_CreateJavaVM.
+//  safejni_benchmark [--json results.json] [--filter case] [--min-time ms] [--max-threads n]
+//Every case is measured for 1, 2, 4... threads. The results are printed as a table and written as JSON, one record per
+//case, implementation, size and thread count, with the cost relative to the raw JNI version of the same measurement.
+//The table goes to stderr and the JSON to stdout unless --json is given.
+
+#include <jni.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include "safejni.h"
+
+using std::string;
+using std::vector;
+using namespace safejni;
+
+#define BENCHMARK_CLASS "com/safejni/bench/Benchmark"
+#define POINT_CLASS "com/safejni/bench/Benchmark$Point"
+
+namespace {
+
+    typedef std::chrono::steady_clock Clock;
+
+    //keeps the compiler from dropping the results of the measured calls
+    template <typename T>
+    inline void keep(const T & value)
+    {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    struct Case
+    {
+        string name;
+        string impl;
+        size_t size;
+        //runs the measured operation count times on the calling thread
+        std::function<void(JNIEnv * env, size_t count)> run;
+    };
+
+    struct Result
+    {
+        string name;
+        string impl;
+        size_t size;
+        int threads;
+        uint64_t iterations;
+        double nsPerOp;
+        double relativeToRaw;
+    };
+
+    //Method IDs of the hand-written versions, resolved once like any careful JNI code would
+    struct RawJNI
+    {
+        jclass benchmark;
+        jclass point;
+        jclass string;
+        jclass hashMap;
+        jmethodID add;
+        jmethodID echo;
+        jmethodID echoStrings;
+        jmethodID echoBytes;
+        jmethodID echoMap;
+        jmethodID pointInit;
+        jmethodID pointSum;
+        jmethodID hashMapInit;
+        jmethodID put;
+        jmethodID entrySet;
+        jmethodID iterator;
+        jmethodID hasNext;
+        jmethodID next;
+        jmethodID getKey;
+        jmethodID getValue;
+    };
+
+    RawJNI raw;
+
+    jclass globalClass(JNIEnv * env, const char * name)
+    {
+        jclass local = env->FindClass(name);
+        if (!local) {
+            env->ExceptionDescribe();
+            fprintf(stderr, "Could not find class %s\n", name);
+            exit(1);
+        }
+        jclass global = static_cast<jclass>(env->NewGlobalRef(local));
+        env->DeleteLocalRef(local);
+        return global;
+    }
+
+    void resolveRaw(JNIEnv * env)
+    {
+        raw.benchmark = globalClass(env, BENCHMARK_CLASS);
+        raw.point = globalClass(env, POINT_CLASS);
+        raw.string = globalClass(env, "java/lang/String");
+        raw.hashMap = globalClass(env, "java/util/HashMap");
+        raw.add = env->GetStaticMethodID(raw.benchmark, "add", "(II)I");
+        raw.echo = env->GetStaticMethodID(raw.benchmark, "echo", "(Ljava/lang/String;)Ljava/lang/String;");
+        raw.echoStrings = env->GetStaticMethodID(raw.benchmark, "echoStrings", "([Ljava/lang/String;)[Ljava/lang/String;");
+        raw.echoBytes = env->GetStaticMethodID(raw.benchmark, "echoBytes", "([B)[B");
+        raw.echoMap = env->GetStaticMethodID(raw.benchmark, "echoMap", "(Ljava/util/HashMap;)Ljava/util/HashMap;");
+        raw.pointInit = env->GetMethodID(raw.point, "<init>", "(II)V");
+        raw.pointSum = env->GetMethodID(raw.point, "sum", "()I");
+        raw.hashMapInit = env->GetMethodID(raw.hashMap, "<init>", "(I)V");
+        raw.put = env->GetMethodID(raw.hashMap, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+        jclass map = env->FindClass("java/util/Map");
+        jclass set = env->FindClass("java/util/Set");
+        jclass iterator = env->FindClass("java/util/Iterator");
+        jclass entry = env->FindClass("java/util/Map$Entry");
+        raw.entrySet = env->GetMethodID(map, "entrySet", "()Ljava/util/Set;");
+        raw.iterator = env->GetMethodID(set, "iterator", "()Ljava/util/Iterator;");
+        raw.hasNext = env->GetMethodID(iterator, "hasNext", "()Z");
+        raw.next = env->GetMethodID(iterator, "next", "()Ljava/lang/Object;");
+        raw.getKey = env->GetMethodID(entry, "getKey", "()Ljava/lang/Object;");
+        raw.getValue = env->GetMethodID(entry, "getValue", "()Ljava/lang/Object;");
+        env->DeleteLocalRef(map);
+        env->DeleteLocalRef(set);
+        env->DeleteLocalRef(iterator);
+        env->DeleteLocalRef(entry);
+        if (env->ExceptionCheck()) {
+            env->ExceptionDescribe();
+            exit(1);
+        }
+    }
+
+    string rawString(JNIEnv * env, jstring value)
+    {
+        const char * chars = env->GetStringUTFChars(value, nullptr);
+        string result(chars, env->GetStringUTFLength(value));
+        env->ReleaseStringUTFChars(value, chars);
+        return result;
+    }
+
+    void rawCheck(JNIEnv * env)
+    {
+        if (env->ExceptionCheck()) {
+            env->ExceptionDescribe();
+            exit(1);
+        }
+    }
+
+    vector<Case> createCases()
+    {
+        vector<Case> cases;
+
+        //primitive static call
+        cases.push_back(Case{"primitive", "raw", 0, [](JNIEnv * env, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                jint result = env->CallStaticIntMethod(raw.benchmark, raw.add, jint(i), 1);
+                rawCheck(env);
+                keep(result);
+            }
+        }});
+        cases.push_back(Case{"primitive", "safejni", 0, [](JNIEnv *, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                keep(callStatic<int32_t>(BENCHMARK_CLASS, "add", int32_t(i), 1));
+            }
+        }});
+        StaticMethod<int32_t(int32_t, int32_t)> add(BENCHMARK_CLASS, "add");
+        cases.push_back(Case{"primitive", "safejni-prebound", 0, [add](JNIEnv *, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                keep(add(int32_t(i), 1));
+            }
+        }});
+
+        //primitive instance call
+        JNIObjectPtr point = JNIObject::create(POINT_CLASS, 1, 2);
+        cases.push_back(Case{"instance", "raw", 0, [point](JNIEnv * env, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                jint result = env->CallIntMethod(point->instance, raw.pointSum);
+                rawCheck(env);
+                keep(result);
+            }
+        }});
+        cases.push_back(Case{"instance", "safejni", 0, [point](JNIEnv *, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                keep(call<int32_t>(point->instance, POINT_CLASS, "sum"));
+            }
+        }});
+
+        //object creation: the raw version keeps a global ref like JNIObject does
+        cases.push_back(Case{"create", "raw", 0, [](JNIEnv * env, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                jobject local = env->NewObject(raw.point, raw.pointInit, jint(i), 1);
+                rawCheck(env);
+                jobject global = env->NewGlobalRef(local);
+                env->DeleteLocalRef(local);
+                env->DeleteGlobalRef(global);
+            }
+        }});
+        cases.push_back(Case{"create", "safejni", 0, [](JNIEnv *, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                keep(JNIObject::create(POINT_CLASS, int32_t(i), 1));
+            }
+        }});
+        Constructor<int32_t, int32_t> newPoint(POINT_CLASS);
+        cases.push_back(Case{"create", "safejni-prebound", 0, [newPoint](JNIEnv *, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                keep(newPoint(int32_t(i), 1));
+            }
+        }});
+
+        //string round trip
+        for (size_t size: {16, 1024, 65536}) {
+            string value(size, 'x');
+            cases.push_back(Case{"string", "raw", size, [value](JNIEnv * env, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    jstring arg = env->NewStringUTF(value.c_str());
+                    jstring result = static_cast<jstring>(env->CallStaticObjectMethod(raw.benchmark, raw.echo, arg));
+                    rawCheck(env);
+                    keep(rawString(env, result));
+                    env->DeleteLocalRef(result);
+                    env->DeleteLocalRef(arg);
+                }
+            }});
+            cases.push_back(Case{"string", "safejni", size, [value](JNIEnv *, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    keep(callStatic<string>(BENCHMARK_CLASS, "echo", value));
+                }
+            }});
+        }
+
+        //vector<string> round trip
+        for (size_t size: {8, 256}) {
+            vector<string> values(size, string(32, 'x'));
+            cases.push_back(Case{"vector<string>", "raw", size, [values](JNIEnv * env, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    jobjectArray arg = env->NewObjectArray(static_cast<jsize>(values.size()), raw.string, nullptr);
+                    for (size_t j = 0; j < values.size(); ++j) {
+                        jstring value = env->NewStringUTF(values[j].c_str());
+                        env->SetObjectArrayElement(arg, static_cast<jsize>(j), value);
+                        env->DeleteLocalRef(value);
+                    }
+                    jobjectArray array = static_cast<jobjectArray>(env->CallStaticObjectMethod(raw.benchmark, raw.echoStrings, arg));
+                    rawCheck(env);
+                    vector<string> result(env->GetArrayLength(array));
+                    for (size_t j = 0; j < result.size(); ++j) {
+                        jstring value = static_cast<jstring>(env->GetObjectArrayElement(array, static_cast<jsize>(j)));
+                        result[j] = rawString(env, value);
+                        env->DeleteLocalRef(value);
+                    }
+                    keep(result);
+                    env->DeleteLocalRef(array);
+                    env->DeleteLocalRef(arg);
+                }
+            }});
+            cases.push_back(Case{"vector<string>", "safejni", size, [values](JNIEnv *, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    keep(callStatic<vector<string>>(BENCHMARK_CLASS, "echoStrings", values));
+                }
+            }});
+        }
+
+        //byte[] round trip
+        for (size_t size: {64, 4096, 262144}) {
+            vector<int8_t> values(size, 7);
+            cases.push_back(Case{"byte[]", "raw", size, [values](JNIEnv * env, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    jbyteArray arg = env->NewByteArray(static_cast<jsize>(values.size()));
+                    env->SetByteArrayRegion(arg, 0, static_cast<jsize>(values.size()), values.data());
+                    jbyteArray array = static_cast<jbyteArray>(env->CallStaticObjectMethod(raw.benchmark, raw.echoBytes, arg));
+                    rawCheck(env);
+                    vector<int8_t> result(env->GetArrayLength(array));
+                    env->GetByteArrayRegion(array, 0, static_cast<jsize>(result.size()), result.data());
+                    keep(result);
+                    env->DeleteLocalRef(array);
+                    env->DeleteLocalRef(arg);
+                }
+            }});
+            cases.push_back(Case{"byte[]", "safejni", size, [values](JNIEnv *, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    keep(callStatic<vector<int8_t>>(BENCHMARK_CLASS, "echoBytes", values));
+                }
+            }});
+        }
+
+        //map round trip
+        for (size_t size: {8, 256}) {
+            std::map<string, string> values;
+            for (size_t i = 0; i < size; ++i) {
+                values["key" + std::to_string(i)] = string(16, 'x');
+            }
+            cases.push_back(Case{"map", "raw", size, [values](JNIEnv * env, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    jobject arg = env->NewObject(raw.hashMap, raw.hashMapInit, static_cast<jint>(values.size()));
+                    for (const auto & entry: values) {
+                        jstring key = env->NewStringUTF(entry.first.c_str());
+                        jstring value = env->NewStringUTF(entry.second.c_str());
+                        env->DeleteLocalRef(env->CallObjectMethod(arg, raw.put, key, value));
+                        env->DeleteLocalRef(key);
+                        env->DeleteLocalRef(value);
+                    }
+                    jobject map = env->CallStaticObjectMethod(raw.benchmark, raw.echoMap, arg);
+                    rawCheck(env);
+                    std::map<string, string> result;
+                    jobject entries = env->CallObjectMethod(map, raw.entrySet);
+                    jobject iterator = env->CallObjectMethod(entries, raw.iterator);
+                    while (env->CallBooleanMethod(iterator, raw.hasNext)) {
+                        jobject entry = env->CallObjectMethod(iterator, raw.next);
+                        jstring key = static_cast<jstring>(env->CallObjectMethod(entry, raw.getKey));
+                        jstring value = static_cast<jstring>(env->CallObjectMethod(entry, raw.getValue));
+                        result[rawString(env, key)] = rawString(env, value);
+                        env->DeleteLocalRef(key);
+                        env->DeleteLocalRef(value);
+                        env->DeleteLocalRef(entry);
+                    }
+                    rawCheck(env);
+                    keep(result);
+                    env->DeleteLocalRef(iterator);
+                    env->DeleteLocalRef(entries);
+                    env->DeleteLocalRef(map);
+                    env->DeleteLocalRef(arg);
+                }
+            }});
+            cases.push_back(Case{"map", "safejni", size, [values](JNIEnv *, size_t count) {
+                for (size_t i = 0; i < count; ++i) {
+                    keep(callStatic<std::map<string, string>>(BENCHMARK_CLASS, "echoMap", values));
+                }
+            }});
+        }
+
+        return cases;
+    }
+
+    //Runs the case on every thread at once until minTime has elapsed, the result is the mean time per operation across threads
+    Result measure(const Case & benchmarkCase, int threads, Clock::duration minTime)
+    {
+        const size_t BATCH = 16;
+        std::atomic<int> ready(0);
+        std::atomic<bool> go(false);
+        vector<uint64_t> iterations(threads, 0);
+        vector<double> nanos(threads, 0.0);
+        vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.push_back(std::thread([&, t]() {
+                JNIEnv * env = Utils::getJNIEnvAttach();
+                //warm up the caches and the JIT before the clock starts
+                benchmarkCase.run(env, BATCH);
+                ++ready;
+                while (!go.load()) {
+                    std::this_thread::yield();
+                }
+                uint64_t count = 0;
+                Clock::time_point start = Clock::now();
+                Clock::duration elapsed;
+                do {
+                    benchmarkCase.run(env, BATCH);
+                    count += BATCH;
+                    elapsed = Clock::now() - start;
+                } while (elapsed < minTime);
+                iterations[t] = count;
+                nanos[t] = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            }));
+        }
+        while (ready.load() < threads) {
+            std::this_thread::yield();
+        }
+        go.store(true);
+        for (std::thread & worker: workers) {
+            worker.join();
+        }
+
+        Result result{benchmarkCase.name, benchmarkCase.impl, benchmarkCase.size, threads, 0, 0.0, 1.0};
+        for (int t = 0; t < threads; ++t) {
+            result.iterations += iterations[t];
+            result.nsPerOp += nanos[t] / iterations[t] / threads;
+        }
+        return result;
+    }
+
+    void writeJSON(FILE * file, const string & javaVersion, const vector<Result> & results)
+    {
+        fprintf(file, "{\n  \"javaVersion\": \"%s\",\n  \"results\": [", javaVersion.c_str());
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result & r = results[i];
+            fprintf(file, "%s\n    {\"case\": \"%s\", \"impl\": \"%s\", \"size\": %zu, \"threads\": %d, \"iterations\": %llu, \"nsPerOp\": %.2f, \"relativeToRaw\": %.3f}",
+                    i ? "," : "", r.name.c_str(), r.impl.c_str(), r.size, r.threads, static_cast<unsigned long long>(r.iterations), r.nsPerOp, r.relativeToRaw);
+        }
+        fprintf(file, "\n  ]\n}\n");
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    string classPath = SAFEJNI_BENCHMARK_CLASSPATH;
+    string jsonPath;
+    string filter;
+    int maxThreads = 4;
+    long minTimeMs = 200;
+    for (int i = 1; i < argc; i += 2) {
+        //an option without its value is reported as a usage error
+        string option = i + 1 < argc ? argv[i] : "";
+        if (option == "--json") jsonPath = argv[i + 1];
+        else if (option == "--filter") filter = argv[i + 1];
+        else if (option == "--min-time") minTimeMs = atol(argv[i + 1]);
+        else if (option == "--max-threads") maxThreads = atoi(argv[i + 1]);
+        else if (option == "--classpath") classPath = argv[i + 1];
+        else {
+            fprintf(stderr, "usage: %s [--json file] [--filter case] [--min-time ms] [--max-threads n] [--classpath path]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    string classPathOption = "-Djava.class.path=" + classPath;
+    JavaVMOption options[1];
+    options[0].optionString = const_cast<char*>(classPathOption.c_str());
+    options[0].extraInfo = nullptr;
+    JavaVMInitArgs vmArgs;
+    vmArgs.version = JNI_VERSION_1_6;
+    vmArgs.nOptions = 1;
+    vmArgs.options = options;
+    vmArgs.ignoreUnrecognized = JNI_FALSE;
+
+    JavaVM * vm = nullptr;
+    JNIEnv * env = nullptr;
+    if (JNI_CreateJavaVM(&vm, reinterpret_cast<void**>(&env), &vmArgs) != JNI_OK) {
+        fprintf(stderr, "Could not create the Java VM\n");
+        return 1;
+    }
+    safejni::init(vm, env);
+    resolveRaw(env);
+
+    vector<Result> results;
+    string javaVersion;
+    try {
+        javaVersion = callStatic<string>("java/lang/System", "getProperty", string("java.version"));
+        vector<Case> cases = createCases();
+        fprintf(stderr, "%-16s %-18s %8s %7s %12s %8s\n", "case", "impl", "size", "threads", "ns/op", "vs raw");
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            std::map<string, double> rawTimes;
+            for (const Case & benchmarkCase: cases) {
+                if (!filter.empty() && benchmarkCase.name != filter) {
+                    continue;
+                }
+                Result result = measure(benchmarkCase, threads, std::chrono::milliseconds(minTimeMs));
+                const string key = result.name + "/" + std::to_string(result.size);
+                if (result.impl == "raw") {
+                    rawTimes[key] = result.nsPerOp;
+                }
+                else if (rawTimes.count(key)) {
+                    result.relativeToRaw = result.nsPerOp / rawTimes[key];
+                }
+                fprintf(stderr, "%-16s %-18s %8zu %7d %12.1f %7.2fx\n", result.name.c_str(), result.impl.c_str(), result.size, result.threads, result.nsPerOp, result.relativeToRaw);
+                results.push_back(result);
+            }
+        }
+#ifdef SAFEJNI_ENABLE_STATS
+        fprintf(stderr, "%s", CallStats::dumpText().c_str());
+#endif
+    }
+    catch (const JNIException & e) {
+        fprintf(stderr, "Benchmark failed: %s\n", e.what());
+        return 1;
+    }
+
+    if (!jsonPath.empty()) {
+        FILE * file = fopen(jsonPath.c_str(), "w");
+        if (!file) {
+            fprintf(stderr, "Could not write %s\n", jsonPath.c_str());
+            return 1;
+        }
+        writeJSON(file, javaVersion, results);
+        fclose(file);
+    }
+    else {
+        writeJSON(stdout, javaVersion, results);
+    }
+    //the prebound handles and the cached JNIObjects are gone by now, the VM can be torn down
+    vm->DestroyJavaVM();
+    return 0;
+}
@@ -0,0 +1,48 @@
+package com.safejni.bench;
+
+import java.util.HashMap;
+
+/*
+ * Java side of the SafeJNI host benchmark (test/host/benchmark.cpp).
+ * The methods do as little as possible, so the measurements are dominated by the JNI transitions and the marshalling.
+*/
+public final class Benchmark
+{
+    private Benchmark() {
+    }
+
+    public static int add(int a, int b) {
+        return a + b;
+    }
+
+    public static String echo(String value) {
+        return value;
+    }
+
+    public static String[] echoStrings(String[] values) {
+        return values;
+    }
+
+    public static byte[] echoBytes(byte[] values) {
+        return values;
+    }
+
+    public static HashMap<String, String> echoMap(HashMap<String, String> values) {
+        return values;
+    }
+
+    public static final class Point
+    {
+        private final int x;
+        private final int y;
+
+        public Point(int x, int y) {
+            this.x = x;
+            this.y = y;
+        }
+
+        public int sum() {
+            return x + y;
+        }
+    }
+}
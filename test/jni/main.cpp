@@ -59,6 +59,174 @@ namespace {
         string name = javaObject->call<string>("getName");
         LOGI("Test4: name %s", name.c_str());
     }
+
+    void test5()
+    {
+        //prebound handles resolve the method once and reuse it on every call
+        static StaticMethod<string(string, string)> concat(TEST_STATIC_CLASS, "concat");
+        static Method<string()> getName("com/safejni/test/Ninja", "getName");
+
+        string result = concat("Prebound ", "handles!");
+        LOGI("Test5: %s", result.c_str());
+
+        SPJNIObject javaObject = JNIObject::create("com/safejni/test/Ninja", "Raiden");
+        string name = getName(javaObject);
+        LOGI("Test5: name %s", name.c_str());
+    }
+
+    void test6()
+    {
+        //field handles resolve the field ID once
+        static Field<string> nameField("com/safejni/test/Ninja", "name");
+
+        SPJNIObject javaObject = JNIObject::create("com/safejni/test/Ninja", "Sub-Zero");
+        nameField.set(javaObject, "Scorpion");
+        LOGI("Test6: name %s", nameField.get(javaObject).c_str());
+    }
+
+    void test7()
+    {
+        //the returned byte[] is accessed in place instead of being copied into a vector
+        vector<uint8_t> bytes = {1, 2, 3, 4};
+        int valueToAdd = 10;
+        JNIArrayView<uint8_t> view = safejni::callStatic<JNIArrayView<uint8_t>>(TEST_STATIC_CLASS, "add", bytes, valueToAdd);
+
+        for (uint8_t & byte: view) {
+            LOGI("Test7: Byte %d", byte);
+            byte *= 2;
+        }
+        int32_t sum = safejni::callStatic<int32_t>(TEST_STATIC_CLASS, "sum", std::move(view));
+        LOGI("Test7: SUM %d", sum);
+    }
+
+    void test8()
+    {
+        //Java exceptions are thrown as JNIException by default
+        try {
+            safejni::callStatic<int32_t>("java/lang/Integer", "parseInt", "SafeJNI");
+        }
+        catch (const JNIException & e) {
+            LOGI("Test8: caught %s", e.what());
+        }
+
+        //or kept as the pending exception of the thread
+        ExceptionScope scope(ExceptionPolicy::RETURN);
+        int32_t value = safejni::callStatic<int32_t>("java/lang/Integer", "parseInt", "NaN");
+        std::unique_ptr<JNIException> pending = Utils::takePendingException();
+        LOGI("Test8: returned %d, pending %s", value, pending ? pending->className().c_str() : "none");
+    }
+
+    void test9()
+    {
+        //C++ functions handed to Java as a Runnable
+        int counter = 0;
+        jobject runnable = safejni::toRunnable([&counter]() { ++counter; });
+        safejni::call<void>(runnable, "java/lang/Runnable", "run");
+        safejni::call<void>(runnable, "java/lang/Runnable", "run");
+        safejni::call<void>(runnable, "java/io/Closeable", "close");
+        Utils::getJNIEnv()->DeleteLocalRef(runnable);
+        LOGI("Test9: runnable called %d times", counter);
+    }
+
+    void test10()
+    {
+        //the call runs on an executor thread attached to the VM
+        std::future<string> result = safejni::callStaticAsync<string>(TEST_STATIC_CLASS, "concat", "Async ", "call!");
+        LOGI("Test10: %s", result.get().c_str());
+    }
+
+    void test11()
+    {
+        //the constructor is resolved once, each object costs one NewObject
+        static Constructor<string> newNinja("com/safejni/test/Ninja");
+        for (const char * name: {"Kitana", "Mileena"}) {
+            JNIObjectPtr ninja = newNinja(name);
+            LOGI("Test11: %s is a %s", ninja->call<string>("getName").c_str(), ninja->className().c_str());
+        }
+    }
+
+    void test12()
+    {
+        //weak objects don't keep the Java object alive, calls promote them
+        SPJNIObject ninja = JNIObject::create("com/safejni/test/Ninja", "Jax");
+        SPJNIObject weakNinja = JNIObject::createWeak(ninja->instance, "com/safejni/test/Ninja", SAFEJNI_REF_SITE);
+        LOGI("Test12: weak %s", weakNinja->call<string>("getName").c_str());
+        for (const auto & site: References::siteStats()) {
+            LOGI("Test12: %d refs created at %s", (int)site.second, site.first.c_str());
+        }
+
+        RefStats stats = References::stats();
+        LOGI("Test12: %d global refs, %d weak refs, %d Ninja refs", (int)stats.globalRefs, (int)stats.weakRefs,
+             (int)ninja->getClassInfo()->liveRefs.load());
+    }
+
+    SAFEJNI_JAVA_CLASS(NinjaClass, "com/safejni/test/Ninja");
+
+    void test13()
+    {
+        //the signature is (Lcom/safejni/test/Ninja;Ljava/lang/String;)Lcom/safejni/test/Ninja;
+        JavaObject<NinjaClass> ninja = JavaObject<NinjaClass>::create("Solid");
+        JavaObject<NinjaClass> renamed = safejni::callStatic<JavaObject<NinjaClass>>(TEST_STATIC_CLASS, "rename", ninja, "Snake");
+        LOGI("Test13: %s", renamed.call<string>("getName").c_str());
+    }
+
+    void test14()
+    {
+        WarmUp warmUp;
+        warmUp.constructor<string>("com/safejni/test/Ninja").method<string>("com/safejni/test/Ninja", "getName");
+        //reported as a failure, the other entries still resolve
+        warmUp.method<void>("com/safejni/test/Ninja", "missing");
+        LOGI("Test14:\n%s", WarmUp::describe(warmUp.run()).c_str());
+    }
+
+    void test15()
+    {
+        //passed without a temporary vector: sum(byte[]) receives the first 3 bytes of the buffer
+        const uint8_t buffer[] = {10, 20, 30, 40};
+        int sum = safejni::callStatic<int>(TEST_STATIC_CLASS, "sum", Span<uint8_t>(buffer, 3));
+        LOGI("Test15: %d", sum);
+    }
+
+    void test16()
+    {
+        //a failed conversion returns an empty map and keeps the exception, both with and without the packed transfer
+        ExceptionScope scope(ExceptionPolicy::RETURN);
+        for (int32_t size: {4, 64}) {
+            std::map<string, string> map = safejni::callStatic<std::map<string, string>>(TEST_STATIC_CLASS, "brokenMap", size);
+            std::unique_ptr<JNIException> pending = Utils::takePendingException();
+            LOGI("Test16: %d entries, %zu read, pending %s", size, map.size(), pending ? pending->className().c_str() : "none");
+        }
+    }
+
+    void test17()
+    {
+        //each element is a local ref released with its frame, at most 2 are alive at once
+        jobjectArray names = static_cast<jobjectArray>(safejni::callStatic<jobject>(TEST_STATIC_CLASS, "toUpper", std::vector<string>{"scorpion", "sub-zero", "raiden"}));
+        safejni::forEachElement(names, [](size_t i, jobject name) {
+            LOGI("Test17: %d %s", (int)i, Utils::toString(static_cast<jstring>(name)).c_str());
+        }, 2);
+        Utils::getJNIEnv()->DeleteLocalRef(names);
+    }
+
+    void runTests(JNIThis activity)
+    {
+        void (*tests[])() = {test1, test2, test3, test4, test5, test6, test7, test8, test9, test10, test11, test12, test13, test14, test15, test16, test17};
+
+        for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+            LOGI("About to run Test%d", (int)i + 1);
+            tests[i]();
+        }
+    }
+
+    //registered by safejni::init from JNI_OnLoad
+    NativeRegistrar registrar(TEST_STATIC_CLASS, {
+        SAFEJNI_NATIVE("runTests", runTests)
+    });
+
+    //resolved on a background worker once safejni::init runs, failures are logged
+    WarmUpRegistrar warmUp(
+        "class  com/safejni/test/Ninja\n"
+        "static com/safejni/test/TestActivity rename (Lcom/safejni/test/Ninja;Ljava/lang/String;)Lcom/safejni/test/Ninja;\n");
     
 
 
@@ -78,15 +246,4 @@ extern "C"
         return JNI_VERSION_1_6;
     }  
 
-    void Java_com_safejni_test_TestActivity_runTests(JNIEnv * env, jobject thiz)
-    {
-        void (*tests[])() = {test1, test2, test3, test4};
-
-        for (int i = 0; i < 4; ++i) {
-            LOGI("About to run Test%d", i + 1);
-            tests[i]();
-        }
-    }
-
-
-}
\ No newline at end of file
+}
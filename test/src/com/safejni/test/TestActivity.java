@@ -11,6 +11,10 @@ import android.view.View;
 import android.view.ViewGroup;
 import android.os.Build;
 
+import java.util.HashMap;
+import java.util.Map;
+import java.util.Set;
+
 public class TestActivity extends Activity {
 
 	@Override
@@ -59,6 +63,27 @@ public class TestActivity extends Activity {
 		return result;
 	}
 	
+	//called by native
+	public static Ninja rename(Ninja ninja, String name)
+	{
+		return new Ninja(ninja.getName() + " " + name);
+	}
+	
+	//called by native: a map that fails while it is read (packed through PackedStrings.packMap or entry by entry)
+	public static HashMap<String, String> brokenMap(int size)
+	{
+		HashMap<String, String> result = new HashMap<String, String>() {
+			@Override
+			public Set<Map.Entry<String, String>> entrySet() {
+				throw new IllegalStateException("broken map");
+			}
+		};
+		for (int i = 0; i < size; ++i) {
+			result.put("key" + i, "value" + i);
+		}
+		return result;
+	}
+	
 	
 	private native void runTests();
 
@@ -0,0 +1,451 @@
+#!/usr/bin/env python3
+#
+# SafeJNI is licensed under MIT licensed. See LICENSE.md file for more information.
+# Copyright (c) 2014 MortimerGoro
+#
+"""Generates C++ proxy classes for Java classes, on top of SafeJNI.
+
+Reads compiled classes (.class files, directories or jars) and writes a header with one C++ class per Java class
+and one typed method per Java method, constructor and field:
+
+    tools/safejni_proxygen.py -o jni/proxies.h --class com/example/Images bin/classes.jar
+
+    jni::com::example::Images images = jni::com::example::Images::create(path);
+    int32_t width = images.getWidth();
+
+Every method and field ID of a class is resolved in one batch the first time the proxy is used, so calls go
+straight to JNI without any name or signature handling. Regenerate the header when the Java classes change:
+a changed signature breaks the C++ build instead of throwing a JNIException at runtime.
+
+Java types map to the C++ types SafeJNI converts: primitives (char as uint8_t, like SafeJNI does), String as
+std::string, primitive and String arrays as std::vector. Other classes get a SAFEJNI_JAVA_CLASS tag in the
+<namespace>::classes namespace and are passed and returned as safejni::JavaObject<tag>, so passing an object of
+the wrong class does not compile (proxies convert to and from the JavaObject of their class). Object and other
+arrays stay untyped safejni::JNIObjectPtr. Only the members declared by each class are generated (not the
+inherited ones).
+"""
+
+import argparse
+import os
+import struct
+import sys
+import zipfile
+
+ACC_PUBLIC = 0x0001
+ACC_PRIVATE = 0x0002
+ACC_STATIC = 0x0008
+ACC_FINAL = 0x0010
+ACC_BRIDGE = 0x0040
+ACC_SYNTHETIC = 0x1000
+
+PRIMITIVES = {
+    'V': 'void',
+    'Z': 'bool',
+    'B': 'int8_t',
+    'C': 'uint8_t',
+    'S': 'int16_t',
+    'I': 'int32_t',
+    'J': 'int64_t',
+    'F': 'float',
+    'D': 'double',
+}
+
+ARRAYS = {
+    '[Z': 'std::vector<bool>',
+    '[B': 'std::vector<int8_t>',
+    '[C': 'std::vector<uint16_t>',
+    '[S': 'std::vector<int16_t>',
+    '[I': 'std::vector<int32_t>',
+    '[J': 'std::vector<int64_t>',
+    '[F': 'std::vector<float>',
+    '[D': 'std::vector<double>',
+    '[Ljava/lang/String;': 'std::vector<std::string>',
+}
+
+CPP_KEYWORDS = set("""
+    alignas alignof and and_eq asm auto bitand bitor bool break case catch char char16_t char32_t class compl const
+    constexpr const_cast continue decltype default delete do double dynamic_cast else enum explicit export extern false
+    float for friend goto if inline int long mutable namespace new noexcept not not_eq nullptr operator or or_eq private
+    protected public register reinterpret_cast return short signed sizeof static static_assert static_cast struct switch
+    template this thread_local throw true try typedef typeid typename union unsigned using virtual void volatile wchar_t
+    while xor xor_eq ptr create className members resolve object withInstance
+""".split())
+
+# longest class name SAFEJNI_JAVA_CLASS accepts
+MAX_TAGGED_NAME = 128
+
+
+class ClassFileError(Exception):
+    pass
+
+
+class Member(object):
+    def __init__(self, access, name, descriptor):
+        self.access = access
+        self.name = name
+        self.descriptor = descriptor
+
+    @property
+    def static(self):
+        return bool(self.access & ACC_STATIC)
+
+
+class JavaClass(object):
+    def __init__(self, name, access, fields, methods):
+        self.name = name
+        self.access = access
+        self.fields = fields
+        self.methods = methods
+
+
+def parse_class(data):
+    """Parses the parts of a class file the generator needs: name, fields and methods."""
+    if len(data) < 10 or struct.unpack_from('>I', data, 0)[0] != 0xCAFEBABE:
+        raise ClassFileError('not a class file')
+    offset = 8
+    count = struct.unpack_from('>H', data, offset)[0]
+    offset += 2
+    utf8 = {}
+    classes = {}
+    index = 1
+    while index < count:
+        tag = data[offset]
+        offset += 1
+        if tag == 1:
+            length = struct.unpack_from('>H', data, offset)[0]
+            utf8[index] = data[offset + 2:offset + 2 + length].decode('utf-8', 'replace')
+            offset += 2 + length
+        elif tag == 7:
+            classes[index] = struct.unpack_from('>H', data, offset)[0]
+            offset += 2
+        elif tag in (8, 16, 19, 20):
+            offset += 2
+        elif tag == 15:
+            offset += 3
+        elif tag in (3, 4, 9, 10, 11, 12, 17, 18):
+            offset += 4
+        elif tag in (5, 6):
+            offset += 8
+            # longs and doubles take two constant pool slots
+            index += 1
+        else:
+            raise ClassFileError('unknown constant pool tag %d' % tag)
+        index += 1
+
+    access, this_class = struct.unpack_from('>HH', data, offset)
+    offset += 6
+    interfaces = struct.unpack_from('>H', data, offset)[0]
+    offset += 2 + 2 * interfaces
+
+    def members():
+        nonlocal offset
+        result = []
+        count = struct.unpack_from('>H', data, offset)[0]
+        offset += 2
+        for _ in range(count):
+            member_access, name, descriptor, attributes = struct.unpack_from('>HHHH', data, offset)
+            offset += 8
+            for _ in range(attributes):
+                length = struct.unpack_from('>I', data, offset + 2)[0]
+                offset += 6 + length
+            result.append(Member(member_access, utf8[name], utf8[descriptor]))
+        return result
+
+    fields = members()
+    methods = members()
+    return JavaClass(utf8[classes[this_class]], access, fields, methods)
+
+
+def read_classes(paths):
+    """Yields the class file contents of every .class file, directory or jar given."""
+    for path in paths:
+        if os.path.isdir(path):
+            for root, _, files in os.walk(path):
+                for name in sorted(files):
+                    if name.endswith('.class'):
+                        with open(os.path.join(root, name), 'rb') as f:
+                            yield f.read()
+        elif zipfile.is_zipfile(path):
+            with zipfile.ZipFile(path) as jar:
+                for name in sorted(jar.namelist()):
+                    if name.endswith('.class') and not name.startswith('META-INF/'):
+                        yield jar.read(name)
+        else:
+            with open(path, 'rb') as f:
+                yield f.read()
+
+
+def split_descriptor(descriptor):
+    """Returns the parameter descriptors and the return descriptor of a method descriptor."""
+    params = []
+    i = 1
+    while descriptor[i] != ')':
+        start = i
+        while descriptor[i] == '[':
+            i += 1
+        if descriptor[i] == 'L':
+            i = descriptor.index(';', i)
+        i += 1
+        params.append(descriptor[start:i])
+    return params, descriptor[i + 1:]
+
+
+def tagged_class(descriptor):
+    """Internal name of the class a descriptor is typed as, None for primitives, strings, arrays and Object."""
+    if not descriptor.startswith('L') or descriptor in ('Ljava/lang/String;', 'Ljava/lang/Object;'):
+        return None
+    name = descriptor[1:-1]
+    return name if len(name) <= MAX_TAGGED_NAME else None
+
+
+def tag_name(class_name):
+    return identifier(class_name.replace('/', '_').replace('$', '_'))
+
+
+def return_type(descriptor, namespace):
+    if descriptor in PRIMITIVES:
+        return PRIMITIVES[descriptor]
+    if descriptor == 'Ljava/lang/String;':
+        return 'std::string'
+    if descriptor in ARRAYS:
+        return ARRAYS[descriptor]
+    tagged = tagged_class(descriptor)
+    if tagged:
+        return '::safejni::JavaObject<::%s::classes::%s>' % (namespace, tag_name(tagged))
+    return '::safejni::JNIObjectPtr'
+
+
+def param_type(descriptor, namespace):
+    if descriptor in PRIMITIVES:
+        return PRIMITIVES[descriptor]
+    return 'const %s &' % return_type(descriptor, namespace)
+
+
+def identifier(name):
+    name = ''.join(c if c.isalnum() or c == '_' else '_' for c in name)
+    if name in CPP_KEYWORDS or name[0].isdigit():
+        name += '_'
+    return name
+
+
+def generated(member, include_private):
+    if member.access & (ACC_SYNTHETIC | ACC_BRIDGE):
+        return False
+    return include_private or not member.access & ACC_PRIVATE
+
+
+class ProxyWriter(object):
+    def __init__(self, java_class, namespace, include_private):
+        self.java_class = java_class
+        self.namespace = namespace
+        self.package, _, simple_name = java_class.name.rpartition('/')
+        self.cpp_name = identifier(simple_name.replace('$', '_'))
+        self.fields = [f for f in java_class.fields if generated(f, include_private)]
+        self.methods = [m for m in java_class.methods if generated(m, include_private) and m.name != '<clinit>']
+        # abstract classes and interfaces have no create()
+        if java_class.access & 0x0600:
+            self.methods = [m for m in self.methods if m.name != '<init>']
+        self.ids = {}
+        used = set()
+        for member in self.fields + self.methods:
+            base = 'init' if member.name == '<init>' else identifier(member.name)
+            name = base
+            suffix = 1
+            while name in used:
+                suffix += 1
+                name = '%s%d' % (base, suffix)
+            used.add(name)
+            self.ids[id(member)] = name
+
+    def tagged_classes(self):
+        """Classes that need a tag: the class itself and the classes its generated members use."""
+        descriptors = ['L%s;' % self.java_class.name] + [f.descriptor for f in self.fields]
+        for method in self.methods:
+            params, result = split_descriptor(method.descriptor)
+            descriptors += params + [result]
+        return set(filter(None, (tagged_class(d) for d in descriptors)))
+
+    def write(self, out):
+        namespaces = [identifier(p) for p in self.package.split('/')] if self.package else []
+        for namespace in namespaces:
+            out.append('namespace %s {\n' % namespace)
+        out.append('\n')
+        out.append('    // %s\n' % self.java_class.name.replace('/', '.'))
+        out.append('    class %s {\n' % self.cpp_name)
+        out.append('    public:\n')
+        out.append('        %s() {}\n' % self.cpp_name)
+        out.append('        explicit %s(::safejni::JNIObjectPtr object): object(std::move(object)) {}\n' % self.cpp_name)
+        typed = return_type('L%s;' % self.java_class.name, self.namespace)
+        if tagged_class('L%s;' % self.java_class.name):
+            out.append('        %s(const %s & typed): object(typed.ptr()) {}\n' % (self.cpp_name, typed))
+            out.append('        inline operator %s() const { return %s(object);}\n' % (typed, typed))
+        out.append('\n')
+        out.append('        static inline const char * className() { return "%s";}\n' % self.java_class.name)
+        out.append('        inline const ::safejni::JNIObjectPtr & ptr() const { return object;}\n')
+        out.append('        explicit inline operator bool() const { return object != nullptr;}\n')
+        out.append('        //calls f with a ref usable as the object: weak objects are promoted for the duration of f and\n')
+        out.append('        //throw when collected, an empty proxy passes nullptr\n')
+        out.append('        template<typename F>\n')
+        out.append('        auto withInstance(F && f) const -> decltype(f(jobject()))\n')
+        out.append('        {\n')
+        out.append('            return object ? object->withInstance(std::forward<F>(f)) : f(nullptr);\n')
+        out.append('        }\n')
+
+        signatures = set()
+        for method in self.methods:
+            self.write_method(out, method, signatures)
+        for field in self.fields:
+            self.write_field(out, field)
+
+        out.append('\n')
+        out.append('        //every member of the class, resolved in one batch on first use\n')
+        out.append('        struct Members {\n')
+        out.append('            const ::safejni::JNIClassInfo * classInfo;\n')
+        for member in self.methods:
+            out.append('            const ::safejni::JNIMethodInfo * %s;\n' % self.ids[id(member)])
+        for member in self.fields:
+            out.append('            const ::safejni::JNIFieldInfo * %s;\n' % self.ids[id(member)])
+        out.append('        };\n')
+        out.append('\n')
+        out.append('        static const Members & members()\n')
+        out.append('        {\n')
+        out.append('            static const Members resolved = resolve();\n')
+        out.append('            return resolved;\n')
+        out.append('        }\n')
+        out.append('\n')
+        out.append('    private:\n')
+        out.append('        static Members resolve()\n')
+        out.append('        {\n')
+        out.append('            Members result;\n')
+        out.append('            result.classInfo = &::safejni::Utils::findClassInfo(className());\n')
+        for member in self.methods:
+            lookup = 'findStaticMethod' if member.static else 'findMethod'
+            out.append('            result.%s = &::safejni::Utils::%s(className(), "%s", "%s");\n' % (self.ids[id(member)], lookup, member.name, member.descriptor))
+        for member in self.fields:
+            lookup = 'findStaticField' if member.static else 'findField'
+            out.append('            result.%s = &::safejni::Utils::%s(className(), "%s", "%s");\n' % (self.ids[id(member)], lookup, member.name, member.descriptor))
+        out.append('            return result;\n')
+        out.append('        }\n')
+        out.append('\n')
+        out.append('        ::safejni::JNIObjectPtr object;\n')
+        out.append('    };\n')
+        out.append('\n')
+        out.append('%s\n' % ''.join('}' for _ in namespaces) if namespaces else '')
+
+    def write_method(self, out, method, signatures):
+        params, result = split_descriptor(method.descriptor)
+        types = [param_type(p, self.namespace) for p in params]
+        args = ', '.join('a%d' % i for i in range(len(params)))
+        declaration = ', '.join('%s a%d' % (t, i) for i, t in enumerate(types))
+        member = 'members().%s' % self.ids[id(method)]
+        if method.name == '<init>':
+            name = 'create'
+            cpp_result = self.cpp_name
+            body = 'return %s(::safejni::JNIObject::construct(*members().classInfo, *%s%s));' % (self.cpp_name, member, ', ' + args if args else '')
+            qualifier = 'static '
+            const = ''
+        else:
+            name = identifier(method.name)
+            cpp_result = return_type(result, self.namespace)
+            template = '' if cpp_result == 'void' else '<%s>' % cpp_result
+            if method.static:
+                body = '::safejni::callStatic%s(*%s%s)' % (template, member, ', ' + args if args else '')
+                qualifier = 'static '
+                const = ''
+            else:
+                body = 'withInstance([&](jobject instance) { return ::safejni::call%s(instance, *%s%s); })' % (template, member, ', ' + args if args else '')
+                qualifier = ''
+                const = ' const'
+            # objects of the proxied class itself come back wrapped in the proxy (factories, builders)
+            if result == 'L%s;' % self.java_class.name:
+                cpp_result = self.cpp_name
+                body = '%s(%s)' % (self.cpp_name, body)
+            body = 'return %s;' % body
+        # Java overloads that map to the same C++ parameters (e.g. two object array types) get a numbered name
+        key = (name, tuple(types))
+        if key in signatures:
+            name = self.ids[id(method)]
+            key = (name, tuple(types))
+        signatures.add(key)
+        out.append('\n')
+        kind = 'constructor' if method.name == '<init>' else 'static' if method.static else 'instance'
+        out.append('        // %s %s%s\n' % (kind, method.name, method.descriptor))
+        out.append('        %s%s %s(%s)%s\n' % (qualifier, cpp_result, name, declaration, const))
+        out.append('        {\n')
+        out.append('            %s\n' % body)
+        out.append('        }\n')
+
+    def write_field(self, out, field):
+        cpp_type = return_type(field.descriptor, self.namespace)
+        value_type = param_type(field.descriptor, self.namespace)
+        set_type = cpp_type
+        name = self.ids[id(field)]
+        member = '*members().%s' % name
+        out.append('\n')
+        out.append('        // %s field %s %s\n' % ('static' if field.static else 'instance', field.name, field.descriptor))
+        if field.static:
+            out.append('        static %s get_%s() { return ::safejni::getStaticField<%s>(%s);}\n' % (cpp_type, name, cpp_type, member))
+            if not field.access & ACC_FINAL:
+                out.append('        static void set_%s(%s value) { ::safejni::setStaticField<%s>(%s, value);}\n' % (name, value_type, set_type, member))
+        else:
+            out.append('        %s get_%s() const { return withInstance([](jobject instance) { return ::safejni::getField<%s>(instance, %s);});}\n' % (cpp_type, name, cpp_type, member))
+            if not field.access & ACC_FINAL:
+                out.append('        void set_%s(%s value) const { withInstance([&](jobject instance) { ::safejni::setField<%s>(instance, %s, value);});}\n' % (name, value_type, set_type, member))
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description='Generates SafeJNI C++ proxies from compiled Java classes.')
+    parser.add_argument('inputs', nargs='+', help='.class files, class directories or jars')
+    parser.add_argument('-o', '--output', required=True, help='header to write')
+    parser.add_argument('--class', dest='classes', action='append', default=[], help='internal name of a class to generate (com/example/Foo), repeatable')
+    parser.add_argument('--package', dest='packages', action='append', default=[], help='generate every class of a package (com/example), repeatable')
+    parser.add_argument('--namespace', default='jni', help='root C++ namespace of the proxies (default: jni)')
+    parser.add_argument('--include-private', action='store_true', help='also generate private members')
+    args = parser.parse_args(argv)
+
+    wanted = set(c.replace('.', '/') for c in args.classes)
+    packages = [p.replace('.', '/').rstrip('/') + '/' for p in args.packages]
+    classes = []
+    for data in read_classes(args.inputs):
+        try:
+            java_class = parse_class(data)
+        except (ClassFileError, struct.error, KeyError, IndexError) as e:
+            sys.stderr.write('skipping an unreadable class file: %s\n' % e)
+            continue
+        if (wanted or packages) and java_class.name not in wanted and not any(java_class.name.startswith(p) for p in packages):
+            continue
+        classes.append(java_class)
+    missing = wanted - set(c.name for c in classes)
+    if missing:
+        sys.stderr.write('classes not found: %s\n' % ', '.join(sorted(missing)))
+        return 1
+
+    out = ['// Generated by tools/safejni_proxygen.py, do not edit.\n',
+           '// Regenerate it when the Java classes change.\n',
+           '\n',
+           '#pragma once\n',
+           '\n',
+           '#include "safejni.h"\n',
+           '\n',
+           'namespace %s {\n' % args.namespace]
+    writers = [ProxyWriter(c, args.namespace, args.include_private) for c in sorted(classes, key=lambda c: c.name)]
+    tagged = sorted(set().union(*(w.tagged_classes() for w in writers)))
+    if tagged:
+        out.append('namespace classes {\n')
+        for name in tagged:
+            out.append('    SAFEJNI_JAVA_CLASS(%s, "%s");\n' % (tag_name(name), name))
+        out.append('}\n')
+    for writer in writers:
+        writer.write(out)
+    out.append('\n}\n')
+
+    directory = os.path.dirname(args.output)
+    if directory and not os.path.isdir(directory):
+        os.makedirs(directory)
+    with open(args.output, 'w') as f:
+        f.write(''.join(out))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))